@@ -26,7 +26,9 @@
 #include <net/ethernet.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 #include <sys/select.h>
 #include <sys/types.h>
@@ -39,6 +41,34 @@
 #define ALFRED_SERVER_TIMEOUT		60
 #define ALFRED_DATA_TIMEOUT		600
 #define ALFRED_SOCK_PATH_DEFAULT	"/var/run/alfred.sock"
+#define ALFRED_COMPRESS_MIN_SIZE	1024
+#define ALFRED_COMPRESS_IDLE_TIME	60
+#define ALFRED_DELTA_MIN_SIZE		1024
+#define ALFRED_COMPRESS_SYNC_RATIO	4
+#define ALFRED_SNAPSHOT_INTERVAL	60
+#define ALFRED_MAX_DATASET_SIZE		(16 * 1024 * 1024)
+#define ALFRED_UNIX_TIMEOUT		2
+#define ALFRED_SOCKBUF_SIZE		(2 * 1024 * 1024)
+#define ALFRED_IPV6_MIN_MTU		1280
+#define ALFRED_OWN_CAPS			(ALFRED_CAP_CHUNK | ALFRED_CAP_NACK | \
+					 ALFRED_CAP_FEC | ALFRED_CAP_ACK | \
+					 ALFRED_CAP_MERKLE | ALFRED_CAP_GOSSIP | \
+					 ALFRED_CAP_MCAST_SYNC | ALFRED_CAP_REFRESH | \
+					 ALFRED_CAP_DELTA | ALFRED_CAP_COMPRESS | \
+					 ALFRED_CAP_REQUEST_DIGEST)
+#define ALFRED_FULL_SYNC_INTERVAL	60
+#define ALFRED_NACK_RETRIES		3
+#define ALFRED_RETRANSMIT_TIMEOUT	ALFRED_REQUEST_TIMEOUT
+#define ALFRED_RETRANSMIT_MAX_SIZE	(4 * 1024 * 1024)
+#define ALFRED_MAX_TRANSACTIONS		256
+#define ALFRED_MAX_PEER_TRANSACTIONS	16
+#define ALFRED_MAX_TX_PACKETS		UINT16_MAX
+#define ALFRED_HEDGE_SERVERS		3
+#define ALFRED_LATENCY_SAMPLES		128
+#define ALFRED_TX_MEM_LIMIT		(64 * 1024 * 1024)
+#define ALFRED_TX_PEER_MEM_LIMIT	(32 * 1024 * 1024)
+#define ALFRED_FEC_OVERHEAD		(sizeof(struct alfred_parity_v0) - \
+					 sizeof(struct alfred_push_data_v0))
 #define NO_FILTER			-1
 
 enum data_source {
@@ -47,34 +77,191 @@ enum data_source {
 	SOURCE_SYNCED = 2,
 };
 
+/**
+ * struct payload - content addressed data body shared by datasets
+ * @digest: digest over the content
+ * @length: length of the content
+ * @zlength: length of the compressed content, 0 if not compressed
+ * @flags: PAYLOAD_* flags
+ * @refcount: number of datasets using this payload
+ * @plain_users: datasets using this payload whose data type is not kept
+ *  compressed
+ * @last_read: time of the last read on behalf of a client
+ * @buf: the content
+ */
+struct payload {
+	uint64_t digest;
+	uint32_t length;
+	uint32_t zlength;
+	uint8_t flags;
+	unsigned int refcount;
+	unsigned int plain_users;
+	struct timespec last_read;
+	uint8_t *buf;
+};
+
+enum payload_flags {
+	PAYLOAD_SNAPSHOT = 1 << 0,	/* allocated with the snapshot */
+	PAYLOAD_MAPPED = 1 << 1,	/* buf points into the snapshot file */
+};
+
 struct dataset {
 	struct alfred_data data;
-	unsigned char *buf;
+	struct payload *payload;
 
 	struct timespec last_seen;
 	enum data_source data_source;
 	uint8_t local_data;
+	uint8_t from_snapshot;
+
+	uint32_t revision;
+	struct timespec changed;
+	struct list_head history;	/* struct history_entry, newest first */
+	uint32_t change_seq;		/* globals->change_seq of last change */
+	uint64_t digest;		/* see merkle.c, 0 without payload */
+	struct payload *base;		/* previous payload for deltas */
+	uint32_t base_seq;		/* change_seq while base was current */
+
+	struct list_head lru;
 };
 
-struct changed_data_type {
-	uint8_t data_type;
+/**
+ * struct history_entry - previous version of a dataset
+ * @revision: revision of the dataset while it had this content
+ * @version: data version of the content
+ * @raw: data holds the plain content instead of a delta
+ * @changed: time the content was stored
+ * @length: length of the plain content
+ * @delta_len: length of data
+ * @list: list node in dataset->history
+ * @data: delta (see delta.c) of the content against the next newer version
+ */
+struct history_entry {
+	uint32_t revision;
+	uint8_t version;
+	uint8_t raw;
+	struct timespec changed;
+	uint32_t length;
+	uint32_t delta_len;
 	struct list_head list;
+	uint8_t data[];
+};
+
+struct compress_policy {
+	uint8_t enabled;
+	uint16_t min_size;
+	uint16_t idle_time;
+};
+
+/**
+ * struct type_policy - handling of a data type
+ * @timeout: seconds after which a dataset expires without refresh
+ * @max_size: largest accepted payload
+ * @priority: datasets of higher priority are pushed first
+ * @sync: whether the data type is synchronized between masters
+ */
+struct type_policy {
+	uint32_t timeout;
+	uint32_t max_size;
+	uint8_t priority;
+	uint8_t sync;
 };
 
-struct transaction_packet {
-	struct alfred_push_data_v0 *push;
+struct datastore_account {
+	size_t datasets;
+	size_t payloads;
+	size_t payload_bytes;
+	size_t mem_used;
+	size_t dedup_saved;
+	size_t compressed;
+	size_t compress_saved;
+	size_t compress_shared;		/* shared with uncompressed types */
+	size_t compress_shared_bytes;
+	size_t history_entries;
+	size_t history_bytes;
+	uint32_t evicted;
+};
+
+/**
+ * struct snapshot - state loaded from the snapshot file
+ * @map: read-only mapping of the snapshot file
+ * @map_len: length of the mapping
+ * @datasets: datasets of all records, allocated at once
+ * @payloads: payloads of all records, allocated at once
+ * @refs: datasets and payloads still in use
+ */
+struct snapshot {
+	void *map;
+	size_t map_len;
+	struct dataset *datasets;
+	struct payload *payloads;
+	unsigned int refs;
+};
+
+struct changed_data_type {
+	uint8_t data_type;
 	struct list_head list;
 };
 
+/**
+ * struct transaction_head - packets received for a transaction
+ * @server_addr: mac address of the sender
+ * @id: transaction id chosen by the requester
+ * @requested_type: data type requested by a client, 0 otherwise
+ * @request: 1 if the transaction answers an ALFRED_REQUEST of this daemon
+ * @hedges: other masters the request of the client was also sent to
+ * @deadline: milliseconds after started the client is answered with the
+ *  datasets stored by then, 0 if the client waits for the transaction
+ * @finished: 1 if the data was applied, -1 if the transaction failed
+ * @num_packet: number of packets in buf
+ * @client_socket: unix socket of the requesting client, -1 if none
+ * @started: time the transaction was created
+ * @last_rx_time: time of the last received packet
+ * @nacks: number of nack packets sent for the transaction
+ * @seqno_map: one bit per sequence number, set when it was received
+ * @seqno_map_size: size of seqno_map in bytes
+ * @buf: received packets, stored back to back in order of reception
+ * @buf_len: bytes used in buf
+ * @buf_size: size of buf
+ * @parity: received alfred_parity_v0 packets, stored back to back
+ * @parity_len: bytes used in parity
+ * @parity_size: size of parity
+ * @staged: datasets parsed from the packets, applied when the transaction
+ *  is finished
+ * @staged_hash: staged datasets by source and type, NULL until the first
+ *  one is staged
+ * @peer: daemon the transaction is charged to
+ * @mem_used: bytes of received data charged to the transaction
+ */
 struct transaction_head {
 	struct ether_addr server_addr;
 	uint16_t id;
 	uint8_t requested_type;
+	uint8_t request;
+	uint8_t hedges;
+	uint32_t deadline;
 	int finished;
 	int num_packet;
 	int client_socket;
+	struct timespec started;
 	struct timespec last_rx_time;
-	struct list_head packet_list;
+	uint8_t nacks;
+
+	uint8_t *seqno_map;
+	size_t seqno_map_size;
+	uint8_t *buf;
+	size_t buf_len;
+	size_t buf_size;
+
+	uint8_t *parity;
+	size_t parity_len;
+	size_t parity_size;
+
+	struct list_head staged;
+	struct hashtable_t *staged_hash;
+
+	struct peer *peer;
+	size_t mem_used;
 };
 
 struct server {
@@ -84,6 +271,72 @@ struct server {
 	uint8_t tq;
 };
 
+/**
+ * struct retransmit_cache - packets of a transaction sent by us
+ * @address: destination of the transaction
+ * @id: transaction id as sent in the packets
+ * @num_packet: number of packets announced by the txend packet
+ * @retries: number of nack packets answered
+ * @created: time the transaction was sent
+ * @buf: sent packets, stored back to back in order of their seqno
+ * @buf_len: bytes used in buf
+ * @buf_size: size of buf
+ */
+struct retransmit_cache {
+	struct in6_addr address;
+	uint16_t id;
+	uint16_t num_packet;
+	uint8_t retries;
+	struct timespec created;
+	uint8_t *buf;
+	size_t buf_len;
+	size_t buf_size;
+};
+
+/**
+ * struct peer - another daemon seen on the network
+ * @hwaddr: mac address of the daemon
+ * @caps: enum alfred_capability bits announced by the daemon
+ * @last_seen: time of the last capabilities packet
+ * @transactions: transactions of the daemon which are being received
+ * @transaction_mem: bytes charged to these transactions
+ * @sync_id: transaction id of the last sync sent to the daemon
+ * @sync_seq: globals->change_seq when the last sync was sent
+ * @acked_seq: globals->change_seq of the last acknowledged sync
+ * @full_sync: time of the last sync of all datasets
+ * @mcast_seq: last multicast sync round of the daemon which was completed
+ * @mcast_round: multicast sync round being received, 0 if none
+ * @mcast_id: transaction id of the multicast sync round being received
+ * @repair_time: time of the last full sync sent for a missed round
+ */
+struct peer {
+	struct ether_addr hwaddr;
+	uint32_t caps;
+	struct timespec last_seen;
+	unsigned int transactions;
+	size_t transaction_mem;
+	uint16_t sync_id;
+	uint32_t sync_seq;
+	uint32_t acked_seq;
+	struct timespec full_sync;
+	uint32_t mcast_seq;
+	uint32_t mcast_round;
+	uint16_t mcast_id;
+	struct timespec repair_time;
+};
+
+/**
+ * struct gossip_target - master which can be picked for a gossip round
+ * @interface: interface the master was seen on
+ * @server: the master
+ * @peer: capabilities and sync state of the master
+ */
+struct gossip_target {
+	struct interface *interface;
+	struct server *server;
+	struct peer *peer;
+};
+
 enum opmode {
 	OPMODE_SLAVE,
 	OPMODE_MASTER,
@@ -95,6 +348,9 @@ enum clientmode {
 	CLIENT_SET_DATA,
 	CLIENT_MODESWITCH,
 	CLIENT_CHANGE_INTERFACE,
+	CLIENT_STATS,
+	CLIENT_SET_POLICY,
+	CLIENT_HISTORY,
 };
 
 struct interface {
@@ -122,6 +378,9 @@ struct globals {
 	int clientmode_version;
 	int verbose;
 
+	struct ether_addr history_source;	/* all zero for any source */
+	uint32_t history_since;
+
 	int unix_sock;
 	const char *unix_path;
 
@@ -132,9 +391,90 @@ struct globals {
 	struct timespec if_check;
 
 	struct hashtable_t *data_hash;
+	struct hashtable_t *payload_hash;
 	struct hashtable_t *transaction_hash;
+	struct hashtable_t *peer_hash;
+	struct hashtable_t *retransmit_hash;
+
+	size_t data_mem_limit;		/* 0 if unlimited */
+	size_t data_mem_used;
+	struct list_head data_lru;	/* synced datasets, oldest first */
+	uint32_t data_evicted;
+	uint32_t change_seq;
+	uint32_t full_syncs;
+	uint32_t delta_syncs;
+
+	uint64_t merkle_types[256];	/* XOR of the dataset digests */
+	uint32_t merkle_pushed;
+
+	uint8_t gossip_fanout;		/* 0 if disabled */
+	uint32_t gossip_rounds;
+	uint32_t gossip_refreshed;
+
+	uint8_t mcast_sync;
+	uint32_t mcast_round;		/* last sent multicast sync round */
+	uint32_t mcast_sync_seq;	/* change_seq of the last round */
+	struct timespec mcast_full_sync;
+	uint32_t mcast_repairs;
+
+	struct ether_addr local_push_server;	/* master of the last push */
+	uint32_t local_push_seq;	/* change_seq of the last push */
+	uint32_t refreshed;
+	uint32_t refresh_missing;
+
+	uint8_t delta_sync;
+	uint32_t delta_pushed;
+	uint64_t delta_saved;		/* bytes not sent thanks to deltas */
+	uint32_t delta_failed;
+
+	uint8_t compress_sync;
+	uint32_t sync_compressed;
+	uint64_t sync_compress_saved;
+
+	uint32_t requests_unchanged;
+
+	uint8_t freshness;		/* enum alfred_freshness, client */
+	uint32_t cache_age;		/* 0 if disabled */
+	struct timespec type_fetched[256];	/* last answer of the master */
+	uint32_t cache_hits;
+	uint32_t cache_stale_hits;
+
+	uint32_t hedge_delay;		/* milliseconds, 0 if disabled */
+	uint32_t hedges_sent;
+	uint32_t hedges_won;		/* requests answered by a hedge */
+	uint32_t hedges_cancelled;
+	uint32_t request_latency[ALFRED_LATENCY_SAMPLES];	/* ms */
+	uint32_t requests_answered;
+	uint32_t deadline;		/* milliseconds, client */
+	uint32_t requests_expired;
+
+	size_t tx_mem_limit;		/* 0 if unlimited */
+	size_t tx_peer_mem_limit;	/* 0 if unlimited */
+	size_t tx_mem_used;
+	uint32_t tx_rejected;
+	uint32_t tx_incomplete;		/* dropped with missing packets */
+	uint32_t tx_split;		/* continued in a new transaction */
+	uint32_t fec_rebuilt;		/* packets rebuilt from parity */
+	uint32_t nacks_sent;
+	uint32_t nack_retransmitted;	/* packets sent again on nack */
+
+	struct compress_policy compress[256];
+	struct type_policy policy[256];
+
+	uint8_t history_depth;		/* 0 if disabled */
+	uint8_t fec_group;		/* 0 if disabled */
+	uint8_t stream_apply;
+
+	const char *snapshot_path;
+	struct snapshot *snapshot;
+	struct timespec snapshot_time;
+
+	uint8_t takeover;
+	uint8_t handed_off;
 };
 
+#define ARRAY_SIZE(x)		(sizeof(x) / sizeof(*(x)))
+
 #define debugMalloc(size, num)	malloc(size)
 #define debugFree(ptr, num)	free(ptr)
 
@@ -143,6 +483,8 @@ struct globals {
 extern const struct in6_addr in6addr_localmcast;
 
 /* server.c */
+int data_compare(void *d1, void *d2);
+int data_choose(void *d1, int size);
 int alfred_server(struct globals *globals);
 int set_best_server(struct globals *globals);
 void changed_data_type(struct globals *globals, uint8_t arg);
@@ -152,23 +494,45 @@ int alfred_client_request_data(struct globals *globals);
 int alfred_client_set_data(struct globals *globals);
 int alfred_client_modeswitch(struct globals *globals);
 int alfred_client_change_interface(struct globals *globals);
+int alfred_client_stats(struct globals *globals);
+int alfred_client_set_policy(struct globals *globals);
+int alfred_client_history(struct globals *globals);
 /* recv.c */
 int recv_alfred_packet(struct globals *globals, struct interface *interface,
 		       int recv_sock);
 struct transaction_head *
 transaction_add(struct globals *globals, struct ether_addr mac, uint16_t id);
+int transaction_add_packet(struct globals *globals,
+			   struct transaction_head *head,
+			   struct alfred_push_data_v0 *push);
+int push_packet_check(struct alfred_push_data_v0 *push);
+int transaction_charge(struct globals *globals, struct transaction_head *head,
+		       size_t len);
 struct transaction_head *
 transaction_clean_hash(struct globals *globals,
 		       struct transaction_head *search);
 struct transaction_head *transaction_clean(struct globals *globals,
 					   struct transaction_head *head);
+void transaction_release(struct globals *globals,
+			 struct transaction_head *head);
 /* send.c */
 int push_data(struct globals *globals, struct interface *interface,
 	      struct in6_addr *destination, enum data_source max_source_level,
-	      int type_filter, uint16_t tx_id);
+	      int type_filter, uint16_t tx_id, uint32_t since);
 int announce_master(struct globals *globals);
 int push_local_data(struct globals *globals);
+uint16_t push_datasets(struct globals *globals, struct interface *interface,
+		       struct in6_addr *destination, struct dataset **datasets,
+		       size_t count, uint16_t tx_id);
+uint32_t sync_since(struct globals *globals, struct peer *peer,
+		    struct timespec *now);
 int sync_data(struct globals *globals);
+int sync_repair(struct globals *globals, struct interface *interface,
+		struct in6_addr *source, struct alfred_status_v0 *status);
+int send_capabilities(struct globals *globals, struct interface *interface,
+		      const struct in6_addr *dest);
+int send_request(struct globals *globals, struct interface *interface,
+		 struct server *server, uint8_t type, uint16_t tx_id);
 ssize_t send_alfred_packet(struct interface *interface,
 			   const struct in6_addr *dest, void *buf, int length);
 /* unix_sock.c */
@@ -178,6 +542,7 @@ int unix_sock_open_client(struct globals *globals);
 int unix_sock_close(struct globals *globals);
 int unix_sock_req_data_finish(struct globals *globals,
 			      struct transaction_head *head);
+void unix_sock_req_deadlines(struct globals *globals, struct timespec *tv);
 /* vis.c */
 int vis_update_data(struct globals *globals);
 /* netsock.c */
@@ -185,14 +550,135 @@ int netsock_open_all(struct globals *globals);
 void netsock_close_all(struct globals *globals);
 int netsock_set_interfaces(struct globals *globals, char *interfaces);
 struct interface *netsock_first_interface(struct globals *globals);
+struct interface *netsock_find_interface(struct globals *globals,
+					 const char *name);
 void netsock_reopen(struct globals *globals);
 int netsock_prepare_select(struct globals *globals, fd_set *fds, int maxsock);
 void netsock_check_error(struct globals *globals, fd_set *errfds);
 int netsock_receive_packet(struct globals *globals, fd_set *fds);
+size_t netsock_max_packet(struct interface *interface);
 int netsock_own_address(const struct globals *globals,
 			const struct in6_addr *address);
+/* datastore.c */
+int datastore_init(struct globals *globals);
+struct dataset *dataset_add(struct globals *globals, struct alfred_data *data);
+int dataset_set_data(struct globals *globals, struct dataset *dataset,
+		     uint8_t version, const uint8_t *buf, uint32_t len);
+void dataset_refresh(struct globals *globals, struct dataset *dataset);
+void dataset_refresh_seen(struct globals *globals, struct dataset *dataset,
+			  const struct timespec *seen);
+void dataset_free(struct globals *globals, struct dataset *dataset);
+void dataset_remove(struct globals *globals, struct dataset *dataset);
+int dataset_adopt(struct globals *globals, struct dataset *dataset);
+struct payload *payload_adopt(struct globals *globals,
+			      struct payload *payload);
+void payload_put(struct globals *globals, struct payload *payload);
+void datastore_enforce_limit(struct globals *globals);
+int dataset_copy_data(struct globals *globals, struct dataset *dataset,
+		      uint8_t *dst, bool client_read);
+const uint8_t *dataset_get_data(struct globals *globals,
+				struct dataset *dataset, bool client_read,
+				uint8_t **alloc);
+const uint8_t *payload_get_data(struct payload *payload, uint8_t **alloc);
+void datastore_compress_cold(struct globals *globals);
+void datastore_account(struct globals *globals,
+		       struct datastore_account *account);
+/* compress.c */
+size_t lz_compress(const uint8_t *in, size_t in_len,
+		   uint8_t *out, size_t out_len);
+ssize_t lz_decompress(const uint8_t *in, size_t in_len,
+		      uint8_t *out, size_t out_len);
+/* delta.c */
+size_t delta_encode(const uint8_t *base, size_t base_len,
+		    const uint8_t *target, size_t target_len,
+		    uint8_t *out, size_t out_len);
+ssize_t delta_apply(const uint8_t *base, size_t base_len,
+		    const uint8_t *delta, size_t delta_len,
+		    uint8_t *out, size_t out_len);
+/* history.c */
+void history_add(struct globals *globals, struct dataset *dataset,
+		 const uint8_t *buf, uint32_t len);
+void history_free(struct globals *globals, struct dataset *dataset);
+int history_reply(struct globals *globals, struct dataset *dataset,
+		  uint32_t since, int client_sock);
+/* snapshot.c */
+int snapshot_load(struct globals *globals);
+int snapshot_load_fd(struct globals *globals, int fd);
+int snapshot_write(struct globals *globals);
+int snapshot_write_fp(struct globals *globals, FILE *fp);
+void snapshot_put(struct globals *globals);
+/* handoff.c */
+int handoff_send(struct globals *globals, int client_sock);
+int handoff_receive(struct globals *globals);
+/* policy.c */
+void policy_default(struct type_policy *policy);
+void policy_init(struct globals *globals);
+bool policy_is_default(const struct type_policy *policy);
+int policy_parse(char *line, uint8_t *type, struct type_policy *policy);
+int policy_load_file(struct globals *globals, const char *path);
+int policy_next_priority(struct globals *globals, int priority);
+/* peer.c */
+int peer_init(struct globals *globals);
+void peer_update(struct globals *globals, struct ether_addr *mac,
+		 uint32_t caps);
+struct peer *peer_get(struct globals *globals, struct ether_addr *mac);
+uint32_t peer_caps(struct globals *globals, const struct in6_addr *address);
+void peer_purge(struct globals *globals);
+/* retransmit.c */
+int retransmit_init(struct globals *globals);
+struct retransmit_cache *retransmit_add(struct globals *globals,
+					const struct in6_addr *dest,
+					uint16_t id);
+void retransmit_store(struct retransmit_cache *cache, const void *packet,
+		      size_t len);
+int retransmit_nack(struct globals *globals, struct interface *interface,
+		    const struct in6_addr *source,
+		    struct alfred_nack_v0 *nack);
+void retransmit_cancel(struct globals *globals, const struct in6_addr *source,
+		       struct alfred_status_v0 *status);
+void retransmit_purge(struct globals *globals);
+/* fec.c */
+struct fec_group;
+struct fec_group *fec_new(uint8_t group_size, uint16_t tx_id);
+void fec_add(struct fec_group *fec, struct interface *interface,
+	     const struct in6_addr *dest, const void *packet, size_t len);
+void fec_flush(struct fec_group *fec, struct interface *interface,
+	       const struct in6_addr *dest);
+int fec_store_parity(struct globals *globals, struct transaction_head *head,
+		     struct alfred_parity_v0 *parity);
+void fec_recover(struct globals *globals, struct transaction_head *head,
+		 uint16_t num_packet);
+/* merkle.c */
+void merkle_update(struct globals *globals, struct dataset *dataset);
+void merkle_remove(struct globals *globals, struct dataset *dataset);
+uint64_t merkle_root(struct globals *globals);
+int merkle_send_root(struct globals *globals, struct interface *interface,
+		     struct in6_addr *dest);
+int merkle_receive(struct globals *globals, struct interface *interface,
+		   struct in6_addr *source, struct alfred_merkle_v0 *merkle);
+/* gossip.c */
+void gossip_round(struct globals *globals, struct gossip_target *targets,
+		  size_t count, struct timespec *now);
+int gossip_receive_ages(struct globals *globals,
+			struct alfred_ages_v0 *ages);
+void gossip_staleness(struct globals *globals, long *max_age, long *mean_age);
+/* refresh.c */
+int refresh_send(struct globals *globals, struct interface *interface,
+		 struct in6_addr *dest, uint32_t since);
+int refresh_receive(struct globals *globals, struct interface *interface,
+		    struct in6_addr *source, struct alfred_refresh_v0 *refresh);
+int refresh_request(struct interface *interface, struct in6_addr *dest,
+		    struct alfred_data *data);
+/* hedge.c */
+void hedge_requests(struct globals *globals, struct timespec *tv);
+void hedge_finish(struct globals *globals, struct transaction_head *head);
 /* util.c */
 int time_diff(struct timespec *tv1, struct timespec *tv2,
 	      struct timespec *tvdiff);
+void time_add_ms(struct timespec *tv, uint64_t ms);
 void time_random_seed(void);
 uint16_t get_random_id(void);
+uint64_t digest64(const void *buf, size_t len);
+int read_full(int fd, void *buf, size_t len);
+int write_full(int fd, const void *buf, size_t len);
+int buffer_grow(uint8_t **buf, size_t *size, size_t needed, size_t min_size);
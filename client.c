@@ -25,6 +25,7 @@
 #include <sys/ioctl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <net/if.h>
@@ -33,16 +34,111 @@
 #include "alfred.h"
 #include "packet.h"
 
+static void alfred_client_print_begin(const uint8_t *source)
+{
+	printf("{ \"%02x:%02x:%02x:%02x:%02x:%02x\", \"",
+	       source[0], source[1], source[2],
+	       source[3], source[4], source[5]);
+}
+
+static void alfred_client_print_data(const uint8_t *pos, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (pos[i] == '"')
+			printf("\\\"");
+		else if (pos[i] == '\\')
+			printf("\\\\");
+		else if (!isprint(pos[i]))
+			printf("\\x%02x", pos[i]);
+		else
+			printf("%c", pos[i]);
+	}
+}
+
+static void alfred_client_print_end(struct globals *globals, uint8_t version)
+{
+	printf("\"");
+
+	if (globals->verbose)
+		printf(", %u", version);
+
+	printf(" },\n");
+}
+
+static int alfred_client_print_push(struct globals *globals,
+				    struct alfred_push_data_v0 *push)
+{
+	struct alfred_data *data;
+	int len, data_len;
+	uint8_t *pos;
+
+	len = ntohs(push->header.length);
+	if (len < (int)(sizeof(*push) - sizeof(push->header)))
+		return -1;
+
+	len -= sizeof(*push) - sizeof(push->header);
+	pos = (uint8_t *)push->data;
+
+	while (len >= (int)sizeof(*data)) {
+		data = (struct alfred_data *)pos;
+		data_len = ntohs(data->header.length);
+
+		/* would it fit? it should! */
+		if ((int)(data_len + sizeof(*data)) > len)
+			return -1;
+
+		alfred_client_print_begin(data->source);
+		alfred_client_print_data(data->data, data_len);
+		alfred_client_print_end(globals, data->header.version);
+
+		pos += sizeof(*data) + data_len;
+		len -= sizeof(*data) + data_len;
+	}
+
+	return 0;
+}
+
+/* chunks of a dataset arrive in order, print them as they come in */
+static int alfred_client_print_chunk(struct globals *globals,
+				     struct alfred_push_chunk_v0 *chunk)
+{
+	uint32_t offset, total_length;
+	size_t len;
+
+	len = ntohs(chunk->header.length);
+	if (len < sizeof(*chunk) - sizeof(chunk->header))
+		return -1;
+
+	len -= sizeof(*chunk) - sizeof(chunk->header);
+	offset = ntohl(chunk->offset);
+	total_length = ntohl(chunk->total_length);
+
+	if (offset > total_length || len > total_length - offset)
+		return -1;
+
+	if (offset == 0)
+		alfred_client_print_begin(chunk->source);
+
+	alfred_client_print_data(chunk->data, len);
+
+	if (offset + len == total_length)
+		alfred_client_print_end(globals, chunk->version);
+
+	return 0;
+}
+
 int alfred_client_request_data(struct globals *globals)
 {
-	unsigned char buf[MAX_PAYLOAD], *pos;
+	struct alfred_request_freshness_v0 *request_freshness;
+	struct alfred_request_deadline_v0 *request_deadline;
+	unsigned char buf[MAX_PAYLOAD];
 	struct alfred_request_v0 *request;
-	struct alfred_push_data_v0 *push;
 	struct alfred_status_v0 *status;
 	struct alfred_tlv *tlv;
-	struct alfred_data *data;
-	int ret, len, data_len, i;
-	const size_t buf_data_len = sizeof(buf) - sizeof(*push) - sizeof(*data);
+	bool partial = false;
+	int ret, len;
 
 	if (unix_sock_open_client(globals))
 		return -1;
@@ -57,80 +153,76 @@ int alfred_client_request_data(struct globals *globals)
 	request->requested_type = globals->clientmode_arg;
 	request->tx_id = get_random_id();
 
+	/* the plain request accepts cached data */
+	if (globals->freshness != ALFRED_FRESHNESS_CACHED) {
+		request_freshness = (struct alfred_request_freshness_v0 *)buf;
+		len = sizeof(*request_freshness);
+		request_freshness->header.length =
+			htons(len - sizeof(request_freshness->header));
+		request_freshness->freshness = globals->freshness;
+	}
+
+	if (globals->deadline) {
+		request_deadline = (struct alfred_request_deadline_v0 *)buf;
+		len = sizeof(*request_deadline);
+		request_deadline->header.length =
+			htons(len - sizeof(request_deadline->header));
+		request_deadline->freshness = globals->freshness;
+		request_deadline->deadline = htonl(globals->deadline);
+	}
+
 	ret = write(globals->unix_sock, buf, len);
 	if (ret != len)
 		fprintf(stderr, "%s: only wrote %d of %d bytes: %s\n",
 			__func__, ret, len, strerror(errno));
 
-	push = (struct alfred_push_data_v0 *)buf;
 	tlv = (struct alfred_tlv *)buf;
-	while ((ret = read(globals->unix_sock, buf, sizeof(*tlv))) > 0) {
-		if (ret < (int)sizeof(*tlv))
-			break;
-
+	while (read_full(globals->unix_sock, buf, sizeof(*tlv)) == 0) {
 		if (tlv->type == ALFRED_STATUS_ERROR)
 			goto recv_err;
 
-		if (tlv->type != ALFRED_PUSH_DATA)
-			break;
+		/* the datasets which follow are the ones the daemon had when
+		 * the deadline expired */
+		if (tlv->type == ALFRED_STATUS_PARTIAL) {
+			len = sizeof(*status) - sizeof(*tlv);
+			if (read_full(globals->unix_sock, buf + sizeof(*tlv),
+				      len) < 0)
+				break;
 
-		/* read the rest of the header */
-		ret = read(globals->unix_sock, buf + sizeof(*tlv),
-			   sizeof(*push) - sizeof(*tlv));
+			partial = true;
+			continue;
+		}
 
-		/* too short */
-		if (ret < (int)(sizeof(*push) - (int)sizeof(*tlv)))
+		if (tlv->type != ALFRED_PUSH_DATA &&
+		    tlv->type != ALFRED_PUSH_CHUNK)
 			break;
 
-		/* read the rest of the header */
-		ret = read(globals->unix_sock, buf + sizeof(*push),
-			   sizeof(*data));
-
-		if (ret < (ssize_t)sizeof(*data))
+		len = ntohs(tlv->length);
+		if (len > (int)(sizeof(buf) - sizeof(*tlv)))
 			break;
 
-		data = push->data;
-		data_len = ntohs(data->header.length);
-
-		/* would it fit? it should! */
-		if (data_len > (int)buf_data_len)
+		/* read the rest of the packet */
+		if (read_full(globals->unix_sock, buf + sizeof(*tlv), len) < 0)
 			break;
 
-		/* read the data */
-		ret = read(globals->unix_sock,
-			   buf + sizeof(*push) + sizeof(*data), data_len);
+		if (tlv->type == ALFRED_PUSH_DATA)
+			ret = alfred_client_print_push(globals,
+						       (struct alfred_push_data_v0 *)buf);
+		else
+			ret = alfred_client_print_chunk(globals,
+							(struct alfred_push_chunk_v0 *)buf);
 
-		/* again too short */
-		if (ret < data_len)
+		if (ret < 0)
 			break;
-
-		pos = data->data;
-
-		printf("{ \"%02x:%02x:%02x:%02x:%02x:%02x\", \"",
-		       data->source[0], data->source[1],
-		       data->source[2], data->source[3],
-		       data->source[4], data->source[5]);
-		for (i = 0; i < data_len; i++) {
-			if (pos[i] == '"')
-				printf("\\\"");
-			else if (pos[i] == '\\')
-				printf("\\\\");
-			else if (!isprint(pos[i]))
-				printf("\\x%02x", pos[i]);
-			else
-				printf("%c", pos[i]);
-		}
-
-		printf("\"");
-
-		if (globals->verbose)
-			printf(", %u", data->header.version);
-
-		printf(" },\n");
 	}
 
 	unix_sock_close(globals);
 
+	if (partial) {
+		fprintf(stderr, "Request deadline expired, data may be incomplete\n");
+		return 2;
+	}
+
 	return 0;
 
 recv_err:
@@ -148,26 +240,104 @@ recv_err:
 	return status->tx.seqno;
 }
 
-int alfred_client_set_data(struct globals *globals)
+/* send data too large for a single push packet in chunks */
+static int alfred_client_set_chunks(struct globals *globals,
+				    const uint8_t *data, uint32_t total_length)
 {
 	unsigned char buf[MAX_PAYLOAD];
+	struct alfred_push_chunk_v0 *chunk;
+	size_t len, chunk_max;
+	uint32_t offset;
+
+	chunk = (struct alfred_push_chunk_v0 *)buf;
+	chunk_max = sizeof(buf) - sizeof(*chunk);
+
+	chunk->header.type = ALFRED_PUSH_CHUNK;
+	chunk->header.version = ALFRED_VERSION;
+	chunk->tx.id = get_random_id();
+
+	/* we leave chunk->source "empty" */
+	memset(chunk->source, 0, sizeof(chunk->source));
+	chunk->type = globals->clientmode_arg;
+	chunk->version = globals->clientmode_version;
+	chunk->total_length = htonl(total_length);
+
+	for (offset = 0; offset < total_length; offset += len) {
+		len = total_length - offset;
+		if (len > chunk_max)
+			len = chunk_max;
+
+		chunk->header.length = htons(sizeof(*chunk) -
+					     sizeof(chunk->header) + len);
+		chunk->tx.seqno = htons(offset / chunk_max);
+		chunk->offset = htonl(offset);
+		memcpy(chunk->data, data + offset, len);
+
+		if (write_full(globals->unix_sock, buf,
+			       sizeof(*chunk) + len) < 0) {
+			fprintf(stderr, "%s: write failed: %s\n", __func__,
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int alfred_client_set_data(struct globals *globals)
+{
 	struct alfred_push_data_v0 *push;
 	struct alfred_data *data;
-	int ret, len;
+	size_t len, size, header_len;
+	uint8_t *buf, *tmp;
+	int ret = -1;
+
+	header_len = sizeof(*push) + sizeof(*data);
+	size = MAX_PAYLOAD;
+	buf = malloc(size);
+	if (!buf)
+		return -1;
+
+	/* read everything from stdin behind the space for the header. The
+	 * buffer grows up to one byte more than allowed to detect oversized
+	 * data */
+	len = header_len;
+	while (!feof(stdin) && !ferror(stdin)) {
+		if (len == size) {
+			if (len - header_len > ALFRED_MAX_DATASET_SIZE)
+				break;
+
+			size *= 2;
+			if (size > ALFRED_MAX_DATASET_SIZE + header_len + 1)
+				size = ALFRED_MAX_DATASET_SIZE + header_len + 1;
+
+			tmp = realloc(buf, size);
+			if (!tmp)
+				goto out;
+			buf = tmp;
+		}
+
+		len += fread(&buf[len], 1, size - len, stdin);
+	}
+
+	if (len - header_len > ALFRED_MAX_DATASET_SIZE) {
+		fprintf(stderr, "data larger than %d bytes\n",
+			ALFRED_MAX_DATASET_SIZE);
+		goto out;
+	}
 
 	if (unix_sock_open_client(globals))
-		return -1;
+		goto out;
+
+	if (len > MAX_PAYLOAD) {
+		ret = alfred_client_set_chunks(globals, buf + header_len,
+					       len - header_len);
+		unix_sock_close(globals);
+		goto out;
+	}
 
 	push = (struct alfred_push_data_v0 *)buf;
 	data = push->data;
-	len = sizeof(*push) + sizeof(*data);
-	while (!feof(stdin)) {
-		ret = fread(&buf[len], 1, sizeof(buf) - len, stdin);
-		len += ret;
-
-		if (sizeof(buf) == len)
-			break;
-	}
 
 	push->header.type = ALFRED_PUSH_DATA;
 	push->header.version = ALFRED_VERSION;
@@ -182,12 +352,15 @@ int alfred_client_set_data(struct globals *globals)
 	data->header.length = htons(len - sizeof(*push) - sizeof(*data));
 
 	ret = write(globals->unix_sock, buf, len);
-	if (ret != len)
-		fprintf(stderr, "%s: only wrote %d of %d bytes: %s\n",
+	if (ret != (int)len)
+		fprintf(stderr, "%s: only wrote %d of %zu bytes: %s\n",
 			__func__, ret, len, strerror(errno));
 
 	unix_sock_close(globals);
-	return 0;
+	ret = 0;
+out:
+	free(buf);
+	return ret;
 }
 
 int alfred_client_modeswitch(struct globals *globals)
@@ -309,3 +482,165 @@ int alfred_client_change_interface(struct globals *globals)
 
 	return 0;
 }
+
+int alfred_client_stats(struct globals *globals)
+{
+	unsigned char buf[MAX_PAYLOAD];
+	struct alfred_stats_v0 *stats;
+	int ret, len, pos;
+
+	if (unix_sock_open_client(globals))
+		return -1;
+
+	stats = (struct alfred_stats_v0 *)buf;
+	len = sizeof(*stats);
+
+	stats->header.type = ALFRED_STATS;
+	stats->header.version = ALFRED_VERSION;
+	stats->header.length = htons(0);
+
+	ret = write(globals->unix_sock, buf, len);
+	if (ret != len) {
+		fprintf(stderr, "%s: only wrote %d of %d bytes: %s\n",
+			__func__, ret, len, strerror(errno));
+		goto err;
+	}
+
+	ret = read(globals->unix_sock, buf, sizeof(*stats));
+	if (ret < (int)sizeof(*stats) || stats->header.type != ALFRED_STATS)
+		goto err;
+
+	len = ntohs(stats->header.length);
+	if (len > (int)(sizeof(buf) - sizeof(*stats) - 1))
+		goto err;
+
+	for (pos = 0; pos < len; pos += ret) {
+		ret = read(globals->unix_sock, stats->text + pos, len - pos);
+		if (ret <= 0)
+			goto err;
+	}
+	stats->text[len] = '\0';
+
+	printf("%s", stats->text);
+
+	unix_sock_close(globals);
+	return 0;
+
+err:
+	unix_sock_close(globals);
+	return -1;
+}
+
+int alfred_client_set_policy(struct globals *globals)
+{
+	struct alfred_set_policy_v0 set_policy;
+	struct type_policy *policy;
+	int ret, len;
+
+	if (unix_sock_open_client(globals))
+		return -1;
+
+	policy = &globals->policy[globals->clientmode_arg];
+	len = sizeof(set_policy);
+
+	memset(&set_policy, 0, sizeof(set_policy));
+	set_policy.header.type = ALFRED_SET_POLICY;
+	set_policy.header.version = ALFRED_VERSION;
+	set_policy.header.length = htons(len - sizeof(set_policy.header));
+	set_policy.type = globals->clientmode_arg;
+	set_policy.priority = policy->priority;
+	set_policy.sync = policy->sync;
+	set_policy.max_size = htonl(policy->max_size);
+	set_policy.timeout = htonl(policy->timeout);
+
+	ret = write(globals->unix_sock, &set_policy, len);
+	if (ret != len)
+		fprintf(stderr, "%s: only wrote %d of %d bytes: %s\n",
+			__func__, ret, len, strerror(errno));
+
+	unix_sock_close(globals);
+	return 0;
+}
+
+/* revisions arrive newest first, each one in order of its offsets */
+static int alfred_client_print_history(struct globals *globals,
+				       struct alfred_history_v0 *history)
+{
+	uint32_t offset, total_length;
+	uint8_t *source;
+	size_t len;
+
+	len = ntohs(history->header.length);
+	if (len < sizeof(*history) - sizeof(history->header))
+		return -1;
+
+	len -= sizeof(*history) - sizeof(history->header);
+	offset = ntohl(history->offset);
+	total_length = ntohl(history->total_length);
+
+	if (offset > total_length || len > total_length - offset)
+		return -1;
+
+	if (offset == 0) {
+		source = history->source;
+		printf("{ \"%02x:%02x:%02x:%02x:%02x:%02x\", %u, %u, \"",
+		       source[0], source[1], source[2],
+		       source[3], source[4], source[5],
+		       ntohl(history->revision), ntohl(history->age));
+	}
+
+	alfred_client_print_data(history->data, len);
+
+	if (offset + len == total_length)
+		alfred_client_print_end(globals, history->version);
+
+	return 0;
+}
+
+int alfred_client_history(struct globals *globals)
+{
+	unsigned char buf[MAX_PAYLOAD];
+	struct alfred_history_request_v0 *request;
+	struct alfred_tlv *tlv;
+	int ret, len;
+
+	if (unix_sock_open_client(globals))
+		return -1;
+
+	request = (struct alfred_history_request_v0 *)buf;
+	len = sizeof(*request);
+
+	memset(request, 0, len);
+	request->header.type = ALFRED_HISTORY;
+	request->header.version = ALFRED_VERSION;
+	request->header.length = htons(len - sizeof(request->header));
+	memcpy(request->source, &globals->history_source,
+	       sizeof(request->source));
+	request->type = globals->clientmode_arg;
+	request->since = htonl(globals->history_since);
+
+	ret = write(globals->unix_sock, buf, len);
+	if (ret != len)
+		fprintf(stderr, "%s: only wrote %d of %d bytes: %s\n",
+			__func__, ret, len, strerror(errno));
+
+	tlv = (struct alfred_tlv *)buf;
+	while (read_full(globals->unix_sock, buf, sizeof(*tlv)) == 0) {
+		if (tlv->type != ALFRED_HISTORY)
+			break;
+
+		len = ntohs(tlv->length);
+		if (len > (int)(sizeof(buf) - sizeof(*tlv)))
+			break;
+
+		if (read_full(globals->unix_sock, buf + sizeof(*tlv), len) < 0)
+			break;
+
+		if (alfred_client_print_history(globals,
+						(struct alfred_history_v0 *)buf) < 0)
+			break;
+	}
+
+	unix_sock_close(globals);
+	return 0;
+}
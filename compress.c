@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+/* Small LZ77 codec without external dependencies. The compressed stream is a
+ * sequence of blocks, each started by a control byte:
+ *
+ *  000lllll                    literal run of l + 1 bytes following
+ *  LLLooooo oooooooo           back reference of L + 2 bytes (L = 1..6)
+ *  111ooooo LLLLLLLL oooooooo  back reference of L + 9 bytes
+ *
+ * The 13 bit offset o counts backwards from the byte before the current
+ * output position.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "alfred.h"
+
+#define LZ_HASH_LOG	13
+#define LZ_HASH_SIZE	(1 << LZ_HASH_LOG)
+#define LZ_MAX_LIT	(1 << 5)
+#define LZ_MAX_OFF	(1 << 13)
+#define LZ_MAX_REF	((1 << 8) + (1 << 3))
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+	uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+
+	return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/* returns the compressed length or 0 if the output doesn't fit in out_len */
+size_t lz_compress(const uint8_t *in, size_t in_len,
+		   uint8_t *out, size_t out_len)
+{
+	static const uint8_t *htab[LZ_HASH_SIZE];
+	const uint8_t *ip = in, *in_end = in + in_len, *ref;
+	uint8_t *op = out, *out_end = out + out_len;
+	uint8_t *lit_ctrl;
+	size_t lit = 0, off, len, maxlen;
+	uint32_t h;
+
+	if (in_len == 0 || out_len < 2)
+		return 0;
+
+	memset(htab, 0, sizeof(htab));
+
+	/* reserve control byte of the first literal run */
+	lit_ctrl = op++;
+
+	while (ip < in_end) {
+		if (ip + 2 < in_end) {
+			h = lz_hash(ip);
+			ref = htab[h];
+			htab[h] = ip;
+
+			if (ref && (size_t)(ip - ref - 1) < LZ_MAX_OFF &&
+			    ref[0] == ip[0] && ref[1] == ip[1] &&
+			    ref[2] == ip[2]) {
+				off = ip - ref - 1;
+				maxlen = in_end - ip;
+				if (maxlen > LZ_MAX_REF)
+					maxlen = LZ_MAX_REF;
+
+				len = 3;
+				while (len < maxlen && ref[len] == ip[len])
+					len++;
+
+				/* close the literal run or drop its unused
+				 * control byte */
+				if (lit)
+					*lit_ctrl = lit - 1;
+				else
+					op--;
+
+				if (op + 3 > out_end)
+					return 0;
+
+				ip += len;
+				len -= 2;
+				if (len < 7) {
+					*op++ = (off >> 8) + (len << 5);
+				} else {
+					*op++ = (off >> 8) + (7 << 5);
+					*op++ = len - 7;
+				}
+				*op++ = off & 0xff;
+
+				if (op >= out_end)
+					return 0;
+
+				lit = 0;
+				lit_ctrl = op++;
+				continue;
+			}
+		}
+
+		if (op >= out_end)
+			return 0;
+
+		*op++ = *ip++;
+		lit++;
+
+		if (lit == LZ_MAX_LIT) {
+			*lit_ctrl = lit - 1;
+			lit = 0;
+
+			if (op >= out_end)
+				return 0;
+
+			lit_ctrl = op++;
+		}
+	}
+
+	if (lit)
+		*lit_ctrl = lit - 1;
+	else
+		op--;
+
+	return op - out;
+}
+
+/* returns the decompressed length or -1 on malformed input or if the output
+ * doesn't fit in out_len */
+ssize_t lz_decompress(const uint8_t *in, size_t in_len,
+		      uint8_t *out, size_t out_len)
+{
+	const uint8_t *ip = in, *in_end = in + in_len;
+	uint8_t *op = out, *out_end = out + out_len;
+	const uint8_t *ref;
+	unsigned int ctrl;
+	size_t len, off;
+
+	while (ip < in_end) {
+		ctrl = *ip++;
+
+		if (ctrl < LZ_MAX_LIT) {
+			len = ctrl + 1;
+			if (len > (size_t)(out_end - op) ||
+			    len > (size_t)(in_end - ip))
+				return -1;
+
+			memcpy(op, ip, len);
+			op += len;
+			ip += len;
+			continue;
+		}
+
+		len = ctrl >> 5;
+		if (len == 7) {
+			if (ip >= in_end)
+				return -1;
+			len += *ip++;
+		}
+		len += 2;
+
+		if (ip >= in_end)
+			return -1;
+		off = ((ctrl & 0x1f) << 8) + *ip++;
+
+		if (off >= (size_t)(op - out) || len > (size_t)(out_end - op))
+			return -1;
+
+		/* regions may overlap, copy byte by byte */
+		ref = op - off - 1;
+		while (len--)
+			*op++ = *ref++;
+	}
+
+	return op - out;
+}
@@ -0,0 +1,630 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include "alfred.h"
+#include "hash.h"
+#include "list.h"
+#include "packet.h"
+
+/* scratch space to compare against compressed payloads, grown on demand */
+static uint8_t *payload_scratch[2];
+static size_t payload_scratch_size;
+
+static int payload_scratch_reserve(size_t size)
+{
+	uint8_t *buf[2];
+
+	if (size <= payload_scratch_size)
+		return 0;
+
+	buf[0] = realloc(payload_scratch[0], size);
+	if (!buf[0])
+		return -1;
+	payload_scratch[0] = buf[0];
+
+	buf[1] = realloc(payload_scratch[1], size);
+	if (!buf[1])
+		return -1;
+	payload_scratch[1] = buf[1];
+
+	payload_scratch_size = size;
+
+	return 0;
+}
+
+static const uint8_t *payload_plain(struct payload *payload, int scratch)
+{
+	ssize_t len;
+
+	if (!payload->zlength)
+		return payload->buf;
+
+	if (payload_scratch_reserve(payload->length) < 0)
+		return NULL;
+
+	len = lz_decompress(payload->buf, payload->zlength,
+			    payload_scratch[scratch], payload->length);
+	if (len != payload->length)
+		return NULL;
+
+	return payload_scratch[scratch];
+}
+
+static int payload_compare(void *d1, void *d2)
+{
+	struct payload *p1 = d1, *p2 = d2;
+	const uint8_t *buf1, *buf2;
+
+	if (p1 == p2)
+		return 1;
+
+	if (p1->digest != p2->digest || p1->length != p2->length)
+		return 0;
+
+	buf1 = payload_plain(p1, 0);
+	buf2 = payload_plain(p2, 1);
+	if (!buf1 || !buf2)
+		return 0;
+
+	return memcmp(buf1, buf2, p1->length) == 0;
+}
+
+static int payload_choose(void *d1, int size)
+{
+	struct payload *p1 = d1;
+
+	return p1->digest % size;
+}
+
+int datastore_init(struct globals *globals)
+{
+	INIT_LIST_HEAD(&globals->data_lru);
+	globals->payload_hash = hash_new(128, payload_compare, payload_choose);
+	if (!globals->payload_hash)
+		return -1;
+
+	return 0;
+}
+
+/* memory consumed by a payload: body, payload struct and its hash bucket */
+static size_t payload_mem_size(const struct payload *payload)
+{
+	size_t size;
+
+	size = sizeof(*payload) + sizeof(struct element_t);
+	if (payload->zlength)
+		size += payload->zlength;
+	else
+		size += payload->length;
+
+	return size;
+}
+
+/* memory consumed by a dataset without its (shared) payload */
+static size_t dataset_mem_size(void)
+{
+	return sizeof(struct dataset) + sizeof(struct element_t);
+}
+
+/* find the pooled payload with the given content or add it to the pool. The
+ * returned payload holds an additional reference for the caller */
+static struct payload *payload_get(struct globals *globals,
+				   const uint8_t *buf, uint32_t len)
+{
+	struct payload search, *payload;
+
+	search.digest = digest64(buf, len);
+	search.length = len;
+	search.zlength = 0;
+	search.flags = 0;
+	search.buf = (uint8_t *)buf;
+
+	payload = hash_find(globals->payload_hash, &search);
+	if (payload) {
+		payload->refcount++;
+		return payload;
+	}
+
+	payload = malloc(sizeof(*payload));
+	if (!payload)
+		return NULL;
+
+	payload->buf = malloc(len);
+	if (!payload->buf) {
+		free(payload);
+		return NULL;
+	}
+
+	memcpy(payload->buf, buf, len);
+	payload->digest = search.digest;
+	payload->length = len;
+	payload->zlength = 0;
+	payload->flags = 0;
+	payload->refcount = 1;
+	payload->plain_users = 0;
+	clock_gettime(CLOCK_MONOTONIC, &payload->last_read);
+
+	if (hash_add(globals->payload_hash, payload)) {
+		free(payload->buf);
+		free(payload);
+		return NULL;
+	}
+
+	globals->data_mem_used += payload_mem_size(payload);
+
+	return payload;
+}
+
+/* add a payload prepared by the caller to the pool. If the content is
+ * already pooled, the existing payload is returned instead */
+struct payload *payload_adopt(struct globals *globals,
+			      struct payload *payload)
+{
+	struct payload *found;
+
+	found = hash_find(globals->payload_hash, payload);
+	if (found) {
+		found->refcount++;
+		return found;
+	}
+
+	payload->refcount = 1;
+	payload->plain_users = 0;
+	if (hash_add(globals->payload_hash, payload))
+		return NULL;
+
+	globals->data_mem_used += payload_mem_size(payload);
+
+	return payload;
+}
+
+static void payload_set_buf(struct payload *payload, uint8_t *buf)
+{
+	/* the snapshot mapping is released as a whole */
+	if (!(payload->flags & PAYLOAD_MAPPED))
+		free(payload->buf);
+
+	payload->flags &= ~PAYLOAD_MAPPED;
+	payload->buf = buf;
+}
+
+void payload_put(struct globals *globals, struct payload *payload)
+{
+	if (!payload)
+		return;
+
+	payload->refcount--;
+	if (payload->refcount > 0)
+		return;
+
+	hash_remove(globals->payload_hash, payload);
+	globals->data_mem_used -= payload_mem_size(payload);
+	payload_set_buf(payload, NULL);
+
+	if (payload->flags & PAYLOAD_SNAPSHOT)
+		snapshot_put(globals);
+	else
+		free(payload);
+}
+
+/* replace the compressed body by the plain one */
+static int payload_inflate(struct globals *globals, struct payload *payload)
+{
+	uint8_t *buf;
+	ssize_t len;
+
+	buf = malloc(payload->length);
+	if (!buf)
+		return -1;
+
+	len = lz_decompress(payload->buf, payload->zlength, buf,
+			    payload->length);
+	if (len != payload->length) {
+		free(buf);
+		return -1;
+	}
+
+	globals->data_mem_used -= payload_mem_size(payload);
+	payload_set_buf(payload, buf);
+	payload->zlength = 0;
+	globals->data_mem_used += payload_mem_size(payload);
+
+	return 0;
+}
+
+/* the dataset starts to use its payload. Datasets of types which are not kept
+ * compressed don't share compressed payloads, their reads would pay for the
+ * inflate */
+static void dataset_hold_payload(struct globals *globals,
+				 struct dataset *dataset)
+{
+	struct payload *payload = dataset->payload;
+
+	if (!payload || globals->compress[dataset->data.header.type].enabled)
+		return;
+
+	payload->plain_users++;
+	if (payload->zlength)
+		payload_inflate(globals, payload);
+}
+
+/* the dataset stops to use its payload */
+static void dataset_release_payload(struct globals *globals,
+				    struct dataset *dataset)
+{
+	struct payload *payload = dataset->payload;
+
+	if (!payload || globals->compress[dataset->data.header.type].enabled)
+		return;
+
+	payload->plain_users--;
+}
+
+struct dataset *dataset_add(struct globals *globals, struct alfred_data *data)
+{
+	struct dataset *dataset;
+
+	dataset = malloc(sizeof(*dataset));
+	if (!dataset)
+		return NULL;
+
+	dataset->payload = NULL;
+	dataset->data_source = SOURCE_SYNCED;
+	dataset->from_snapshot = 0;
+	dataset->revision = 0;
+	dataset->change_seq = ++globals->change_seq;
+	dataset->digest = 0;
+	dataset->base = NULL;
+	INIT_LIST_HEAD(&dataset->history);
+	INIT_LIST_HEAD(&dataset->lru);
+
+	memcpy(&dataset->data, data, sizeof(*data));
+	dataset->data.header.length = 0;
+	if (hash_add(globals->data_hash, dataset)) {
+		free(dataset);
+		return NULL;
+	}
+
+	globals->data_mem_used += dataset_mem_size();
+
+	return dataset;
+}
+
+/* add a dataset prepared by the caller to the data store */
+int dataset_adopt(struct globals *globals, struct dataset *dataset)
+{
+	if (hash_add(globals->data_hash, dataset))
+		return -1;
+
+	globals->data_mem_used += dataset_mem_size();
+	INIT_LIST_HEAD(&dataset->history);
+	dataset->digest = 0;
+	dataset->base = NULL;
+	merkle_update(globals, dataset);
+	dataset_hold_payload(globals, dataset);
+
+	/* a dataset handed off by another daemon keeps its change_seq, its
+	 * peers may already have acknowledged it */
+	if (!dataset->change_seq)
+		dataset->change_seq = ++globals->change_seq;
+	else if (dataset->change_seq > globals->change_seq)
+		globals->change_seq = dataset->change_seq;
+
+	if (dataset->data_source == SOURCE_SYNCED)
+		list_add_tail(&dataset->lru, &globals->data_lru);
+	else
+		INIT_LIST_HEAD(&dataset->lru);
+
+	return 0;
+}
+
+/* returns 1 if the payload was changed, 0 if it is unchanged and -1 on
+ * error */
+int dataset_set_data(struct globals *globals, struct dataset *dataset,
+		     uint8_t version, const uint8_t *buf, uint32_t len)
+{
+	struct payload *payload;
+
+	payload = payload_get(globals, buf, len);
+
+	/* that's not good */
+	if (!payload)
+		return -1;
+
+	if (payload == dataset->payload) {
+		if (dataset->data.header.version != version) {
+			dataset->data.header.version = version;
+			dataset->change_seq = ++globals->change_seq;
+			merkle_update(globals, dataset);
+		}
+
+		payload_put(globals, payload);
+		return 0;
+	}
+
+	if (dataset->payload)
+		history_add(globals, dataset, buf, len);
+
+	dataset_release_payload(globals, dataset);
+
+	/* the replaced content is kept as base of deltas to receivers which
+	 * got it */
+	payload_put(globals, dataset->base);
+	dataset->base = NULL;
+	if (globals->delta_sync && dataset->payload &&
+	    dataset->payload->length >= ALFRED_DELTA_MIN_SIZE) {
+		dataset->base = dataset->payload;
+		dataset->base_seq = dataset->change_seq;
+	} else {
+		payload_put(globals, dataset->payload);
+	}
+
+	dataset->data.header.version = version;
+	dataset->payload = payload;
+	dataset_hold_payload(globals, dataset);
+	dataset->revision++;
+	dataset->change_seq = ++globals->change_seq;
+	merkle_update(globals, dataset);
+	clock_gettime(CLOCK_MONOTONIC, &dataset->changed);
+
+	return 1;
+}
+
+static void payload_deflate(struct globals *globals, struct payload *payload)
+{
+	uint8_t *zbuf;
+	size_t zlen;
+
+	if (payload_scratch_reserve(payload->length) < 0)
+		return;
+
+	/* only worth it when at least an eighth is saved */
+	zlen = lz_compress(payload->buf, payload->length, payload_scratch[0],
+			   payload->length - payload->length / 8);
+	if (!zlen)
+		return;
+
+	zbuf = malloc(zlen);
+	if (!zbuf)
+		return;
+
+	memcpy(zbuf, payload_scratch[0], zlen);
+
+	globals->data_mem_used -= payload_mem_size(payload);
+	payload_set_buf(payload, zbuf);
+	payload->zlength = zlen;
+	globals->data_mem_used += payload_mem_size(payload);
+}
+
+static void payload_client_read(struct globals *globals,
+				struct payload *payload)
+{
+	clock_gettime(CLOCK_MONOTONIC, &payload->last_read);
+
+	if (payload->zlength)
+		payload_inflate(globals, payload);
+}
+
+/* copy the plain payload of the dataset to dst. Reads on behalf of a client
+ * keep the payload uncompressed until it turns cold again */
+int dataset_copy_data(struct globals *globals, struct dataset *dataset,
+		      uint8_t *dst, bool client_read)
+{
+	struct payload *payload = dataset->payload;
+	ssize_t len;
+
+	if (client_read)
+		payload_client_read(globals, payload);
+
+	if (!payload->zlength) {
+		memcpy(dst, payload->buf, payload->length);
+		return 0;
+	}
+
+	len = lz_decompress(payload->buf, payload->zlength, dst,
+			    payload->length);
+	if (len != payload->length)
+		return -1;
+
+	return 0;
+}
+
+/* plain content of the payload. Compressed payloads are decompressed into a
+ * buffer returned in alloc, which has to be freed by the caller */
+const uint8_t *payload_get_data(struct payload *payload, uint8_t **alloc)
+{
+	ssize_t len;
+
+	*alloc = NULL;
+
+	if (!payload->zlength)
+		return payload->buf;
+
+	*alloc = malloc(payload->length);
+	if (!*alloc)
+		return NULL;
+
+	len = lz_decompress(payload->buf, payload->zlength, *alloc,
+			    payload->length);
+	if (len != payload->length) {
+		free(*alloc);
+		*alloc = NULL;
+		return NULL;
+	}
+
+	return *alloc;
+}
+
+/* plain payload of the dataset, see payload_get_data() */
+const uint8_t *dataset_get_data(struct globals *globals,
+				struct dataset *dataset, bool client_read,
+				uint8_t **alloc)
+{
+	if (client_read)
+		payload_client_read(globals, dataset->payload);
+
+	return payload_get_data(dataset->payload, alloc);
+}
+
+void dataset_refresh(struct globals *globals, struct dataset *dataset)
+{
+	clock_gettime(CLOCK_MONOTONIC, &dataset->last_seen);
+
+	/* only synced data is a candidate for eviction. Keep it ordered by
+	 * the time of the last refresh */
+	if (dataset->data_source == SOURCE_SYNCED)
+		list_move_tail(&dataset->lru, &globals->data_lru);
+	else
+		list_del_init(&dataset->lru);
+}
+
+/* refresh a synced dataset with the time another master last received it
+ * from its source. These times are only a few rounds old, so moving the
+ * dataset to the end of the lru keeps it roughly ordered */
+void dataset_refresh_seen(struct globals *globals, struct dataset *dataset,
+			  const struct timespec *seen)
+{
+	dataset->last_seen = *seen;
+	list_move_tail(&dataset->lru, &globals->data_lru);
+}
+
+/* the dataset must already be removed from the data_hash */
+void dataset_free(struct globals *globals, struct dataset *dataset)
+{
+	globals->data_mem_used -= dataset_mem_size();
+	merkle_remove(globals, dataset);
+	list_del(&dataset->lru);
+	history_free(globals, dataset);
+	dataset_release_payload(globals, dataset);
+	payload_put(globals, dataset->base);
+	payload_put(globals, dataset->payload);
+
+	if (dataset->from_snapshot)
+		snapshot_put(globals);
+	else
+		free(dataset);
+}
+
+void dataset_remove(struct globals *globals, struct dataset *dataset)
+{
+	hash_remove(globals->data_hash, dataset);
+	dataset_free(globals, dataset);
+}
+
+void datastore_enforce_limit(struct globals *globals)
+{
+	struct dataset *dataset, *safe;
+
+	if (!globals->data_mem_limit)
+		return;
+
+	list_for_each_entry_safe(dataset, safe, &globals->data_lru, lru) {
+		if (globals->data_mem_used <= globals->data_mem_limit)
+			break;
+
+		changed_data_type(globals, dataset->data.header.type);
+
+		dataset_remove(globals, dataset);
+		globals->data_evicted++;
+	}
+}
+
+void datastore_compress_cold(struct globals *globals)
+{
+	struct hash_it_t *hashit = NULL;
+	struct timespec now, diff;
+	struct compress_policy *policy;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
+		struct dataset *dataset = hashit->bucket->data;
+		struct payload *payload = dataset->payload;
+
+		policy = &globals->compress[dataset->data.header.type];
+		if (!policy->enabled)
+			continue;
+
+		if (payload->zlength || payload->length < policy->min_size)
+			continue;
+
+		time_diff(&now, &payload->last_read, &diff);
+		if (diff.tv_sec < policy->idle_time)
+			continue;
+
+		/* readers of other types would pay for the inflate */
+		if (payload->plain_users)
+			continue;
+
+		payload_deflate(globals, payload);
+	}
+}
+
+void datastore_account(struct globals *globals,
+		       struct datastore_account *account)
+{
+	struct hash_it_t *hashit = NULL;
+
+	memset(account, 0, sizeof(*account));
+	account->datasets = globals->data_hash->elements;
+	account->mem_used = globals->data_mem_used;
+	account->evicted = globals->data_evicted;
+
+	while (NULL != (hashit = hash_iterate(globals->payload_hash, hashit))) {
+		struct payload *payload = hashit->bucket->data;
+
+		account->payloads++;
+		account->payload_bytes += payload->length;
+		account->dedup_saved += (payload->refcount - 1) *
+					(size_t)payload->length;
+
+		if (!payload->zlength) {
+			/* held back by datasets of uncompressed types */
+			if (payload->plain_users &&
+			    payload->plain_users < payload->refcount) {
+				account->compress_shared++;
+				account->compress_shared_bytes +=
+					payload->length;
+			}
+			continue;
+		}
+
+		account->compressed++;
+		account->compress_saved += payload->length - payload->zlength;
+	}
+
+	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
+		struct dataset *dataset = hashit->bucket->data;
+		struct history_entry *entry;
+
+		list_for_each_entry(entry, &dataset->history, list) {
+			account->history_entries++;
+			account->history_bytes += entry->delta_len;
+		}
+	}
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+/* Binary delta between two buffers. The delta describes the target as a
+ * sequence of operations, each started by an opcode byte:
+ *
+ *  DELTA_OP_INSERT <len> <len bytes>      bytes following in the delta
+ *  DELTA_OP_COPY <offset> <len>           bytes copied from the base
+ *
+ * Lengths and offsets are stored as LEB128 varints.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "alfred.h"
+
+#define DELTA_HASH_LOG		16
+#define DELTA_HASH_SIZE		(1 << DELTA_HASH_LOG)
+#define DELTA_MIN_MATCH		8
+
+enum delta_op {
+	DELTA_OP_INSERT = 0,
+	DELTA_OP_COPY = 1,
+};
+
+static uint32_t delta_hash(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	v ^= (uint32_t)p[4] << 3 ^ (uint32_t)p[5] << 11;
+
+	return (v * 2654435761u) >> (32 - DELTA_HASH_LOG);
+}
+
+static uint8_t *delta_put_varint(uint8_t *op, uint8_t *out_end, size_t val)
+{
+	do {
+		if (op >= out_end)
+			return NULL;
+
+		*op = val & 0x7f;
+		val >>= 7;
+		if (val)
+			*op |= 0x80;
+		op++;
+	} while (val);
+
+	return op;
+}
+
+static const uint8_t *delta_get_varint(const uint8_t *ip,
+				       const uint8_t *in_end, size_t *val)
+{
+	unsigned int shift = 0;
+
+	*val = 0;
+	do {
+		if (ip >= in_end || shift > 28)
+			return NULL;
+
+		*val |= (size_t)(*ip & 0x7f) << shift;
+		shift += 7;
+	} while (*ip++ & 0x80);
+
+	return ip;
+}
+
+static uint8_t *delta_put_insert(uint8_t *op, uint8_t *out_end,
+				 const uint8_t *lit, size_t len)
+{
+	if (!len)
+		return op;
+
+	if (op >= out_end)
+		return NULL;
+
+	*op++ = DELTA_OP_INSERT;
+	op = delta_put_varint(op, out_end, len);
+	if (!op || len > (size_t)(out_end - op))
+		return NULL;
+
+	memcpy(op, lit, len);
+
+	return op + len;
+}
+
+static uint8_t *delta_put_copy(uint8_t *op, uint8_t *out_end,
+			       size_t offset, size_t len)
+{
+	if (op >= out_end)
+		return NULL;
+
+	*op++ = DELTA_OP_COPY;
+	op = delta_put_varint(op, out_end, offset);
+	if (!op)
+		return NULL;
+
+	return delta_put_varint(op, out_end, len);
+}
+
+/* encode target as delta against base. Returns the delta length or 0 if it
+ * doesn't fit in out_len */
+size_t delta_encode(const uint8_t *base, size_t base_len,
+		    const uint8_t *target, size_t target_len,
+		    uint8_t *out, size_t out_len)
+{
+	static uint32_t htab[DELTA_HASH_SIZE];
+	const uint8_t *ip = target, *lit = target;
+	const uint8_t *target_end = target + target_len;
+	uint8_t *op = out, *out_end = out + out_len;
+	const uint8_t *ref;
+	size_t i, len, maxlen, copy_end = 0;
+	uint32_t h;
+
+	memset(htab, 0, sizeof(htab));
+
+	/* positions are stored incremented by one, 0 marks empty slots */
+	for (i = 0; i + DELTA_MIN_MATCH <= base_len; i++)
+		htab[delta_hash(base + i)] = i + 1;
+
+	while (ip + DELTA_MIN_MATCH <= target_end) {
+		/* content changed in place continues at the same position of
+		 * the base after the last copy. The hash table only keeps the
+		 * last of the positions with the same hash */
+		ref = base + copy_end + (ip - lit);
+		if (copy_end + (ip - lit) + DELTA_MIN_MATCH > base_len ||
+		    memcmp(ref, ip, DELTA_MIN_MATCH) != 0) {
+			h = delta_hash(ip);
+			if (!htab[h]) {
+				ip++;
+				continue;
+			}
+
+			ref = base + htab[h] - 1;
+		}
+
+		maxlen = base + base_len - ref;
+		if (maxlen > (size_t)(target_end - ip))
+			maxlen = target_end - ip;
+
+		len = 0;
+		while (len < maxlen && ref[len] == ip[len])
+			len++;
+
+		if (len < DELTA_MIN_MATCH) {
+			ip++;
+			continue;
+		}
+
+		/* grow the match backwards into the pending literals */
+		while (ip > lit && ref > base && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+			len++;
+		}
+
+		op = delta_put_insert(op, out_end, lit, ip - lit);
+		if (!op)
+			return 0;
+
+		op = delta_put_copy(op, out_end, ref - base, len);
+		if (!op)
+			return 0;
+
+		ip += len;
+		lit = ip;
+		copy_end = ref - base + len;
+	}
+
+	op = delta_put_insert(op, out_end, lit, target_end - lit);
+	if (!op)
+		return 0;
+
+	return op - out;
+}
+
+/* rebuild the target from base and delta. Returns the target length or -1
+ * on malformed input or if the output doesn't fit in out_len */
+ssize_t delta_apply(const uint8_t *base, size_t base_len,
+		    const uint8_t *delta, size_t delta_len,
+		    uint8_t *out, size_t out_len)
+{
+	const uint8_t *ip = delta, *in_end = delta + delta_len;
+	uint8_t *op = out, *out_end = out + out_len;
+	size_t offset, len;
+	uint8_t opcode;
+
+	while (ip < in_end) {
+		opcode = *ip++;
+
+		switch (opcode) {
+		case DELTA_OP_INSERT:
+			ip = delta_get_varint(ip, in_end, &len);
+			if (!ip || len > (size_t)(in_end - ip) ||
+			    len > (size_t)(out_end - op))
+				return -1;
+
+			memcpy(op, ip, len);
+			ip += len;
+			break;
+		case DELTA_OP_COPY:
+			ip = delta_get_varint(ip, in_end, &offset);
+			if (!ip)
+				return -1;
+
+			ip = delta_get_varint(ip, in_end, &len);
+			if (!ip || offset > base_len ||
+			    len > base_len - offset ||
+			    len > (size_t)(out_end - op))
+				return -1;
+
+			memcpy(op, base + offset, len);
+			break;
+		default:
+			return -1;
+		}
+
+		op += len;
+	}
+
+	return op - out;
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+/* XOR parity over groups of consecutive packets of a transaction. The
+ * receiver rebuilds one lost packet per group before it checks the packet
+ * count announced by the txend packet. */
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alfred.h"
+#include "packet.h"
+
+/**
+ * struct fec_group - parity of the packets sent in the current group
+ * @group_size: packets covered by one parity packet
+ * @count: packets added to the current group
+ * @max_len: longest packet data in the current group
+ * @buf: alfred_parity_v0 packet of the current group
+ */
+struct fec_group {
+	uint8_t group_size;
+	uint8_t count;
+	size_t max_len;
+	uint8_t buf[MAX_PAYLOAD];
+};
+
+struct fec_group *fec_new(uint8_t group_size, uint16_t tx_id)
+{
+	struct alfred_parity_v0 *parity;
+	struct fec_group *fec;
+
+	fec = malloc(sizeof(*fec));
+	if (!fec)
+		return NULL;
+
+	fec->group_size = group_size;
+	fec->count = 0;
+	fec->max_len = 0;
+
+	parity = (struct alfred_parity_v0 *)fec->buf;
+	parity->header.type = ALFRED_PARITY;
+	parity->header.version = ALFRED_VERSION;
+	parity->tx.id = tx_id;
+
+	return fec;
+}
+
+static void fec_xor(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+/* add a sent alfred_push_data_v0 or alfred_push_chunk_v0 packet to the
+ * parity, the parity is sent when the group is complete */
+void fec_add(struct fec_group *fec, struct interface *interface,
+	     const struct in6_addr *dest, const void *packet, size_t len)
+{
+	const struct alfred_push_data_v0 *push = packet;
+	struct alfred_parity_v0 *parity;
+	size_t data_len;
+
+	if (!fec)
+		return;
+
+	parity = (struct alfred_parity_v0 *)fec->buf;
+	data_len = len - sizeof(*push);
+
+	if (fec->count == 0) {
+		parity->tx.seqno = push->tx.seqno;
+		parity->type = 0;
+		parity->length = 0;
+	}
+
+	/* shorter packets are padded with zeros */
+	if (data_len > fec->max_len) {
+		memset(parity->data + fec->max_len, 0,
+		       data_len - fec->max_len);
+		fec->max_len = data_len;
+	}
+
+	fec_xor(parity->data, (const uint8_t *)packet + sizeof(*push),
+		data_len);
+	parity->type ^= push->header.type;
+	parity->length ^= push->header.length;
+	fec->count++;
+
+	if (fec->count == fec->group_size)
+		fec_flush(fec, interface, dest);
+}
+
+void fec_flush(struct fec_group *fec, struct interface *interface,
+	       const struct in6_addr *dest)
+{
+	struct alfred_parity_v0 *parity;
+	size_t tlv_length;
+
+	if (!fec || !fec->count)
+		return;
+
+	parity = (struct alfred_parity_v0 *)fec->buf;
+
+	tlv_length = sizeof(*parity) - sizeof(parity->header) + fec->max_len;
+	parity->header.length = htons(tlv_length);
+	parity->count = fec->count;
+
+	send_alfred_packet(interface, dest, parity,
+			   sizeof(*parity) + fec->max_len);
+
+	fec->count = 0;
+	fec->max_len = 0;
+}
+
+int fec_store_parity(struct globals *globals, struct transaction_head *head,
+		     struct alfred_parity_v0 *parity)
+{
+	size_t len = ntohs(parity->header.length) + sizeof(parity->header);
+
+	if (transaction_charge(globals, head, len) < 0)
+		return -1;
+
+	if (buffer_grow(&head->parity, &head->parity_size,
+			head->parity_len + len, MAX_PAYLOAD) < 0)
+		return -1;
+
+	memcpy(head->parity + head->parity_len, parity, len);
+	head->parity_len += len;
+
+	return 0;
+}
+
+/* rebuild the single missing packet of the group covered by parity */
+static void fec_recover_group(struct globals *globals,
+			      struct transaction_head *head,
+			      struct alfred_parity_v0 *parity,
+			      const uint32_t *offsets, uint16_t missing)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct alfred_push_data_v0 *push, *rebuilt;
+	size_t parity_len, data_len;
+	uint16_t first, seqno;
+	uint8_t type;
+	uint16_t length;
+
+	parity_len = ntohs(parity->header.length) -
+		     (sizeof(*parity) - sizeof(parity->header));
+	first = ntohs(parity->tx.seqno);
+
+	rebuilt = (struct alfred_push_data_v0 *)buf;
+	memcpy(buf + sizeof(*rebuilt), parity->data, parity_len);
+	type = parity->type;
+	length = parity->length;
+
+	for (seqno = first; seqno < first + parity->count; seqno++) {
+		if (seqno == missing)
+			continue;
+
+		push = (struct alfred_push_data_v0 *)(head->buf +
+						      offsets[seqno]);
+		data_len = ntohs(push->header.length) -
+			   (sizeof(*push) - sizeof(push->header));
+		if (data_len > parity_len)
+			return;
+
+		fec_xor(buf + sizeof(*rebuilt),
+			(uint8_t *)push + sizeof(*push), data_len);
+		type ^= push->header.type;
+		length ^= push->header.length;
+	}
+
+	data_len = ntohs(length);
+	if (data_len < sizeof(*rebuilt) - sizeof(rebuilt->header))
+		return;
+
+	data_len -= sizeof(*rebuilt) - sizeof(rebuilt->header);
+	if (data_len > parity_len)
+		return;
+
+	rebuilt->header.type = type;
+	rebuilt->header.version = ALFRED_VERSION;
+	rebuilt->header.length = length;
+	rebuilt->tx.id = parity->tx.id;
+	rebuilt->tx.seqno = htons(missing);
+
+	if (push_packet_check(rebuilt) < 0)
+		return;
+
+	if (transaction_add_packet(globals, head, rebuilt) == 0)
+		globals->fec_rebuilt++;
+}
+
+/* rebuild lost packets of the transaction with num_packet packets from the
+ * received parity packets */
+void fec_recover(struct globals *globals, struct transaction_head *head,
+		 uint16_t num_packet)
+{
+	struct alfred_parity_v0 *parity;
+	struct alfred_push_data_v0 *push;
+	uint32_t *offsets;
+	uint16_t first, seqno, missing;
+	unsigned int num_missing;
+	size_t pos, len;
+
+	if (!head->parity_len)
+		return;
+
+	offsets = malloc(num_packet * sizeof(*offsets));
+	if (!offsets)
+		return;
+
+	for (seqno = 0; seqno < num_packet; seqno++)
+		offsets[seqno] = UINT32_MAX;
+
+	for (pos = 0; pos < head->buf_len; pos += len) {
+		push = (struct alfred_push_data_v0 *)(head->buf + pos);
+		len = ntohs(push->header.length) + sizeof(push->header);
+		seqno = ntohs(push->tx.seqno);
+
+		if (seqno < num_packet)
+			offsets[seqno] = pos;
+	}
+
+	for (pos = 0; pos < head->parity_len; pos += len) {
+		parity = (struct alfred_parity_v0 *)(head->parity + pos);
+		len = ntohs(parity->header.length) + sizeof(parity->header);
+		first = ntohs(parity->tx.seqno);
+
+		if (first >= num_packet || parity->count > num_packet - first)
+			continue;
+
+		num_missing = 0;
+		missing = 0;
+		for (seqno = first; seqno < first + parity->count; seqno++) {
+			if (offsets[seqno] != UINT32_MAX)
+				continue;
+
+			num_missing++;
+			missing = seqno;
+		}
+
+		if (num_missing == 1)
+			fec_recover_group(globals, head, parity, offsets,
+					  missing);
+	}
+
+	free(offsets);
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+/* Epidemic synchronization between masters. Every round a master syncs with
+ * a few randomly chosen masters instead of all of them. Changed datasets are
+ * relayed by every master which received them, the refresh times of the
+ * datasets are spread the same way with alfred_ages_v0 packets. With M
+ * masters and a fanout of k, a change reaches all masters within O(log M)
+ * rounds with high probability while each round only sends k syncs per
+ * master. */
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "alfred.h"
+#include "hash.h"
+#include "list.h"
+#include "packet.h"
+
+/* datasets changed after the change sequence number since, highest priority
+ * first. First hand datasets are always sent. Synced ones are only relayed
+ * in deltas, a full sync would refresh copies the sender may hold long after
+ * their source stopped sending them */
+static size_t gossip_collect(struct globals *globals, struct dataset **datasets,
+			     uint32_t since)
+{
+	struct hash_it_t *hashit = NULL;
+	struct type_policy *policy;
+	size_t count = 0;
+	int priority;
+
+	for (priority = policy_next_priority(globals, 256); priority >= 0;
+	     priority = policy_next_priority(globals, priority)) {
+		while (NULL != (hashit = hash_iterate(globals->data_hash,
+						      hashit))) {
+			struct dataset *dataset = hashit->bucket->data;
+
+			if (!dataset->payload || dataset->change_seq <= since)
+				continue;
+
+			if (dataset->data_source == SOURCE_SYNCED && !since)
+				continue;
+
+			policy = &globals->policy[dataset->data.header.type];
+			if (policy->priority != priority || !policy->sync)
+				continue;
+
+			datasets[count++] = dataset;
+		}
+	}
+
+	return count;
+}
+
+static void gossip_send_ages(struct globals *globals,
+			     struct interface *interface,
+			     struct in6_addr *dest, struct timespec *now)
+{
+	struct hash_it_t *hashit = NULL;
+	uint8_t buf[MAX_PAYLOAD];
+	struct alfred_ages_v0 *ages;
+	struct alfred_age_v0 *age;
+	size_t count = 0, max_count;
+	struct timespec diff;
+
+	ages = (struct alfred_ages_v0 *)buf;
+	ages->header.type = ALFRED_AGES;
+	ages->header.version = ALFRED_VERSION;
+	max_count = (netsock_max_packet(interface) - sizeof(*ages)) /
+		    sizeof(*age);
+
+	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
+		struct dataset *dataset = hashit->bucket->data;
+
+		if (!globals->policy[dataset->data.header.type].sync)
+			continue;
+
+		time_diff(now, &dataset->last_seen, &diff);
+
+		age = &ages->ages[count++];
+		memcpy(age->source, dataset->data.source, ETH_ALEN);
+		age->type = dataset->data.header.type;
+		age->age = htonl(diff.tv_sec);
+
+		if (count < max_count)
+			continue;
+
+		ages->header.length = htons(count * sizeof(*age));
+		send_alfred_packet(interface, dest, ages,
+				   sizeof(*ages) + count * sizeof(*age));
+		count = 0;
+	}
+
+	if (!count)
+		return;
+
+	ages->header.length = htons(count * sizeof(*age));
+	send_alfred_packet(interface, dest, ages,
+			   sizeof(*ages) + count * sizeof(*age));
+}
+
+/* send the changes since the last acknowledged sync, all datasets when a
+ * full sync is due, and the refresh times of all datasets to a master */
+static void gossip_server(struct globals *globals,
+			  struct gossip_target *target, struct timespec *now)
+{
+	struct dataset **datasets;
+	struct peer *peer = target->peer;
+	uint32_t since;
+	uint16_t tx_id;
+	size_t count;
+
+	datasets = malloc((globals->data_hash->elements + 1) *
+			  sizeof(*datasets));
+	if (!datasets)
+		return;
+
+	since = sync_since(globals, peer, now);
+
+	tx_id = get_random_id();
+	peer->sync_seq = globals->change_seq;
+
+	/* a sync split into several transactions is acknowledged with the
+	 * last one */
+	count = gossip_collect(globals, datasets, since);
+	peer->sync_id = push_datasets(globals, target->interface,
+				      &target->server->address, datasets,
+				      count, tx_id);
+	free(datasets);
+
+	gossip_send_ages(globals, target->interface, &target->server->address,
+			 now);
+
+	if (peer->caps & ALFRED_CAP_MERKLE)
+		merkle_send_root(globals, target->interface,
+				 &target->server->address);
+}
+
+/* sync with globals->gossip_fanout masters picked at random out of targets */
+void gossip_round(struct globals *globals, struct gossip_target *targets,
+		  size_t count, struct timespec *now)
+{
+	struct gossip_target tmp;
+	size_t i, j;
+
+	globals->gossip_rounds++;
+
+	for (i = 0; i < count && i < globals->gossip_fanout; i++) {
+		j = i + random() % (count - i);
+
+		tmp = targets[i];
+		targets[i] = targets[j];
+		targets[j] = tmp;
+
+		gossip_server(globals, &targets[i], now);
+	}
+}
+
+int gossip_receive_ages(struct globals *globals,
+			struct alfred_ages_v0 *ages)
+{
+	struct alfred_data search;
+	struct dataset *dataset;
+	struct timespec now, seen, diff;
+	size_t count, i;
+	uint32_t age;
+
+	if (globals->opmode != OPMODE_MASTER)
+		return -1;
+
+	count = ntohs(ages->header.length) / sizeof(ages->ages[0]);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i = 0; i < count; i++) {
+		memcpy(search.source, ages->ages[i].source, ETH_ALEN);
+		search.header.type = ages->ages[i].type;
+
+		dataset = hash_find(globals->data_hash, &search);
+		if (!dataset || dataset->data_source != SOURCE_SYNCED)
+			continue;
+
+		age = ntohl(ages->ages[i].age);
+		if (age >= globals->policy[search.header.type].timeout)
+			continue;
+
+		/* our copy was refreshed more recently */
+		time_diff(&now, &dataset->last_seen, &diff);
+		if (diff.tv_sec <= age)
+			continue;
+
+		seen = now;
+		seen.tv_sec -= age;
+		dataset_refresh_seen(globals, dataset, &seen);
+		globals->gossip_refreshed++;
+	}
+
+	return 0;
+}
+
+/* time since the synced datasets were refreshed by their source, as seen by
+ * this master. It stays bounded by a few rounds when the masters converge */
+void gossip_staleness(struct globals *globals, long *max_age, long *mean_age)
+{
+	struct dataset *dataset;
+	struct timespec now, diff;
+	long long sum = 0;
+	size_t count = 0;
+
+	*max_age = 0;
+	*mean_age = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	list_for_each_entry(dataset, &globals->data_lru, lru) {
+		time_diff(&now, &dataset->last_seen, &diff);
+		if (diff.tv_sec > *max_age)
+			*max_age = diff.tv_sec;
+
+		sum += diff.tv_sec;
+		count++;
+	}
+
+	if (count)
+		*mean_age = sum / count;
+}
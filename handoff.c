@@ -0,0 +1,906 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+/* State handoff between a running daemon and its replacement. The new daemon
+ * connects to the unix socket and sends an ALFRED_HANDOFF request. The old
+ * daemon answers with a single message carrying all file descriptors (unix
+ * listening socket, data store snapshot in a temporary file, network sockets
+ * and the client sockets of pending requests) followed by a stream of records
+ * describing the interfaces, known servers, peers, sync state, in-flight
+ * transactions and the transactions cached for retransmission. Only root and
+ * the user of the daemon may request the handoff.
+ *
+ * Both sides always run on the same host, so the records are in host byte
+ * order.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "alfred.h"
+#include "hash.h"
+#include "list.h"
+#include "packet.h"
+
+/* limited by SCM_MAX_FD of the kernel */
+#define HANDOFF_MAX_FDS		253
+#define HANDOFF_NO_FD		0xffff
+#define HANDOFF_NEVER		UINT32_MAX
+
+enum handoff_record_type {
+	HANDOFF_INTERFACE,
+	HANDOFF_SERVER,
+	HANDOFF_TRANSACTION,
+	HANDOFF_END,
+	HANDOFF_PEER,
+	HANDOFF_SYNC,
+	HANDOFF_RETRANSMIT,
+};
+
+struct handoff_hello {
+	struct alfred_tlv header;
+	uint16_t num_fds;
+} __packed;
+
+struct handoff_interface {
+	struct alfred_tlv header;
+	char name[IFNAMSIZ];
+	struct ether_addr hwaddr;
+	struct in6_addr address;
+	uint32_t scope_id;
+	uint16_t netsock;
+	uint16_t netsock_mcast;
+} __packed;
+
+struct handoff_server {
+	struct alfred_tlv header;
+	char iface[IFNAMSIZ];
+	struct ether_addr hwaddr;
+	struct in6_addr address;
+	uint32_t age;
+	uint8_t tq;
+} __packed;
+
+struct handoff_peer {
+	struct alfred_tlv header;
+	struct ether_addr hwaddr;
+	uint32_t caps;
+	uint32_t age;
+	uint16_t sync_id;
+	uint32_t sync_seq;
+	uint32_t acked_seq;
+	uint32_t full_sync;
+	uint32_t mcast_seq;
+	uint32_t mcast_round;
+	uint16_t mcast_id;
+	uint32_t repair_time;
+} __packed;
+
+/* sync state of the daemon which peers refer to */
+struct handoff_sync {
+	struct alfred_tlv header;
+	uint32_t change_seq;
+	uint32_t mcast_round;
+	uint32_t mcast_sync_seq;
+	uint32_t mcast_full_sync;
+	struct ether_addr local_push_server;
+	uint32_t local_push_seq;
+} __packed;
+
+/* followed by num_packet alfred_push_data_v0 packets and parity_len bytes of
+ * alfred_parity_v0 packets */
+struct handoff_transaction {
+	struct alfred_tlv header;
+	struct ether_addr server_addr;
+	uint16_t id;
+	uint8_t requested_type;
+	uint8_t request;
+	uint8_t hedges;
+	uint8_t nacks;
+	uint32_t deadline;
+	uint16_t client_socket;
+	uint16_t num_packet;
+	uint32_t parity_len;
+	uint32_t started;
+	uint32_t age;
+} __packed;
+
+/* followed by buf_len bytes of cached packets */
+struct handoff_retransmit {
+	struct alfred_tlv header;
+	struct in6_addr address;
+	uint16_t id;
+	uint16_t num_packet;
+	uint8_t retries;
+	uint32_t age;
+	uint32_t buf_len;
+} __packed;
+
+/* age of a timestamp in milliseconds, HANDOFF_NEVER for an unset one */
+static uint32_t handoff_age(struct timespec *now, struct timespec *ts)
+{
+	struct timespec diff;
+	uint64_t age;
+
+	if (ts->tv_sec == 0 && ts->tv_nsec == 0)
+		return HANDOFF_NEVER;
+
+	if (!time_diff(now, ts, &diff))
+		return 0;
+
+	age = (uint64_t)diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+	if (age >= HANDOFF_NEVER)
+		return HANDOFF_NEVER - 1;
+
+	return age;
+}
+
+static void handoff_set_age(struct timespec *now, struct timespec *ts,
+			    uint32_t age)
+{
+	if (age == HANDOFF_NEVER) {
+		memset(ts, 0, sizeof(*ts));
+		return;
+	}
+
+	*ts = *now;
+	ts->tv_sec -= age / 1000;
+	ts->tv_nsec -= (age % 1000) * 1000000;
+	if (ts->tv_nsec < 0) {
+		ts->tv_nsec += 1000000000;
+		ts->tv_sec--;
+	}
+}
+
+/* the snapshot is written to an unlinked temporary file whose descriptor is
+ * passed on, the new daemon maps it like a snapshot file */
+static FILE *handoff_snapshot(struct globals *globals)
+{
+	FILE *fp;
+
+	fp = tmpfile();
+	if (!fp) {
+		perror("can't create handoff snapshot");
+		return NULL;
+	}
+
+	if (snapshot_write_fp(globals, fp) < 0 || fflush(fp) != 0) {
+		fclose(fp);
+		return NULL;
+	}
+
+	return fp;
+}
+
+static uint16_t handoff_add_fd(int *fds, uint16_t *num_fds, int fd)
+{
+	if (fd < 0 || *num_fds >= HANDOFF_MAX_FDS)
+		return HANDOFF_NO_FD;
+
+	fds[*num_fds] = fd;
+	return (*num_fds)++;
+}
+
+static int handoff_send_fds(int sock, int *fds, uint16_t num_fds)
+{
+	struct handoff_hello hello;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+
+	hello.header.type = ALFRED_HANDOFF;
+	hello.header.version = ALFRED_VERSION;
+	hello.header.length = htons(sizeof(hello) - sizeof(hello.header));
+	hello.num_fds = num_fds;
+
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+
+	if (sendmsg(sock, &msg, 0) != sizeof(hello))
+		return -1;
+
+	return 0;
+}
+
+static int handoff_send_transaction(int sock, struct transaction_head *head,
+				    uint16_t client_socket,
+				    struct timespec *now)
+{
+	struct handoff_transaction record;
+
+	memset(&record, 0, sizeof(record));
+	record.header.type = HANDOFF_TRANSACTION;
+	record.header.length = sizeof(record) - sizeof(record.header);
+	record.server_addr = head->server_addr;
+	record.id = head->id;
+	record.requested_type = head->requested_type;
+	record.request = head->request;
+	record.hedges = head->hedges;
+	record.nacks = head->nacks;
+	record.deadline = head->deadline;
+	record.client_socket = client_socket;
+	/* staged transactions are handed off without packets, the sender
+	 * retransmits them on nack */
+	if (head->buf_len) {
+		record.num_packet = head->num_packet;
+		record.parity_len = head->parity_len;
+	}
+	record.started = handoff_age(now, &head->started);
+	record.age = handoff_age(now, &head->last_rx_time);
+
+	if (write_full(sock, &record, sizeof(record)) < 0)
+		return -1;
+
+	/* the packets are already stored back to back */
+	if (write_full(sock, head->buf, head->buf_len) < 0)
+		return -1;
+
+	return write_full(sock, head->parity, record.parity_len);
+}
+
+static int handoff_send_peers(int sock, struct globals *globals,
+			      struct timespec *now)
+{
+	struct hash_it_t *hashit = NULL;
+	struct handoff_peer record;
+
+	memset(&record, 0, sizeof(record));
+	record.header.type = HANDOFF_PEER;
+	record.header.length = sizeof(record) - sizeof(record.header);
+
+	while (NULL != (hashit = hash_iterate(globals->peer_hash, hashit))) {
+		struct peer *peer = hashit->bucket->data;
+
+		record.hwaddr = peer->hwaddr;
+		record.caps = peer->caps;
+		record.age = handoff_age(now, &peer->last_seen);
+		record.sync_id = peer->sync_id;
+		record.sync_seq = peer->sync_seq;
+		record.acked_seq = peer->acked_seq;
+		record.full_sync = handoff_age(now, &peer->full_sync);
+		record.mcast_seq = peer->mcast_seq;
+		record.mcast_round = peer->mcast_round;
+		record.mcast_id = peer->mcast_id;
+		record.repair_time = handoff_age(now, &peer->repair_time);
+
+		if (write_full(sock, &record, sizeof(record)) < 0) {
+			hash_iterate_free(hashit);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int handoff_send_sync(int sock, struct globals *globals,
+			     struct timespec *now)
+{
+	struct handoff_sync record;
+
+	memset(&record, 0, sizeof(record));
+	record.header.type = HANDOFF_SYNC;
+	record.header.length = sizeof(record) - sizeof(record.header);
+	record.change_seq = globals->change_seq;
+	record.mcast_round = globals->mcast_round;
+	record.mcast_sync_seq = globals->mcast_sync_seq;
+	record.mcast_full_sync = handoff_age(now, &globals->mcast_full_sync);
+	record.local_push_server = globals->local_push_server;
+	record.local_push_seq = globals->local_push_seq;
+
+	return write_full(sock, &record, sizeof(record));
+}
+
+static int handoff_send_retransmits(int sock, struct globals *globals,
+				    struct timespec *now)
+{
+	struct hash_it_t *hashit = NULL;
+	struct handoff_retransmit record;
+
+	memset(&record, 0, sizeof(record));
+	record.header.type = HANDOFF_RETRANSMIT;
+	record.header.length = sizeof(record) - sizeof(record.header);
+
+	while (NULL != (hashit = hash_iterate(globals->retransmit_hash,
+					      hashit))) {
+		struct retransmit_cache *cache = hashit->bucket->data;
+
+		record.address = cache->address;
+		record.id = cache->id;
+		record.num_packet = cache->num_packet;
+		record.retries = cache->retries;
+		record.age = handoff_age(now, &cache->created);
+		record.buf_len = cache->buf_len;
+
+		if (write_full(sock, &record, sizeof(record)) < 0 ||
+		    write_full(sock, cache->buf, cache->buf_len) < 0) {
+			hash_iterate_free(hashit);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* only root and the user of the daemon may take over its sockets */
+static bool handoff_allowed(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		perror("can't get credentials of handoff client");
+		return false;
+	}
+
+	return cred.uid == 0 || cred.uid == geteuid();
+}
+
+int handoff_send(struct globals *globals, int client_sock)
+{
+	struct hash_it_t *hashit = NULL;
+	struct handoff_interface iface_record;
+	struct handoff_server server_record;
+	struct alfred_tlv end;
+	struct interface *interface;
+	struct timespec now;
+	int fds[HANDOFF_MAX_FDS];
+	uint16_t num_fds = 0, client_fd;
+	FILE *snapshot;
+	int ret = -1;
+
+	if (!handoff_allowed(client_sock)) {
+		fprintf(stderr, "refused handoff to unprivileged client\n");
+		close(client_sock);
+		return -1;
+	}
+
+	snapshot = handoff_snapshot(globals);
+	if (!snapshot)
+		goto out;
+
+	handoff_add_fd(fds, &num_fds, globals->unix_sock);
+	handoff_add_fd(fds, &num_fds, fileno(snapshot));
+
+	memset(&iface_record, 0, sizeof(iface_record));
+	iface_record.header.type = HANDOFF_INTERFACE;
+	iface_record.header.length = sizeof(iface_record) -
+				     sizeof(iface_record.header);
+
+	/* the file descriptors are sent first, the records referencing them
+	 * are prepared with the same iteration order afterwards */
+	list_for_each_entry(interface, &globals->interfaces, list) {
+		handoff_add_fd(fds, &num_fds, interface->netsock);
+		handoff_add_fd(fds, &num_fds, interface->netsock_mcast);
+	}
+
+	while (NULL != (hashit = hash_iterate(globals->transaction_hash,
+					      hashit))) {
+		struct transaction_head *head = hashit->bucket->data;
+
+		handoff_add_fd(fds, &num_fds, head->client_socket);
+	}
+
+	if (handoff_send_fds(client_sock, fds, num_fds) < 0) {
+		perror("can't send handoff file descriptors");
+		goto out;
+	}
+
+	/* the new daemon owns the sockets from now on */
+	globals->handed_off = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	num_fds = 2;
+
+	list_for_each_entry(interface, &globals->interfaces, list) {
+		strncpy(iface_record.name, interface->interface,
+			sizeof(iface_record.name));
+		iface_record.name[sizeof(iface_record.name) - 1] = '\0';
+		iface_record.hwaddr = interface->hwaddr;
+		iface_record.address = interface->address;
+		iface_record.scope_id = interface->scope_id;
+		iface_record.netsock = handoff_add_fd(fds, &num_fds,
+						      interface->netsock);
+		iface_record.netsock_mcast = handoff_add_fd(fds, &num_fds,
+							    interface->netsock_mcast);
+
+		if (write_full(client_sock, &iface_record,
+			       sizeof(iface_record)) < 0)
+			goto out;
+
+		memset(&server_record, 0, sizeof(server_record));
+		server_record.header.type = HANDOFF_SERVER;
+		server_record.header.length = sizeof(server_record) -
+					      sizeof(server_record.header);
+		memcpy(server_record.iface, iface_record.name,
+		       sizeof(server_record.iface));
+
+		while (NULL != (hashit = hash_iterate(interface->server_hash,
+						      hashit))) {
+			struct server *server = hashit->bucket->data;
+
+			server_record.hwaddr = server->hwaddr;
+			server_record.address = server->address;
+			server_record.age = handoff_age(&now,
+							&server->last_seen);
+			server_record.tq = server->tq;
+
+			if (write_full(client_sock, &server_record,
+				       sizeof(server_record)) < 0) {
+				hash_iterate_free(hashit);
+				goto out;
+			}
+		}
+	}
+
+	/* peers are known before their transactions are charged to them */
+	if (handoff_send_peers(client_sock, globals, &now) < 0 ||
+	    handoff_send_sync(client_sock, globals, &now) < 0)
+		goto out;
+
+	while (NULL != (hashit = hash_iterate(globals->transaction_hash,
+					      hashit))) {
+		struct transaction_head *head = hashit->bucket->data;
+
+		/* finished transactions only wait for the cleanup */
+		client_fd = handoff_add_fd(fds, &num_fds, head->client_socket);
+		if (head->finished != 0)
+			continue;
+
+		if (handoff_send_transaction(client_sock, head, client_fd,
+					     &now) < 0) {
+			hash_iterate_free(hashit);
+			goto out;
+		}
+	}
+
+	if (handoff_send_retransmits(client_sock, globals, &now) < 0)
+		goto out;
+
+	memset(&end, 0, sizeof(end));
+	end.type = HANDOFF_END;
+	if (write_full(client_sock, &end, sizeof(end)) < 0)
+		goto out;
+
+	ret = 0;
+out:
+	if (globals->handed_off && ret < 0)
+		fprintf(stderr, "failed to send the complete handoff state\n");
+
+	if (snapshot)
+		fclose(snapshot);
+	close(client_sock);
+
+	return ret;
+}
+
+static int handoff_receive_fds(int sock, int *fds, uint16_t *num_fds)
+{
+	struct handoff_hello hello;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t len;
+
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello))
+		return -1;
+
+	if (hello.header.type != ALFRED_HANDOFF)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+
+	len = cmsg->cmsg_len - CMSG_LEN(0);
+	*num_fds = len / sizeof(int);
+	if (*num_fds != hello.num_fds || *num_fds < 2)
+		return -1;
+
+	memcpy(fds, CMSG_DATA(cmsg), len);
+
+	return 0;
+}
+
+static int handoff_fd(int *fds, uint16_t num_fds, uint16_t index)
+{
+	int fd;
+
+	if (index >= num_fds)
+		return -1;
+
+	/* each descriptor may only be taken once */
+	fd = fds[index];
+	fds[index] = -1;
+
+	return fd;
+}
+
+static void handoff_receive_interface(struct globals *globals,
+				      struct handoff_interface *record,
+				      int *fds, uint16_t num_fds)
+{
+	struct interface *interface;
+	int netsock, netsock_mcast;
+
+	netsock = handoff_fd(fds, num_fds, record->netsock);
+	netsock_mcast = handoff_fd(fds, num_fds, record->netsock_mcast);
+
+	record->name[sizeof(record->name) - 1] = '\0';
+	interface = netsock_find_interface(globals, record->name);
+
+	/* interface is not used anymore or was closed in the old daemon */
+	if (!interface || netsock < 0 || netsock_mcast < 0) {
+		if (netsock >= 0)
+			close(netsock);
+		if (netsock_mcast >= 0)
+			close(netsock_mcast);
+		return;
+	}
+
+	interface->hwaddr = record->hwaddr;
+	interface->address = record->address;
+	interface->scope_id = record->scope_id;
+	interface->netsock = netsock;
+	interface->netsock_mcast = netsock_mcast;
+}
+
+static void handoff_receive_server(struct globals *globals,
+				   struct handoff_server *record,
+				   struct timespec *now)
+{
+	struct interface *interface;
+	struct server *server;
+
+	record->iface[sizeof(record->iface) - 1] = '\0';
+	interface = netsock_find_interface(globals, record->iface);
+	if (!interface)
+		return;
+
+	if (hash_find(interface->server_hash, &record->hwaddr))
+		return;
+
+	server = malloc(sizeof(*server));
+	if (!server)
+		return;
+
+	server->hwaddr = record->hwaddr;
+	server->address = record->address;
+	server->tq = record->tq;
+	handoff_set_age(now, &server->last_seen, record->age);
+
+	if (hash_add(interface->server_hash, server))
+		free(server);
+}
+
+static void handoff_receive_peer(struct globals *globals,
+				 struct handoff_peer *record,
+				 struct timespec *now)
+{
+	struct peer *peer;
+
+	peer = peer_get(globals, &record->hwaddr);
+	if (!peer)
+		return;
+
+	peer->caps = record->caps;
+	handoff_set_age(now, &peer->last_seen, record->age);
+	peer->sync_id = record->sync_id;
+	peer->sync_seq = record->sync_seq;
+	peer->acked_seq = record->acked_seq;
+	handoff_set_age(now, &peer->full_sync, record->full_sync);
+	peer->mcast_seq = record->mcast_seq;
+	peer->mcast_round = record->mcast_round;
+	peer->mcast_id = record->mcast_id;
+	handoff_set_age(now, &peer->repair_time, record->repair_time);
+}
+
+static void handoff_receive_sync(struct globals *globals,
+				 struct handoff_sync *record,
+				 struct timespec *now)
+{
+	/* the datasets kept their change_seq, but the last changes may have
+	 * removed datasets */
+	if (record->change_seq > globals->change_seq)
+		globals->change_seq = record->change_seq;
+
+	globals->mcast_round = record->mcast_round;
+	globals->mcast_sync_seq = record->mcast_sync_seq;
+	handoff_set_age(now, &globals->mcast_full_sync,
+			record->mcast_full_sync);
+	globals->local_push_server = record->local_push_server;
+	globals->local_push_seq = record->local_push_seq;
+}
+
+/* read a packet of at least min_len bytes following a record into buf, which
+ * holds MAX_PAYLOAD bytes. Returns the length of the packet */
+static ssize_t handoff_read_packet(int sock, uint8_t *buf, size_t min_len)
+{
+	struct alfred_tlv *tlv = (struct alfred_tlv *)buf;
+	size_t len;
+
+	if (read_full(sock, buf, sizeof(*tlv)) < 0)
+		return -1;
+
+	len = ntohs(tlv->length);
+	if (len < min_len - sizeof(*tlv) || len > MAX_PAYLOAD - sizeof(*tlv))
+		return -1;
+
+	if (read_full(sock, buf + sizeof(*tlv), len) < 0)
+		return -1;
+
+	return len + sizeof(*tlv);
+}
+
+static int handoff_receive_transaction(struct globals *globals, int sock,
+				       struct handoff_transaction *record,
+				       int *fds, uint16_t num_fds,
+				       struct timespec *now)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct alfred_push_data_v0 *push;
+	struct alfred_parity_v0 *parity;
+	struct transaction_head *head;
+	int client_sock;
+	size_t pos;
+	ssize_t len;
+	uint16_t i;
+
+	client_sock = handoff_fd(fds, num_fds, record->client_socket);
+
+	head = transaction_add(globals, record->server_addr, record->id);
+	if (head) {
+		head->requested_type = record->requested_type;
+		head->request = record->request;
+		head->hedges = record->hedges;
+		head->nacks = record->nacks;
+		head->deadline = record->deadline;
+		head->client_socket = client_sock;
+		handoff_set_age(now, &head->started, record->started);
+		handoff_set_age(now, &head->last_rx_time, record->age);
+	} else if (client_sock >= 0) {
+		close(client_sock);
+	}
+
+	push = (struct alfred_push_data_v0 *)buf;
+	parity = (struct alfred_parity_v0 *)buf;
+
+	for (i = 0; i < record->num_packet; i++) {
+		if (handoff_read_packet(sock, buf, sizeof(*push)) < 0)
+			return -1;
+
+		if (head)
+			transaction_add_packet(globals, head, push);
+	}
+
+	for (pos = 0; pos < record->parity_len; pos += len) {
+		len = handoff_read_packet(sock, buf, sizeof(*parity));
+		if (len < 0 || (size_t)len > record->parity_len - pos)
+			return -1;
+
+		if (head)
+			fec_store_parity(globals, head, parity);
+	}
+
+	return 0;
+}
+
+static int handoff_receive_retransmit(struct globals *globals, int sock,
+				      struct handoff_retransmit *record,
+				      struct timespec *now)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct retransmit_cache *cache;
+	struct in6_addr address;
+	size_t pos;
+	ssize_t len;
+
+	/* the record is packed */
+	address = record->address;
+	cache = retransmit_add(globals, &address, record->id);
+	if (cache) {
+		cache->num_packet = record->num_packet;
+		cache->retries = record->retries;
+		handoff_set_age(now, &cache->created, record->age);
+	}
+
+	for (pos = 0; pos < record->buf_len; pos += len) {
+		len = handoff_read_packet(sock, buf,
+					  sizeof(struct alfred_push_data_v0));
+		if (len < 0 || (size_t)len > record->buf_len - pos)
+			return -1;
+
+		retransmit_store(cache, buf, len);
+	}
+
+	return 0;
+}
+
+int handoff_receive(struct globals *globals)
+{
+	struct handoff_transaction transaction_record;
+	struct handoff_retransmit retransmit_record;
+	struct handoff_interface iface_record;
+	struct handoff_server server_record;
+	struct handoff_peer peer_record;
+	struct handoff_sync sync_record;
+	struct alfred_tlv request, tlv;
+	struct timespec now;
+	int fds[HANDOFF_MAX_FDS];
+	uint16_t num_fds, i;
+	int sock, ret = -1;
+	size_t len;
+	void *record;
+
+	if (unix_sock_open_client(globals))
+		return -1;
+
+	sock = globals->unix_sock;
+	globals->unix_sock = -1;
+
+	request.type = ALFRED_HANDOFF;
+	request.version = ALFRED_VERSION;
+	request.length = htons(0);
+
+	if (write_full(sock, &request, sizeof(request)) < 0)
+		goto err;
+
+	if (handoff_receive_fds(sock, fds, &num_fds) < 0) {
+		fprintf(stderr, "Failed to receive handoff file descriptors\n");
+		goto err;
+	}
+
+	globals->unix_sock = handoff_fd(fds, num_fds, 0);
+	snapshot_load_fd(globals, fds[1]);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (read_full(sock, &tlv, sizeof(tlv)) == 0) {
+		switch (tlv.type) {
+		case HANDOFF_INTERFACE:
+			record = &iface_record;
+			len = sizeof(iface_record);
+			break;
+		case HANDOFF_SERVER:
+			record = &server_record;
+			len = sizeof(server_record);
+			break;
+		case HANDOFF_PEER:
+			record = &peer_record;
+			len = sizeof(peer_record);
+			break;
+		case HANDOFF_SYNC:
+			record = &sync_record;
+			len = sizeof(sync_record);
+			break;
+		case HANDOFF_TRANSACTION:
+			record = &transaction_record;
+			len = sizeof(transaction_record);
+			break;
+		case HANDOFF_RETRANSMIT:
+			record = &retransmit_record;
+			len = sizeof(retransmit_record);
+			break;
+		case HANDOFF_END:
+			ret = 0;
+			goto out;
+		default:
+			goto out;
+		}
+
+		if (tlv.length != len - sizeof(tlv))
+			goto out;
+
+		memcpy(record, &tlv, sizeof(tlv));
+		if (read_full(sock, (uint8_t *)record + sizeof(tlv),
+			      len - sizeof(tlv)) < 0)
+			goto out;
+
+		switch (tlv.type) {
+		case HANDOFF_INTERFACE:
+			handoff_receive_interface(globals, &iface_record, fds,
+						  num_fds);
+			break;
+		case HANDOFF_SERVER:
+			handoff_receive_server(globals, &server_record, &now);
+			break;
+		case HANDOFF_PEER:
+			handoff_receive_peer(globals, &peer_record, &now);
+			break;
+		case HANDOFF_SYNC:
+			handoff_receive_sync(globals, &sync_record, &now);
+			break;
+		case HANDOFF_TRANSACTION:
+			if (handoff_receive_transaction(globals, sock,
+							&transaction_record,
+							fds, num_fds,
+							&now) < 0)
+				goto out;
+			break;
+		case HANDOFF_RETRANSMIT:
+			if (handoff_receive_retransmit(globals, sock,
+						       &retransmit_record,
+						       &now) < 0)
+				goto out;
+			break;
+		}
+	}
+
+out:
+	if (ret < 0)
+		fprintf(stderr, "Handoff state incomplete\n");
+
+	/* the unix socket was taken over in any case */
+	ret = 0;
+	printf("took over from the running daemon\n");
+
+	for (i = 1; i < num_fds; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	if (globals->opmode == OPMODE_SLAVE)
+		set_best_server(globals);
+err:
+	close(sock);
+	return ret;
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+/* Hedged requests of slaves. When no packet of the answer arrived within
+ * globals->hedge_delay milliseconds, the request of a client is also sent to
+ * the master with the next best TQ, up to ALFRED_HEDGE_SERVERS masters. All
+ * of them use the transaction id of the client. The first transaction which
+ * finishes answers the client, the others are cancelled. */
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "alfred.h"
+#include "hash.h"
+#include "packet.h"
+
+/* transaction of another master for the same request */
+static bool hedge_sibling(struct transaction_head *head,
+			  struct transaction_head *other)
+{
+	return other->request && other->id == head->id &&
+	       other->requested_type == head->requested_type &&
+	       memcmp(&other->server_addr, &head->server_addr,
+		      sizeof(other->server_addr)) != 0;
+}
+
+/* a packet of the answer arrived from one of the asked masters */
+static bool hedge_answering(struct globals *globals,
+			    struct transaction_head *head)
+{
+	struct hash_it_t *hashit = NULL;
+
+	while (NULL != (hashit = hash_iterate(globals->transaction_hash,
+					      hashit))) {
+		struct transaction_head *other = hashit->bucket->data;
+
+		if (other != head && !hedge_sibling(head, other))
+			continue;
+
+		if (other->num_packet > 0) {
+			hash_iterate_free(hashit);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* master with the best TQ which wasn't asked yet */
+static struct server *hedge_next_server(struct globals *globals,
+					struct interface *interface,
+					struct transaction_head *head)
+{
+	struct transaction_head search;
+	struct hash_it_t *hashit = NULL;
+	struct server *best_server = NULL;
+	int best_tq = -1;
+
+	search.id = head->id;
+
+	while (NULL != (hashit = hash_iterate(interface->server_hash,
+					      hashit))) {
+		struct server *server = hashit->bucket->data;
+
+		search.server_addr = server->hwaddr;
+		if (hash_find(globals->transaction_hash, &search))
+			continue;
+
+		if (server->tq > best_tq) {
+			best_tq = server->tq;
+			best_server = server;
+		}
+	}
+
+	return best_server;
+}
+
+/* request of a client waiting longer than its next hedge delay. Others
+ * reduce tv to the time until their next hedge is due */
+static struct transaction_head *hedge_due(struct globals *globals,
+					  struct timespec *now,
+					  struct timespec *tv)
+{
+	struct hash_it_t *hashit = NULL;
+	struct timespec due, diff, rest;
+	uint64_t delay;
+
+	while (NULL != (hashit = hash_iterate(globals->transaction_hash,
+					      hashit))) {
+		struct transaction_head *head = hashit->bucket->data;
+
+		if (!head->request || head->client_socket < 0 ||
+		    head->finished != 0 ||
+		    head->hedges >= ALFRED_HEDGE_SERVERS - 1)
+			continue;
+
+		if (hedge_answering(globals, head))
+			continue;
+
+		delay = (uint64_t)globals->hedge_delay * (head->hedges + 1);
+		due = head->started;
+		time_add_ms(&due, delay);
+
+		if (!time_diff(&due, now, &diff) ||
+		    (diff.tv_sec == 0 && diff.tv_nsec == 0)) {
+			hash_iterate_free(hashit);
+			return head;
+		}
+
+		if (time_diff(tv, &diff, &rest))
+			*tv = diff;
+	}
+
+	return NULL;
+}
+
+/* send the requests of clients which wait too long to further masters and
+ * limit the select timeout tv to the next hedge */
+void hedge_requests(struct globals *globals, struct timespec *tv)
+{
+	struct transaction_head *head, *hedge;
+	struct interface *interface;
+	struct server *server;
+	struct timespec now;
+
+	if (!globals->hedge_delay || globals->opmode == OPMODE_MASTER)
+		return;
+
+	interface = netsock_first_interface(globals);
+	if (!interface)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while ((head = hedge_due(globals, &now, tv))) {
+		head->hedges++;
+
+		server = hedge_next_server(globals, interface, head);
+		if (!server) {
+			/* every known master was asked */
+			head->hedges = ALFRED_HEDGE_SERVERS;
+			continue;
+		}
+
+		hedge = transaction_add(globals, server->hwaddr, head->id);
+		if (!hedge)
+			continue;
+
+		hedge->requested_type = head->requested_type;
+		hedge->request = 1;
+		hedge->started = head->started;
+
+		send_request(globals, interface, server, head->requested_type,
+			     head->id);
+		globals->hedges_sent++;
+	}
+}
+
+/* drop the data of a transaction which lost against another one and tell
+ * its master that it won't be requested. It is kept until it times out to
+ * ignore its remaining packets */
+static void hedge_cancel(struct globals *globals,
+			 struct transaction_head *head)
+{
+	struct alfred_status_v0 status;
+	struct interface *interface;
+	struct server *server;
+
+	transaction_release(globals, head);
+	head->finished = -1;
+	globals->hedges_cancelled++;
+
+	interface = netsock_first_interface(globals);
+	if (!interface)
+		return;
+
+	server = hash_find(interface->server_hash, &head->server_addr);
+	if (!server)
+		return;
+
+	status.header.type = ALFRED_STATUS_ERROR;
+	status.header.version = ALFRED_VERSION;
+	status.header.length = htons(sizeof(status) - sizeof(status.header));
+	status.tx.id = htons(head->id);
+	status.tx.seqno = 0;
+
+	send_alfred_packet(interface, &server->address, &status,
+			   sizeof(status));
+}
+
+/* called for a request transaction which was removed from the transaction
+ * hash. A finished one takes over the client of its siblings and cancels
+ * them, a failed one leaves its client to a sibling which is still pending */
+void hedge_finish(struct globals *globals, struct transaction_head *head)
+{
+	struct hash_it_t *hashit = NULL;
+
+	if (!head->request)
+		return;
+
+	while (NULL != (hashit = hash_iterate(globals->transaction_hash,
+					      hashit))) {
+		struct transaction_head *other = hashit->bucket->data;
+
+		if (!hedge_sibling(head, other) || other->finished != 0)
+			continue;
+
+		if (head->finished != 1) {
+			if (head->client_socket < 0) {
+				hash_iterate_free(hashit);
+				return;
+			}
+
+			other->client_socket = head->client_socket;
+			other->hedges = head->hedges;
+			other->deadline = head->deadline;
+			head->client_socket = -1;
+			hash_iterate_free(hashit);
+			return;
+		}
+
+		if (other->client_socket >= 0) {
+			head->client_socket = other->client_socket;
+			other->client_socket = -1;
+			globals->hedges_won++;
+		}
+
+		hedge_cancel(globals, other);
+	}
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+/* Previous versions of a dataset are kept as reverse deltas. The newest
+ * entry is a delta against the current content, every older one against the
+ * entry before it. Older versions are rebuilt by walking the list from the
+ * current content. */
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include "alfred.h"
+#include "list.h"
+#include "packet.h"
+
+static size_t history_mem_size(const struct history_entry *entry)
+{
+	return sizeof(*entry) + entry->delta_len;
+}
+
+static void history_entry_free(struct globals *globals,
+			       struct history_entry *entry)
+{
+	globals->data_mem_used -= history_mem_size(entry);
+	list_del(&entry->list);
+	free(entry);
+}
+
+static void history_trim(struct globals *globals, struct dataset *dataset)
+{
+	struct history_entry *entry, *safe;
+	unsigned int count = 0;
+
+	list_for_each_entry_safe(entry, safe, &dataset->history, list) {
+		count++;
+		if (count <= globals->history_depth)
+			continue;
+
+		history_entry_free(globals, entry);
+	}
+}
+
+/* store the current content of the dataset before it is replaced by buf */
+void history_add(struct globals *globals, struct dataset *dataset,
+		 const uint8_t *buf, uint32_t len)
+{
+	struct history_entry *entry, *shrunk;
+	const uint8_t *old;
+	uint32_t old_len;
+	uint8_t *alloc;
+	size_t delta_len;
+
+	if (!globals->history_depth)
+		return;
+
+	old_len = dataset->payload->length;
+	old = dataset_get_data(globals, dataset, false, &alloc);
+
+	entry = NULL;
+	if (old)
+		entry = malloc(sizeof(*entry) + old_len);
+
+	/* the older entries can't be rebuilt without the current content */
+	if (!entry) {
+		free(alloc);
+		history_free(globals, dataset);
+		return;
+	}
+
+	delta_len = delta_encode(buf, len, old, old_len, entry->data, old_len);
+	if (delta_len) {
+		entry->raw = 0;
+		entry->delta_len = delta_len;
+
+		shrunk = realloc(entry, sizeof(*entry) + delta_len);
+		if (shrunk)
+			entry = shrunk;
+	} else {
+		/* delta isn't smaller than the content */
+		entry->raw = 1;
+		entry->delta_len = old_len;
+		memcpy(entry->data, old, old_len);
+	}
+
+	free(alloc);
+
+	entry->revision = dataset->revision;
+	entry->version = dataset->data.header.version;
+	entry->changed = dataset->changed;
+	entry->length = old_len;
+
+	list_add(&entry->list, &dataset->history);
+	globals->data_mem_used += history_mem_size(entry);
+
+	history_trim(globals, dataset);
+}
+
+void history_free(struct globals *globals, struct dataset *dataset)
+{
+	struct history_entry *entry, *safe;
+
+	list_for_each_entry_safe(entry, safe, &dataset->history, list)
+		history_entry_free(globals, entry);
+}
+
+static int history_send(int client_sock, struct dataset *dataset,
+			uint32_t revision, uint8_t version,
+			struct timespec *changed,
+			const uint8_t *plain, uint32_t total_length)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct alfred_history_v0 *history;
+	struct timespec now, diff;
+	uint32_t offset = 0;
+	size_t len, chunk_max;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time_diff(&now, changed, &diff);
+
+	history = (struct alfred_history_v0 *)buf;
+	chunk_max = sizeof(buf) - sizeof(*history);
+	history->header.type = ALFRED_HISTORY;
+	history->header.version = ALFRED_VERSION;
+	memcpy(history->source, dataset->data.source, sizeof(history->source));
+	history->type = dataset->data.header.type;
+	history->version = version;
+	history->revision = htonl(revision);
+	history->age = htonl(diff.tv_sec);
+	history->total_length = htonl(total_length);
+
+	/* empty content is still announced with one packet */
+	do {
+		len = total_length - offset;
+		if (len > chunk_max)
+			len = chunk_max;
+
+		history->header.length = htons(sizeof(*history) -
+					       sizeof(history->header) + len);
+		history->offset = htonl(offset);
+		memcpy(history->data, plain + offset, len);
+
+		if (write_full(client_sock, buf, sizeof(*history) + len) < 0)
+			return -1;
+
+		offset += len;
+	} while (offset < total_length);
+
+	return 0;
+}
+
+/* write all revisions of the dataset newer than since to the client */
+int history_reply(struct globals *globals, struct dataset *dataset,
+		  uint32_t since, int client_sock)
+{
+	struct history_entry *entry;
+	const uint8_t *base;
+	uint8_t *alloc, *plain;
+	uint32_t base_len;
+	ssize_t len;
+	int ret = 0;
+
+	if (dataset->revision <= since)
+		return 0;
+
+	base = dataset_get_data(globals, dataset, true, &alloc);
+	if (!base)
+		return 0;
+
+	base_len = dataset->payload->length;
+	ret = history_send(client_sock, dataset, dataset->revision,
+			   dataset->data.header.version, &dataset->changed,
+			   base, base_len);
+
+	list_for_each_entry(entry, &dataset->history, list) {
+		if (ret < 0 || entry->revision <= since)
+			break;
+
+		plain = malloc(entry->length ? entry->length : 1);
+		if (!plain)
+			break;
+
+		if (entry->raw) {
+			memcpy(plain, entry->data, entry->length);
+		} else {
+			len = delta_apply(base, base_len, entry->data,
+					  entry->delta_len, plain,
+					  entry->length);
+			if (len != entry->length) {
+				free(plain);
+				break;
+			}
+		}
+
+		free(alloc);
+		alloc = plain;
+		base = plain;
+		base_len = entry->length;
+
+		ret = history_send(client_sock, dataset, entry->revision,
+				   entry->version, &entry->changed, base,
+				   base_len);
+	}
+
+	free(alloc);
+	return ret;
+}
@@ -20,7 +20,9 @@
  */
 
 #include <getopt.h>
+#include <netinet/ether.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +35,29 @@
 #include "packet.h"
 #include "list.h"
 
+enum alfred_long_option {
+	OPT_MEM_LIMIT = 256,
+	OPT_COMPRESS,
+	OPT_SNAPSHOT,
+	OPT_TAKEOVER,
+	OPT_POLICY_FILE,
+	OPT_SINCE,
+	OPT_SOURCE,
+	OPT_HISTORY_DEPTH,
+	OPT_FEC,
+	OPT_STREAM_APPLY,
+	OPT_REASSEMBLY_LIMIT,
+	OPT_PEER_REASSEMBLY_LIMIT,
+	OPT_GOSSIP,
+	OPT_MULTICAST_SYNC,
+	OPT_DELTA_SYNC,
+	OPT_COMPRESS_SYNC,
+	OPT_FRESHNESS,
+	OPT_CACHE_AGE,
+	OPT_HEDGE,
+	OPT_DEADLINE,
+};
+
 static struct globals alfred_globals;
 
 static void alfred_usage(void)
@@ -43,11 +68,24 @@ static void alfred_usage(void)
 	printf("                                      for the supplied data type (0-255)\n");
 	printf("  -r, --request [data type]           collect data from the network and prints\n");
 	printf("                                      it on the network\n");
+	printf("      --freshness cached              accept data fetched by a slave within its\n");
+	printf("                                      cache age for -r (default)\n");
+	printf("                  fresh               always fetch the data for -r\n");
+	printf("                  stale               accept any data fetched by a slave for -r,\n");
+	printf("                                      outdated data is fetched afterwards\n");
+	printf("      --deadline [milliseconds]       answer -r with the data the server has when the\n");
+	printf("                                      request isn't done in time, exit with 2\n");
 	printf("  -d, --verbose                       Show extra information in the data output\n");
 	printf("  -V, --req-version                   specify the data version set for -s\n");
 	printf("  -M, --modeswitch master             switch daemon to mode master\n");
 	printf("                   slave              switch daemon to mode slave\n");
 	printf("  -I, --change-interface [interface]  change to the specified interface(s)\n");
+	printf("  -S, --stats                         print the statistics of the daemon\n");
+	printf("  -P, --policy \"type [key=value ...]\" set the policy of a data type, keys are\n");
+	printf("                                      timeout, max_size, priority and sync\n");
+	printf("  -H, --history [data type]           print the stored versions of the data type\n");
+	printf("      --since [revision]              only print versions newer than revision\n");
+	printf("      --source [mac]                  only print versions of the given source\n");
 	printf("\n");
 	printf("server mode options:\n");
 	printf("  -i, --interface                     specify the interface (or comma separated list of interfaces) to listen on\n");
@@ -62,6 +100,44 @@ static void alfred_usage(void)
 	printf("  -u, --unix-path [path]              path to unix socket used for client-server\n");
 	printf("                                      communication (default: \""ALFRED_SOCK_PATH_DEFAULT"\")\n");
 	printf("  -c, --update-command                command to call on data change\n");
+	printf("      --mem-limit [size]              limit memory used by the data store\n");
+	printf("                                      (suffixes k and M allowed, default: none)\n");
+	printf("      --compress type[:size[:idle]]   compress payloads of the data type larger than\n");
+	printf("                                      size bytes (default: %d) when not read by a\n",
+	       ALFRED_COMPRESS_MIN_SIZE);
+	printf("                                      client for idle seconds (default: %d)\n",
+	       ALFRED_COMPRESS_IDLE_TIME);
+	printf("      --snapshot [path]               keep a snapshot of the data store in path and\n");
+	printf("                                      restore it on startup\n");
+	printf("      --takeover                      take over sockets and data from the daemon\n");
+	printf("                                      running on the unix socket\n");
+	printf("      --policy-file [path]            read data type policies from path\n");
+	printf("      --history-depth [count]         keep up to count previous versions of each\n");
+	printf("                                      dataset (0-255, default: 0)\n");
+	printf("      --fec [count]                   send a parity packet after every count data\n");
+	printf("                                      packets (1-255, default: off)\n");
+	printf("      --stream-apply                  parse received packets right away instead\n");
+	printf("                                      of buffering them until the transaction ends\n");
+	printf("      --reassembly-limit [size]       limit memory used by incomplete transactions\n");
+	printf("                                      (suffixes k and M allowed, 0 for none,\n");
+	printf("                                      default: %dM)\n",
+	       ALFRED_TX_MEM_LIMIT / (1024 * 1024));
+	printf("      --peer-reassembly-limit [size]  limit memory used by incomplete transactions\n");
+	printf("                                      of each sender (default: %dM)\n",
+	       ALFRED_TX_PEER_MEM_LIMIT / (1024 * 1024));
+	printf("      --gossip [fanout]               sync with fanout randomly picked masters\n");
+	printf("                                      per round (1-255, default: all)\n");
+	printf("      --multicast-sync                send the data to all masters of a link\n");
+	printf("                                      with a single multicast transaction\n");
+	printf("      --delta-sync                    send changed large datasets as delta against\n");
+	printf("                                      the content the receiver got before\n");
+	printf("      --compress-sync                 send the datasets compressed to daemons\n");
+	printf("                                      which support it\n");
+	printf("      --cache-age [seconds]           answer requests of clients on a slave with the\n");
+	printf("                                      data fetched up to seconds ago (default: 0)\n");
+	printf("      --hedge [milliseconds]          also send requests of clients on a slave to the\n");
+	printf("                                      next best master when they aren't answered in\n");
+	printf("                                      time (default: 0, disabled)\n");
 	printf("  -v, --version                       print the version\n");
 	printf("  -h, --help                          this help\n");
 	printf("\n");
@@ -140,10 +216,84 @@ out:
 	return ret;
 }
 
+static int parse_size(const char *arg, size_t *size)
+{
+	unsigned long long val;
+	char *end;
+
+	val = strtoull(arg, &end, 10);
+	if (end == arg)
+		return -1;
+
+	switch (*end) {
+	case 'k':
+	case 'K':
+		val *= 1024;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		val *= 1024 * 1024;
+		end++;
+		break;
+	}
+
+	if (*end != '\0' || val > SIZE_MAX)
+		return -1;
+
+	*size = val;
+	return 0;
+}
+
+static int parse_compress(struct globals *globals, char *arg)
+{
+	struct compress_policy *policy;
+	unsigned long type, min_size, idle_time;
+	char *end;
+
+	min_size = ALFRED_COMPRESS_MIN_SIZE;
+	idle_time = ALFRED_COMPRESS_IDLE_TIME;
+
+	type = strtoul(arg, &end, 10);
+	if (end == arg || type > 255)
+		return -1;
+
+	if (*end == ':') {
+		arg = end + 1;
+		min_size = strtoul(arg, &end, 10);
+		if (end == arg || min_size > UINT16_MAX)
+			return -1;
+	}
+
+	if (*end == ':') {
+		arg = end + 1;
+		idle_time = strtoul(arg, &end, 10);
+		if (end == arg || idle_time > UINT16_MAX)
+			return -1;
+	}
+
+	if (*end != '\0')
+		return -1;
+
+	/* parsed before the data store is filled, the plain users of the
+	 * pooled payloads don't have to be recounted */
+	policy = &globals->compress[type];
+	policy->enabled = 1;
+	policy->min_size = min_size;
+	policy->idle_time = idle_time;
+
+	return 0;
+}
+
 static struct globals *alfred_init(int argc, char *argv[])
 {
 	int opt, opt_ind, i, ret;
 	struct globals *globals;
+	struct ether_addr *mac;
+	unsigned long val;
+	char *end;
+	struct type_policy policy;
+	uint8_t type;
 	struct option long_options[] = {
 		{"set-data",		required_argument,	NULL,	's'},
 		{"request",		required_argument,	NULL,	'r'},
@@ -157,6 +307,29 @@ static struct globals *alfred_init(int argc, char *argv[])
 		{"update-command",	required_argument,	NULL,	'c'},
 		{"version",		no_argument,		NULL,	'v'},
 		{"verbose",		no_argument,		NULL,	'd'},
+		{"stats",		no_argument,		NULL,	'S'},
+		{"mem-limit",		required_argument,	NULL,	OPT_MEM_LIMIT},
+		{"compress",		required_argument,	NULL,	OPT_COMPRESS},
+		{"snapshot",		required_argument,	NULL,	OPT_SNAPSHOT},
+		{"takeover",		no_argument,		NULL,	OPT_TAKEOVER},
+		{"policy",		required_argument,	NULL,	'P'},
+		{"policy-file",		required_argument,	NULL,	OPT_POLICY_FILE},
+		{"history",		required_argument,	NULL,	'H'},
+		{"since",		required_argument,	NULL,	OPT_SINCE},
+		{"source",		required_argument,	NULL,	OPT_SOURCE},
+		{"history-depth",	required_argument,	NULL,	OPT_HISTORY_DEPTH},
+		{"fec",			required_argument,	NULL,	OPT_FEC},
+		{"stream-apply",	no_argument,		NULL,	OPT_STREAM_APPLY},
+		{"reassembly-limit",	required_argument,	NULL,	OPT_REASSEMBLY_LIMIT},
+		{"peer-reassembly-limit", required_argument,	NULL,	OPT_PEER_REASSEMBLY_LIMIT},
+		{"gossip",		required_argument,	NULL,	OPT_GOSSIP},
+		{"multicast-sync",	no_argument,		NULL,	OPT_MULTICAST_SYNC},
+		{"delta-sync",		no_argument,		NULL,	OPT_DELTA_SYNC},
+		{"compress-sync",	no_argument,		NULL,	OPT_COMPRESS_SYNC},
+		{"freshness",		required_argument,	NULL,	OPT_FRESHNESS},
+		{"cache-age",		required_argument,	NULL,	OPT_CACHE_AGE},
+		{"hedge",		required_argument,	NULL,	OPT_HEDGE},
+		{"deadline",		required_argument,	NULL,	OPT_DEADLINE},
 		{NULL,			0,			NULL,	0},
 	};
 
@@ -179,10 +352,14 @@ static struct globals *alfred_init(int argc, char *argv[])
 	globals->update_command = NULL;
 	INIT_LIST_HEAD(&globals->changed_data_types);
 	globals->changed_data_type_count = 0;
+	globals->data_mem_limit = 0;
+	globals->tx_mem_limit = ALFRED_TX_MEM_LIMIT;
+	globals->tx_peer_mem_limit = ALFRED_TX_PEER_MEM_LIMIT;
+	policy_init(globals);
 
 	time_random_seed();
 
-	while ((opt = getopt_long(argc, argv, "ms:r:hi:b:vV:M:I:u:dc:", long_options,
+	while ((opt = getopt_long(argc, argv, "ms:r:hi:b:vV:M:I:u:dc:SP:H:", long_options,
 				  &opt_ind)) != -1) {
 		switch (opt) {
 		case 'r':
@@ -245,6 +422,152 @@ static struct globals *alfred_init(int argc, char *argv[])
 		case 'c':
 			globals->update_command = optarg;
 			break;
+		case 'S':
+			globals->clientmode = CLIENT_STATS;
+			break;
+		case 'P':
+			if (policy_parse(optarg, &type, &policy) != 0) {
+				fprintf(stderr, "bad policy argument\n");
+				return NULL;
+			}
+			globals->policy[type] = policy;
+			globals->clientmode_arg = type;
+			globals->clientmode = CLIENT_SET_POLICY;
+			break;
+		case 'H':
+			globals->clientmode = CLIENT_HISTORY;
+			i = atoi(optarg);
+			if (i < ALFRED_MAX_RESERVED_TYPE || i > 255) {
+				fprintf(stderr, "bad data type argument\n");
+				return NULL;
+			}
+			globals->clientmode_arg = i;
+			break;
+		case OPT_FRESHNESS:
+			if (strcmp(optarg, "cached") == 0) {
+				globals->freshness = ALFRED_FRESHNESS_CACHED;
+			} else if (strcmp(optarg, "fresh") == 0) {
+				globals->freshness = ALFRED_FRESHNESS_FRESH;
+			} else if (strcmp(optarg, "stale") == 0) {
+				globals->freshness = ALFRED_FRESHNESS_STALE;
+			} else {
+				fprintf(stderr, "bad freshness argument\n");
+				return NULL;
+			}
+			break;
+		case OPT_CACHE_AGE:
+			val = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || val > UINT32_MAX) {
+				fprintf(stderr, "bad cache age argument\n");
+				return NULL;
+			}
+			globals->cache_age = val;
+			break;
+		case OPT_HEDGE:
+			val = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || val > UINT32_MAX) {
+				fprintf(stderr, "bad hedge argument\n");
+				return NULL;
+			}
+			globals->hedge_delay = val;
+			break;
+		case OPT_DEADLINE:
+			val = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || val > UINT32_MAX) {
+				fprintf(stderr, "bad deadline argument\n");
+				return NULL;
+			}
+			globals->deadline = val;
+			break;
+		case OPT_SINCE:
+			val = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || val > UINT32_MAX) {
+				fprintf(stderr, "bad revision argument\n");
+				return NULL;
+			}
+			globals->history_since = val;
+			break;
+		case OPT_SOURCE:
+			mac = ether_aton(optarg);
+			if (!mac) {
+				fprintf(stderr, "bad source argument\n");
+				return NULL;
+			}
+			globals->history_source = *mac;
+			break;
+		case OPT_HISTORY_DEPTH:
+			val = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || val > 255) {
+				fprintf(stderr, "bad history depth argument\n");
+				return NULL;
+			}
+			globals->history_depth = val;
+			break;
+		case OPT_FEC:
+			val = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || val < 1 ||
+			    val > 255) {
+				fprintf(stderr, "bad fec argument\n");
+				return NULL;
+			}
+			globals->fec_group = val;
+			break;
+		case OPT_GOSSIP:
+			val = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || val < 1 ||
+			    val > 255) {
+				fprintf(stderr, "bad gossip argument\n");
+				return NULL;
+			}
+			globals->gossip_fanout = val;
+			break;
+		case OPT_MULTICAST_SYNC:
+			globals->mcast_sync = 1;
+			break;
+		case OPT_DELTA_SYNC:
+			globals->delta_sync = 1;
+			break;
+		case OPT_COMPRESS_SYNC:
+			globals->compress_sync = 1;
+			break;
+		case OPT_STREAM_APPLY:
+			globals->stream_apply = 1;
+			break;
+		case OPT_MEM_LIMIT:
+			if (parse_size(optarg, &globals->data_mem_limit) < 0) {
+				fprintf(stderr, "bad memory limit argument\n");
+				return NULL;
+			}
+			break;
+		case OPT_REASSEMBLY_LIMIT:
+			if (parse_size(optarg, &globals->tx_mem_limit) < 0) {
+				fprintf(stderr, "bad reassembly limit argument\n");
+				return NULL;
+			}
+			break;
+		case OPT_PEER_REASSEMBLY_LIMIT:
+			if (parse_size(optarg,
+				       &globals->tx_peer_mem_limit) < 0) {
+				fprintf(stderr, "bad reassembly limit argument\n");
+				return NULL;
+			}
+			break;
+		case OPT_COMPRESS:
+			if (parse_compress(globals, optarg) < 0) {
+				fprintf(stderr, "bad compress argument\n");
+				return NULL;
+			}
+			break;
+		case OPT_SNAPSHOT:
+			globals->snapshot_path = optarg;
+			break;
+		case OPT_TAKEOVER:
+			globals->takeover = 1;
+			break;
+		case OPT_POLICY_FILE:
+			if (policy_load_file(globals, optarg) < 0)
+				return NULL;
+			break;
 		case 'v':
 			printf("%s %s\n", argv[0], SOURCE_VERSION);
 			printf("A.L.F.R.E.D. - Almighty Lightweight Remote Fact Exchange Daemon\n");
@@ -283,6 +606,12 @@ int main(int argc, char *argv[])
 		return alfred_client_modeswitch(globals);
 	case CLIENT_CHANGE_INTERFACE:
 		return alfred_client_change_interface(globals);
+	case CLIENT_STATS:
+		return alfred_client_stats(globals);
+	case CLIENT_SET_POLICY:
+		return alfred_client_set_policy(globals);
+	case CLIENT_HISTORY:
+		return alfred_client_history(globals);
 	}
 
 	return 0;
@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+/* Anti-entropy between masters. Every dataset has a digest over its key,
+ * version and content. The digests of all datasets of a data type are
+ * combined with XOR, so they can be updated whenever a single dataset
+ * changes. The root is the digest over the digests of all synced data types.
+ *
+ * Two masters compare their roots first. Only when they differ, the digests
+ * of the data types and then the digests of the datasets of the differing
+ * data types are exchanged. */
+
+#include <endian.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alfred.h"
+#include "batadv_query.h"
+#include "hash.h"
+#include "packet.h"
+
+static uint64_t merkle_dataset_digest(const struct dataset *dataset)
+{
+	uint8_t buf[ETH_ALEN + 2 + sizeof(uint64_t)];
+	uint64_t payload_digest;
+
+	if (!dataset->payload)
+		return 0;
+
+	memcpy(buf, dataset->data.source, ETH_ALEN);
+	buf[ETH_ALEN] = dataset->data.header.type;
+	buf[ETH_ALEN + 1] = dataset->data.header.version;
+	payload_digest = htobe64(dataset->payload->digest);
+	memcpy(buf + ETH_ALEN + 2, &payload_digest, sizeof(payload_digest));
+
+	return digest64(buf, sizeof(buf));
+}
+
+/* recalculate the digest after the payload or version of the dataset
+ * changed */
+void merkle_update(struct globals *globals, struct dataset *dataset)
+{
+	uint64_t *type_digest;
+
+	type_digest = &globals->merkle_types[dataset->data.header.type];
+	*type_digest ^= dataset->digest;
+	dataset->digest = merkle_dataset_digest(dataset);
+	*type_digest ^= dataset->digest;
+}
+
+void merkle_remove(struct globals *globals, struct dataset *dataset)
+{
+	globals->merkle_types[dataset->data.header.type] ^= dataset->digest;
+	dataset->digest = 0;
+}
+
+/* datasets of data types which are not synced differ between masters */
+static uint64_t merkle_type_digest(struct globals *globals, uint8_t type)
+{
+	if (!globals->policy[type].sync)
+		return 0;
+
+	return globals->merkle_types[type];
+}
+
+uint64_t merkle_root(struct globals *globals)
+{
+	uint64_t digests[ARRAY_SIZE(globals->merkle_types)];
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(digests); i++)
+		digests[i] = htobe64(merkle_type_digest(globals, i));
+
+	return digest64(digests, sizeof(digests));
+}
+
+static void merkle_send(struct interface *interface, struct in6_addr *dest,
+			struct alfred_merkle_v0 *merkle, uint8_t level,
+			size_t data_len)
+{
+	size_t tlv_length;
+
+	merkle->header.type = ALFRED_MERKLE;
+	merkle->header.version = ALFRED_VERSION;
+	tlv_length = sizeof(*merkle) - sizeof(merkle->header) + data_len;
+	merkle->header.length = htons(tlv_length);
+	merkle->level = level;
+
+	send_alfred_packet(interface, dest, merkle, sizeof(*merkle) + data_len);
+}
+
+int merkle_send_root(struct globals *globals, struct interface *interface,
+		     struct in6_addr *dest)
+{
+	uint8_t buf[sizeof(struct alfred_merkle_v0) + sizeof(uint64_t)];
+	struct alfred_merkle_v0 *merkle;
+	uint64_t root;
+
+	merkle = (struct alfred_merkle_v0 *)buf;
+	memset(merkle, 0, sizeof(*merkle));
+	root = htobe64(merkle_root(globals));
+	memcpy(merkle->data, &root, sizeof(root));
+
+	merkle_send(interface, dest, merkle, ALFRED_MERKLE_ROOT, sizeof(root));
+
+	return 0;
+}
+
+static void merkle_send_types(struct globals *globals,
+			      struct interface *interface,
+			      struct in6_addr *dest)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct alfred_merkle_v0 *merkle;
+	size_t first, i, count, max_count;
+	uint64_t digest;
+
+	merkle = (struct alfred_merkle_v0 *)buf;
+	memset(merkle, 0, sizeof(*merkle));
+	max_count = (netsock_max_packet(interface) - sizeof(*merkle)) /
+		    sizeof(digest);
+
+	for (first = 0; first < ARRAY_SIZE(globals->merkle_types);
+	     first += count) {
+		count = ARRAY_SIZE(globals->merkle_types) - first;
+		if (count > max_count)
+			count = max_count;
+
+		for (i = 0; i < count; i++) {
+			digest = htobe64(merkle_type_digest(globals,
+							    first + i));
+			memcpy(merkle->data + i * sizeof(digest), &digest,
+			       sizeof(digest));
+		}
+
+		merkle->type = first;
+		merkle_send(interface, dest, merkle, ALFRED_MERKLE_TYPES,
+			    count * sizeof(digest));
+	}
+}
+
+static int merkle_source_compare(const void *d1, const void *d2)
+{
+	const struct alfred_merkle_source_v0 *s1 = d1, *s2 = d2;
+
+	return memcmp(s1->source, s2->source, sizeof(s1->source));
+}
+
+static bool merkle_in_range(const uint8_t *source, const uint8_t *start,
+			    const uint8_t *end)
+{
+	return memcmp(source, start, ETH_ALEN) >= 0 &&
+	       memcmp(source, end, ETH_ALEN) <= 0;
+}
+
+static void merkle_mac_inc(uint8_t *mac)
+{
+	int i;
+
+	for (i = ETH_ALEN - 1; i >= 0; i--) {
+		if (++mac[i])
+			break;
+	}
+}
+
+/* send the digests of all datasets of the data type with a source between
+ * start and end, split in as many packets as needed */
+static int merkle_send_sources(struct globals *globals,
+			       struct interface *interface,
+			       struct in6_addr *dest, uint8_t type,
+			       const uint8_t *start, const uint8_t *end,
+			       uint8_t level)
+{
+	struct alfred_merkle_source_v0 *sources;
+	struct hash_it_t *hashit = NULL;
+	struct alfred_merkle_v0 *merkle;
+	uint8_t buf[MAX_PAYLOAD];
+	size_t num_sources = 0;
+	size_t pos = 0, count, max_count;
+
+	sources = malloc((globals->data_hash->elements + 1) *
+			 sizeof(*sources));
+	if (!sources)
+		return -1;
+
+	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
+		struct dataset *dataset = hashit->bucket->data;
+
+		if (dataset->data.header.type != type || !dataset->digest)
+			continue;
+
+		if (!merkle_in_range(dataset->data.source, start, end))
+			continue;
+
+		memcpy(sources[num_sources].source, dataset->data.source,
+		       ETH_ALEN);
+		sources[num_sources].digest = htobe64(dataset->digest);
+		num_sources++;
+	}
+
+	qsort(sources, num_sources, sizeof(*sources), merkle_source_compare);
+
+	merkle = (struct alfred_merkle_v0 *)buf;
+	merkle->type = type;
+	memcpy(merkle->range_start, start, ETH_ALEN);
+	max_count = (netsock_max_packet(interface) - sizeof(*merkle)) /
+		    sizeof(*sources);
+
+	/* every packet covers the sources up to its last entry, the final
+	 * one up to end */
+	do {
+		count = num_sources - pos;
+		if (count > max_count)
+			count = max_count;
+
+		if (pos + count == num_sources)
+			memcpy(merkle->range_end, end, ETH_ALEN);
+		else
+			memcpy(merkle->range_end,
+			       sources[pos + count - 1].source, ETH_ALEN);
+
+		memcpy(merkle->data, &sources[pos], count * sizeof(*sources));
+		merkle_send(interface, dest, merkle, level,
+			    count * sizeof(*sources));
+
+		memcpy(merkle->range_start, merkle->range_end, ETH_ALEN);
+		merkle_mac_inc(merkle->range_start);
+		pos += count;
+	} while (pos < num_sources);
+
+	free(sources);
+	return 0;
+}
+
+static void merkle_receive_root(struct globals *globals,
+				struct interface *interface,
+				struct in6_addr *source,
+				struct alfred_merkle_v0 *merkle,
+				size_t data_len)
+{
+	uint64_t root;
+
+	if (data_len != sizeof(root))
+		return;
+
+	memcpy(&root, merkle->data, sizeof(root));
+	if (be64toh(root) == merkle_root(globals))
+		return;
+
+	merkle_send_types(globals, interface, source);
+}
+
+static void merkle_receive_types(struct globals *globals,
+				 struct interface *interface,
+				 struct in6_addr *source,
+				 struct alfred_merkle_v0 *merkle,
+				 size_t data_len)
+{
+	static const uint8_t start[ETH_ALEN];
+	static const uint8_t end[ETH_ALEN] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
+	size_t i, count;
+	uint64_t digest;
+	size_t type;
+
+	count = data_len / sizeof(digest);
+	for (i = 0; i < count; i++) {
+		type = merkle->type + i;
+		if (type >= ARRAY_SIZE(globals->merkle_types))
+			break;
+
+		if (!globals->policy[type].sync)
+			continue;
+
+		memcpy(&digest, merkle->data + i * sizeof(digest),
+		       sizeof(digest));
+		if (be64toh(digest) == globals->merkle_types[type])
+			continue;
+
+		merkle_send_sources(globals, interface, source, type, start,
+				    end, ALFRED_MERKLE_SOURCES);
+	}
+}
+
+/* push the first hand datasets in the range of the sources which the other
+ * master doesn't have in the same version */
+static int merkle_receive_sources(struct globals *globals,
+				  struct interface *interface,
+				  struct in6_addr *source,
+				  struct alfred_merkle_v0 *merkle,
+				  size_t data_len)
+{
+	struct alfred_merkle_source_v0 *sources, search, *found;
+	struct hash_it_t *hashit = NULL;
+	struct dataset **datasets;
+	size_t num_sources, count = 0;
+	uint32_t pending = UINT32_MAX;
+	struct ether_addr mac;
+	struct peer *peer;
+
+	if (!globals->policy[merkle->type].sync)
+		return 0;
+
+	/* changes after the last acknowledged sync are sent by the next
+	 * sync anyway */
+	if (ipv6_to_mac(source, &mac) == 0) {
+		peer = peer_get(globals, &mac);
+		if (peer && peer->caps & ALFRED_CAP_ACK && peer->acked_seq)
+			pending = peer->acked_seq;
+	}
+
+	if (data_len % sizeof(*sources))
+		return -1;
+
+	sources = (struct alfred_merkle_source_v0 *)merkle->data;
+	num_sources = data_len / sizeof(*sources);
+
+	datasets = malloc((globals->data_hash->elements + 1) *
+			  sizeof(*datasets));
+	if (!datasets)
+		return -1;
+
+	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
+		struct dataset *dataset = hashit->bucket->data;
+
+		if (dataset->data.header.type != merkle->type ||
+		    !dataset->digest)
+			continue;
+
+		/* synced data is pushed by the master which has it first
+		 * hand */
+		if (dataset->data_source > SOURCE_FIRST_HAND ||
+		    dataset->change_seq > pending)
+			continue;
+
+		if (!merkle_in_range(dataset->data.source, merkle->range_start,
+				     merkle->range_end))
+			continue;
+
+		memcpy(search.source, dataset->data.source, ETH_ALEN);
+		found = bsearch(&search, sources, num_sources,
+				sizeof(*sources), merkle_source_compare);
+		if (found && be64toh(found->digest) == dataset->digest)
+			continue;
+
+		datasets[count++] = dataset;
+	}
+
+	if (count) {
+		push_datasets(globals, interface, source, datasets, count,
+			      get_random_id());
+		globals->merkle_pushed += count;
+	}
+
+	free(datasets);
+
+	if (merkle->level == ALFRED_MERKLE_SOURCES_REPLY)
+		return 0;
+
+	return merkle_send_sources(globals, interface, source, merkle->type,
+				   merkle->range_start, merkle->range_end,
+				   ALFRED_MERKLE_SOURCES_REPLY);
+}
+
+int merkle_receive(struct globals *globals, struct interface *interface,
+		   struct in6_addr *source, struct alfred_merkle_v0 *merkle)
+{
+	size_t len;
+
+	if (globals->opmode != OPMODE_MASTER)
+		return -1;
+
+	len = ntohs(merkle->header.length);
+	if (len < sizeof(*merkle) - sizeof(merkle->header))
+		return -1;
+
+	len -= sizeof(*merkle) - sizeof(merkle->header);
+
+	switch (merkle->level) {
+	case ALFRED_MERKLE_ROOT:
+		merkle_receive_root(globals, interface, source, merkle, len);
+		break;
+	case ALFRED_MERKLE_TYPES:
+		merkle_receive_types(globals, interface, source, merkle, len);
+		break;
+	case ALFRED_MERKLE_SOURCES:
+	case ALFRED_MERKLE_SOURCES_REPLY:
+		return merkle_receive_sources(globals, interface, source,
+					      merkle, len);
+	default:
+		return -1;
+	}
+
+	return 0;
+}
@@ -25,6 +25,7 @@
 #include <net/ethernet.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/ip6.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -107,8 +108,8 @@ struct interface *netsock_first_interface(struct globals *globals)
 	return NULL;
 }
 
-static struct interface *netsock_find_interface(struct globals *globals,
-						const char *name)
+struct interface *netsock_find_interface(struct globals *globals,
+					 const char *name)
 {
 	struct interface *interface;
 
@@ -217,7 +218,7 @@ static int netsock_open(struct interface *interface)
 	struct sockaddr_in6 sin6, sin6_mc;
 	struct ipv6_mreq mreq;
 	struct ifreq ifr;
-	int ret;
+	int ret, bufsize;
 
 	interface->netsock = -1;
 	interface->netsock_mcast = -1;
@@ -281,6 +282,15 @@ static int netsock_open(struct interface *interface)
 	}
 	enable_raw_bind_capability(0);
 
+	/* large datasets are sent as bursts of chunks, the kernel limits the
+	 * buffers to net.core.[rw]mem_max */
+	bufsize = ALFRED_SOCKBUF_SIZE;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize,
+		       sizeof(bufsize)) ||
+	    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize,
+		       sizeof(bufsize)))
+		perror("can't set socket buffer size");
+
 	if (bind(sock, (struct sockaddr *)&sin6, sizeof(sin6)) < 0) {
 		perror("can't bind");
 		goto err;
@@ -342,6 +352,12 @@ int netsock_open_all(struct globals *globals)
 	struct interface *interface;
 
 	list_for_each_entry(interface, &globals->interfaces, list) {
+		/* sockets taken over from the previous daemon */
+		if (interface->netsock >= 0) {
+			num_socks++;
+			continue;
+		}
+
 		ret = netsock_open(interface);
 		if (ret >= 0)
 			num_socks++;
@@ -429,6 +445,30 @@ int netsock_receive_packet(struct globals *globals, fd_set *fds)
 	return recvs;
 }
 
+/* largest alfred packet which fits in a single IPv6 packet on the interface,
+ * MAX_PAYLOAD if the MTU is unknown */
+size_t netsock_max_packet(struct interface *interface)
+{
+	struct ifreq ifr;
+	size_t overhead;
+
+	if (interface->netsock < 0)
+		return MAX_PAYLOAD;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, interface->interface, IFNAMSIZ);
+	ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+	if (ioctl(interface->netsock, SIOCGIFMTU, &ifr) == -1)
+		return MAX_PAYLOAD;
+
+	overhead = sizeof(struct ip6_hdr) + sizeof(struct udphdr);
+	if (ifr.ifr_mtu < ALFRED_IPV6_MIN_MTU ||
+	    (size_t)ifr.ifr_mtu - overhead > MAX_PAYLOAD)
+		return MAX_PAYLOAD;
+
+	return ifr.ifr_mtu - overhead;
+}
+
 int netsock_own_address(const struct globals *globals,
 			const struct in6_addr *address)
 {
@@ -70,6 +70,25 @@ struct alfred_transaction_mgmt {
  * @ALFRED_STATUS_ERROR: Error was detected during the transaction
  * @ALFRED_MODESWITCH: Switch between different operation modes
  * @ALFRED_CHANGE_INTERFACE: Change the listening interface
+ * @ALFRED_STATS: Request/reply of the daemon statistics
+ * @ALFRED_HANDOFF: Request of a new daemon to take over sockets and state
+ * @ALFRED_SET_POLICY: Change the policy of a data type
+ * @ALFRED_PUSH_CHUNK: Packet is an alfred_push_chunk_v*
+ * @ALFRED_CAPABILITIES: Packet is an alfred_capabilities_v*
+ * @ALFRED_HISTORY: Request/reply of the stored versions of a dataset
+ * @ALFRED_NACK: Packet is an alfred_nack_v*
+ * @ALFRED_PARITY: Packet is an alfred_parity_v*
+ * @ALFRED_STATUS_ACK: Transaction was applied by the receiver
+ * @ALFRED_MERKLE: Packet is an alfred_merkle_v*
+ * @ALFRED_AGES: Packet is an alfred_ages_v*
+ * @ALFRED_SYNC_ROUND: Packet is an alfred_sync_round_v*
+ * @ALFRED_STATUS_REPAIR: Receiver missed a sync round of the sender
+ * @ALFRED_REFRESH: Packet is an alfred_refresh_v*
+ * @ALFRED_PUSH_DELTA: Packet is an alfred_push_delta_v*
+ * @ALFRED_PUSH_COMPRESSED: Packet is an alfred_push_compressed_v*
+ * @ALFRED_STATUS_UNCHANGED: Requester already has the requested data
+ * @ALFRED_STATUS_PARTIAL: Answer of a request whose deadline expired, only
+ *  holds the datasets stored by then
  */
 enum alfred_packet_type {
 	ALFRED_PUSH_DATA = 0,
@@ -79,6 +98,72 @@ enum alfred_packet_type {
 	ALFRED_STATUS_ERROR = 4,
 	ALFRED_MODESWITCH = 5,
 	ALFRED_CHANGE_INTERFACE = 6,
+	ALFRED_STATS = 7,
+	ALFRED_HANDOFF = 8,
+	ALFRED_SET_POLICY = 9,
+	ALFRED_PUSH_CHUNK = 10,
+	ALFRED_CAPABILITIES = 11,
+	ALFRED_HISTORY = 12,
+	ALFRED_NACK = 13,
+	ALFRED_PARITY = 14,
+	ALFRED_STATUS_ACK = 15,
+	ALFRED_MERKLE = 16,
+	ALFRED_AGES = 17,
+	ALFRED_SYNC_ROUND = 18,
+	ALFRED_STATUS_REPAIR = 19,
+	ALFRED_REFRESH = 20,
+	ALFRED_PUSH_DELTA = 21,
+	ALFRED_PUSH_COMPRESSED = 22,
+	ALFRED_STATUS_UNCHANGED = 23,
+	ALFRED_STATUS_PARTIAL = 24,
+};
+
+/**
+ * enum alfred_capability - Optional features supported by a daemon
+ * @ALFRED_CAP_CHUNK: Receives datasets split in alfred_push_chunk_v* packets
+ * @ALFRED_CAP_NACK: Sends and answers alfred_nack_v* packets
+ * @ALFRED_CAP_FEC: Rebuilds lost packets from alfred_parity_v* packets
+ * @ALFRED_CAP_ACK: Only sends changed datasets to masters which acknowledge
+ *  transactions with ALFRED_STATUS_ACK
+ * @ALFRED_CAP_MERKLE: Compares its data with alfred_merkle_v* packets
+ * @ALFRED_CAP_GOSSIP: Refreshes synced datasets from alfred_ages_v* packets
+ * @ALFRED_CAP_MCAST_SYNC: Receives syncs sent using multicast and asks for
+ *  missed rounds with ALFRED_STATUS_REPAIR
+ * @ALFRED_CAP_REFRESH: Refreshes the datasets of slaves from
+ *  alfred_refresh_v* packets
+ * @ALFRED_CAP_DELTA: Receives changed datasets as alfred_push_delta_v*
+ *  packets and asks for the ones it can't rebuild with ALFRED_REFRESH_MISSING
+ * @ALFRED_CAP_COMPRESS: Receives alfred_push_compressed_v* packets
+ * @ALFRED_CAP_REQUEST_DIGEST: Answers alfred_request_digest_v* packets with
+ *  ALFRED_STATUS_UNCHANGED when the digest matches
+ */
+enum alfred_capability {
+	ALFRED_CAP_CHUNK = 1 << 0,
+	ALFRED_CAP_NACK = 1 << 1,
+	ALFRED_CAP_FEC = 1 << 2,
+	ALFRED_CAP_ACK = 1 << 3,
+	ALFRED_CAP_MERKLE = 1 << 4,
+	ALFRED_CAP_GOSSIP = 1 << 5,
+	ALFRED_CAP_MCAST_SYNC = 1 << 6,
+	ALFRED_CAP_REFRESH = 1 << 7,
+	ALFRED_CAP_DELTA = 1 << 8,
+	ALFRED_CAP_COMPRESS = 1 << 9,
+	ALFRED_CAP_REQUEST_DIGEST = 1 << 10,
+};
+
+/**
+ * enum alfred_merkle_level - Content of an alfred_merkle_v* packet
+ * @ALFRED_MERKLE_ROOT: digest over all data types
+ * @ALFRED_MERKLE_TYPES: digests of consecutive data types
+ * @ALFRED_MERKLE_SOURCES: digests of the datasets of a data type
+ * @ALFRED_MERKLE_SOURCES_REPLY: like ALFRED_MERKLE_SOURCES, sent in reply to
+ *  it
+ */
+enum alfred_merkle_level {
+	ALFRED_MERKLE_ROOT = 0,
+	ALFRED_MERKLE_TYPES = 1,
+	ALFRED_MERKLE_SOURCES = 2,
+	ALFRED_MERKLE_SOURCES_REPLY = 3,
 };
 
 /* packets */
@@ -99,6 +184,95 @@ struct alfred_push_data_v0 {
 	__extension__  struct alfred_data data[0];
 } __packed;
 
+/**
+ * struct alfred_push_chunk_v0 - Packet with a part of a large dataset
+ * @header: TLV header describing the complete packet
+ * @tx: Transaction identificator and sequence number of packet
+ * @source: Mac address of the original source of the data
+ * @type: Type of the data
+ * @version: Version of the data
+ * @total_length: Length of the complete dataset
+ * @offset: Position of the chunk in the dataset
+ * @data: chunk of the dataset (length calculated from "header.length")
+ *
+ * Used for datasets which don't fit in an alfred_push_data_v0 packet. The
+ * chunks are part of the same transaction as the alfred_push_data_v0 packets
+ * and only sent to daemons announcing ALFRED_CAP_CHUNK. Over the unix socket,
+ * the chunks of a dataset are sent in order
+ */
+struct alfred_push_chunk_v0 {
+	struct alfred_tlv header;
+	struct alfred_transaction_mgmt tx;
+	uint8_t source[ETH_ALEN];
+	uint8_t type;
+	uint8_t version;
+	uint32_t total_length;
+	uint32_t offset;
+	/* flexible data block */
+	__extension__ uint8_t data[0];
+} __packed;
+
+/**
+ * struct alfred_push_delta_v0 - Packet with a changed dataset as delta
+ * @header: TLV header describing the complete packet
+ * @tx: Transaction identificator and sequence number of packet
+ * @source: Mac address of the original source of the data
+ * @type: Type of the data
+ * @version: Version of the data
+ * @base_digest: digest of the content the delta is based on in network byte
+ *  order
+ * @total_length: Length of the complete dataset
+ * @data: delta against the base (length calculated from "header.length")
+ *
+ * Sent in a transaction instead of the complete dataset to daemons announcing
+ * ALFRED_CAP_DELTA when the receiver is known to hold the base. A receiver
+ * with a different content asks for the dataset with ALFRED_REFRESH_MISSING
+ */
+struct alfred_push_delta_v0 {
+	struct alfred_tlv header;
+	struct alfred_transaction_mgmt tx;
+	uint8_t source[ETH_ALEN];
+	uint8_t type;
+	uint8_t version;
+	uint64_t base_digest;
+	uint32_t total_length;
+	/* flexible data block */
+	__extension__ uint8_t data[0];
+} __packed;
+
+/**
+ * struct alfred_push_compressed_v0 - Packet with compressed datasets
+ * @header: TLV header describing the complete packet
+ * @tx: Transaction identificator and sequence number of packet
+ * @length: Length of the uncompressed data block
+ * @data: compressed alfred_data block of an alfred_push_data_v0 packet
+ *  (length calculated from "header.length")
+ *
+ * Sent in a transaction instead of an alfred_push_data_v0 packet to daemons
+ * announcing ALFRED_CAP_COMPRESS when the datasets get smaller. The data is
+ * compressed with the LZ codec of compress.c
+ */
+struct alfred_push_compressed_v0 {
+	struct alfred_tlv header;
+	struct alfred_transaction_mgmt tx;
+	uint16_t length;
+	/* flexible data block */
+	__extension__ uint8_t data[0];
+} __packed;
+
+/**
+ * struct alfred_capabilities_v0 - Features supported by the sender
+ * @header: TLV header describing the complete packet
+ * @caps: enum alfred_capability bits
+ *
+ * Sent using multicast by masters together with their announcement and as
+ * unicast by slaves to their master. Receivers must accept longer packets
+ */
+struct alfred_capabilities_v0 {
+	struct alfred_tlv header;
+	uint32_t caps;
+} __packed;
+
 /**
  * struct alfred_announce_master_v0 - Hello packet sent by an alfred master
  * @header: TLV header describing the complete packet
@@ -124,6 +298,75 @@ struct alfred_request_v0 {
 	uint16_t tx_id;
 } __packed;
 
+/**
+ * struct alfred_request_digest_v0 - Request for a type unless unchanged
+ * @header: TLV header describing the complete packet
+ * @requested_type: data type which is requested
+ * @tx_id: random identificator used for this transaction
+ * @digest: XOR of the digests of the datasets of the type the requester has
+ *  (see merkle.c) in network byte order
+ *
+ * Sent as unicast with the type ALFRED_REQUEST to masters announcing
+ * ALFRED_CAP_REQUEST_DIGEST. The master answers with ALFRED_STATUS_UNCHANGED
+ * instead of the datasets when its digest of the type is the same
+ */
+struct alfred_request_digest_v0 {
+	struct alfred_tlv header;
+	uint8_t requested_type;
+	uint16_t tx_id;
+	uint64_t digest;
+} __packed;
+
+/**
+ * enum alfred_freshness - Age of the data a client accepts from a slave
+ * @ALFRED_FRESHNESS_CACHED: datasets fetched within the cache age
+ * @ALFRED_FRESHNESS_FRESH: datasets fetched for this request
+ * @ALFRED_FRESHNESS_STALE: any fetched datasets, outdated ones are fetched
+ *  again after the answer
+ */
+enum alfred_freshness {
+	ALFRED_FRESHNESS_CACHED = 0,
+	ALFRED_FRESHNESS_FRESH = 1,
+	ALFRED_FRESHNESS_STALE = 2,
+};
+
+/**
+ * struct alfred_request_freshness_v0 - Request for a type with a freshness
+ * @header: TLV header describing the complete packet
+ * @requested_type: data type which is requested
+ * @tx_id: random identificator used for this transaction
+ * @freshness: enum alfred_freshness
+ *
+ * Sent with the type ALFRED_REQUEST over the unix socket. A plain
+ * alfred_request_v0 accepts ALFRED_FRESHNESS_CACHED
+ */
+struct alfred_request_freshness_v0 {
+	struct alfred_tlv header;
+	uint8_t requested_type;
+	uint16_t tx_id;
+	uint8_t freshness;
+} __packed;
+
+/**
+ * struct alfred_request_deadline_v0 - Request for a type with a deadline
+ * @header: TLV header describing the complete packet
+ * @requested_type: data type which is requested
+ * @tx_id: random identificator used for this transaction
+ * @freshness: enum alfred_freshness
+ * @deadline: milliseconds until the client is answered with the datasets
+ *  stored by then, 0 to wait for the transaction
+ *
+ * Sent with the type ALFRED_REQUEST over the unix socket. An answer sent
+ * when the deadline expired starts with an ALFRED_STATUS_PARTIAL packet
+ */
+struct alfred_request_deadline_v0 {
+	struct alfred_tlv header;
+	uint8_t requested_type;
+	uint16_t tx_id;
+	uint8_t freshness;
+	uint32_t deadline;
+} __packed;
+
 /**
  * enum alfred_modeswitch_type - Mode of the daemon
  * @ALFRED_MODESWITCH_SLAVE: see OPMODE_SLAVE
@@ -158,6 +401,88 @@ struct alfred_change_interface_v0 {
 	char ifaces[IFNAMSIZ * 16];
 } __packed;
 
+/**
+ * struct alfred_stats_v0 - Statistics of the daemon
+ * @header: TLV header describing the complete packet
+ * @text: "name: value" lines, one per counter (only in the reply)
+ *
+ * Sent to the daemon by client without text, the daemon answers with the
+ * same packet type including the text
+ */
+struct alfred_stats_v0 {
+	struct alfred_tlv header;
+	/* flexible data block */
+	__extension__ char text[0];
+} __packed;
+
+/**
+ * struct alfred_set_policy_v0 - Policy of a data type
+ * @header: TLV header describing the complete packet
+ * @type: data type the policy applies to
+ * @priority: push priority, datasets of higher priority are sent first
+ * @sync: 1 if the data type is synchronized between masters, 0 otherwise
+ * @reserved: always zero
+ * @max_size: largest accepted payload of the data type
+ * @timeout: seconds after which datasets of the type expire
+ *
+ * Sent to the daemon by client
+ */
+struct alfred_set_policy_v0 {
+	struct alfred_tlv header;
+	uint8_t type;
+	uint8_t priority;
+	uint8_t sync;
+	uint8_t reserved;
+	uint32_t max_size;
+	uint32_t timeout;
+} __packed;
+
+/**
+ * struct alfred_history_request_v0 - Request for the versions of a dataset
+ * @header: TLV header describing the complete packet
+ * @source: mac address of the source, all zero for any source
+ * @type: data type of the dataset
+ * @reserved: always zero
+ * @since: only versions with a higher revision are returned
+ *
+ * Sent to the daemon by client. The daemon answers with alfred_history_v*
+ * packets and closes the connection afterwards
+ */
+struct alfred_history_request_v0 {
+	struct alfred_tlv header;
+	uint8_t source[ETH_ALEN];
+	uint8_t type;
+	uint8_t reserved;
+	uint32_t since;
+} __packed;
+
+/**
+ * struct alfred_history_v0 - Part of one version of a dataset
+ * @header: TLV header describing the complete packet
+ * @source: mac address of the source of the dataset
+ * @type: data type of the dataset
+ * @version: data version of this revision
+ * @revision: local revision number, increased on every change
+ * @age: seconds since the revision was stored
+ * @total_length: length of the complete data of this revision
+ * @offset: position of data in the complete data
+ * @data: data block of the revision
+ *
+ * Revisions are sent newest first, each one in order of its offsets
+ */
+struct alfred_history_v0 {
+	struct alfred_tlv header;
+	uint8_t source[ETH_ALEN];
+	uint8_t type;
+	uint8_t version;
+	uint32_t revision;
+	uint32_t age;
+	uint32_t total_length;
+	uint32_t offset;
+	/* flexible data block */
+	__extension__ uint8_t data[0];
+} __packed;
+
 /**
  * struct alfred_status_v0 - Status info of a transaction
  * @header: TLV header describing the complete packet
@@ -174,6 +499,177 @@ struct alfred_status_v0 {
 	struct alfred_transaction_mgmt tx;
 } __packed;
 
+/**
+ * struct alfred_nack_v0 - Request to retransmit lost packets of a transaction
+ * @header: TLV header describing the complete packet
+ * @tx: Transaction identificator and number of packets announced by txend
+ * @missing: sequence numbers of the packets which were not received
+ *
+ * Sent as unicast to the sender of a transaction when its txend packet
+ * announced more packets than were received. The sender retransmits the
+ * missing packets followed by the txend packet again
+ */
+struct alfred_nack_v0 {
+	struct alfred_tlv header;
+	struct alfred_transaction_mgmt tx;
+	/* flexible data block */
+	__extension__ uint16_t missing[0];
+} __packed;
+
+/**
+ * struct alfred_parity_v0 - Parity over a group of packets of a transaction
+ * @header: TLV header describing the complete packet
+ * @tx: Transaction identificator and sequence number of the first packet
+ *  of the group
+ * @count: number of consecutive packets in the group
+ * @type: XOR of the TLV types of the packets
+ * @length: XOR of the TLV lengths of the packets
+ * @data: XOR of the packets following their transaction block, each one
+ *  padded with zeros to the length of the longest
+ *
+ * Sent after the packets of the group to receivers announcing
+ * ALFRED_CAP_FEC. A single lost packet of the group can be rebuilt from the
+ * parity and the other packets
+ */
+struct alfred_parity_v0 {
+	struct alfred_tlv header;
+	struct alfred_transaction_mgmt tx;
+	uint8_t count;
+	uint8_t type;
+	uint16_t length;
+	/* flexible data block */
+	__extension__ uint8_t data[0];
+} __packed;
+
+/**
+ * struct alfred_merkle_source_v0 - Digest of a dataset
+ * @source: mac address of the source of the dataset
+ * @digest: digest over source, type, version and content of the dataset
+ */
+struct alfred_merkle_source_v0 {
+	uint8_t source[ETH_ALEN];
+	uint64_t digest;
+} __packed;
+
+/**
+ * struct alfred_merkle_v0 - Digests of the data of a master
+ * @header: TLV header describing the complete packet
+ * @level: enum alfred_merkle_level
+ * @type: data type of the sources, first data type of the types
+ * @range_start: lowest source mac address covered by the sources
+ * @range_end: highest source mac address covered by the sources
+ * @data: a single digest for the root, one digest per data type for the
+ *  types and alfred_merkle_source_v0 entries sorted by source for the
+ *  sources
+ *
+ * Digests are sent in network byte order. The digest of a data type is the
+ * XOR of the digests of its datasets, the root is the digest over the digests
+ * of all data types. A master receiving a root which differs from its own
+ * replies with its types, the other master then sends the sources of the
+ * differing data types. Both masters push their first hand datasets which
+ * are missing or different in the sources of the other one
+ */
+struct alfred_merkle_v0 {
+	struct alfred_tlv header;
+	uint8_t level;
+	uint8_t type;
+	uint8_t range_start[ETH_ALEN];
+	uint8_t range_end[ETH_ALEN];
+	/* flexible data block */
+	__extension__ uint8_t data[0];
+} __packed;
+
+/**
+ * struct alfred_age_v0 - Time since a dataset was refreshed
+ * @source: mac address of the source of the dataset
+ * @type: data type of the dataset
+ * @age: seconds since the sender received the dataset from its source
+ */
+struct alfred_age_v0 {
+	uint8_t source[ETH_ALEN];
+	uint8_t type;
+	uint32_t age;
+} __packed;
+
+/**
+ * struct alfred_ages_v0 - Refresh times of the datasets of a master
+ * @header: TLV header describing the complete packet
+ * @ages: alfred_age_v0 entries
+ *
+ * Sent as unicast by masters in gossip mode to the masters they sync with.
+ * The receiver moves the refresh time of its synced copies forward to the
+ * one of the sender, but never creates datasets or refreshes them beyond the
+ * time the source sent them. Datasets which are no longer refreshed by
+ * their source still time out on every master
+ */
+struct alfred_ages_v0 {
+	struct alfred_tlv header;
+	/* flexible data block */
+	__extension__ struct alfred_age_v0 ages[0];
+} __packed;
+
+/**
+ * struct alfred_sync_round_v0 - Sync round sent using multicast
+ * @header: TLV header describing the complete packet
+ * @tx: Transaction identificator of the round and number of its packets
+ * @round: sequence number of the round, counted by the sender from 1
+ *
+ * Sent using multicast by masters after the packets of the transaction of a
+ * sync round and before its txend packet. The transaction contains the
+ * first hand datasets changed since the previous round. Lost packets are
+ * requested with alfred_nack_v* packets and retransmitted as unicast. A
+ * receiver which didn't complete the previous round asks the sender with
+ * ALFRED_STATUS_REPAIR for a full sync as unicast
+ */
+struct alfred_sync_round_v0 {
+	struct alfred_tlv header;
+	struct alfred_transaction_mgmt tx;
+	uint32_t round;
+} __packed;
+
+/**
+ * enum alfred_refresh_kind - Meaning of the entries of alfred_refresh_v*
+ * @ALFRED_REFRESH_DIGESTS: Unchanged datasets of a slave
+ * @ALFRED_REFRESH_MISSING: Datasets the receiver doesn't have in this version
+ */
+enum alfred_refresh_kind {
+	ALFRED_REFRESH_DIGESTS = 0,
+	ALFRED_REFRESH_MISSING = 1,
+};
+
+/**
+ * struct alfred_refresh_entry_v0 - Dataset of a slave
+ * @type: data type of the dataset
+ * @version: version of the dataset
+ * @digest: digest of the content of the dataset in network byte order
+ */
+struct alfred_refresh_entry_v0 {
+	uint8_t type;
+	uint8_t version;
+	uint64_t digest;
+} __packed;
+
+/**
+ * struct alfred_refresh_v0 - Keepalive of the datasets of a slave
+ * @header: TLV header describing the complete packet
+ * @kind: enum alfred_refresh_kind
+ * @source: mac address of the source of the datasets
+ * @entries: alfred_refresh_entry_v0 entries
+ *
+ * Sent as unicast by slaves to their master instead of pushing the datasets
+ * which didn't change since the last interval again. The master refreshes
+ * its copies with the same version and digest and answers with the missing
+ * entries, which the slave then pushes. Receivers of an alfred_push_delta_v0
+ * packet they can't rebuild ask its sender for the dataset the same way
+ */
+struct alfred_refresh_v0 {
+	struct alfred_tlv header;
+	uint8_t kind;
+	uint8_t source[ETH_ALEN];
+	/* flexible data block */
+	__extension__ struct alfred_refresh_entry_v0 entries[0];
+} __packed;
+
 #define ALFRED_VERSION			0
 #define ALFRED_PORT			0x4242
 #define ALFRED_MAX_RESERVED_TYPE	64
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "alfred.h"
+#include "batadv_query.h"
+#include "hash.h"
+
+static int peer_compare(void *d1, void *d2)
+{
+	struct peer *p1 = d1, *p2 = d2;
+
+	return memcmp(&p1->hwaddr, &p2->hwaddr, sizeof(p1->hwaddr)) == 0;
+}
+
+static int peer_choose(void *d1, int size)
+{
+	struct peer *p1 = d1;
+	uint32_t hash = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(p1->hwaddr); i++) {
+		hash += p1->hwaddr.ether_addr_octet[i];
+		hash += (hash << 10);
+		hash ^= (hash >> 6);
+	}
+
+	hash += (hash << 3);
+	hash ^= (hash >> 11);
+	hash += (hash << 15);
+
+	return hash % size;
+}
+
+int peer_init(struct globals *globals)
+{
+	globals->peer_hash = hash_new(64, peer_compare, peer_choose);
+	if (!globals->peer_hash)
+		return -1;
+
+	return 0;
+}
+
+/* find the daemon with the given mac address, add it without capabilities
+ * if it wasn't seen yet */
+struct peer *peer_get(struct globals *globals, struct ether_addr *mac)
+{
+	struct peer search, *peer;
+
+	search.hwaddr = *mac;
+	peer = hash_find(globals->peer_hash, &search);
+	if (peer)
+		return peer;
+
+	peer = malloc(sizeof(*peer));
+	if (!peer)
+		return NULL;
+
+	peer->hwaddr = *mac;
+	peer->caps = 0;
+	clock_gettime(CLOCK_MONOTONIC, &peer->last_seen);
+	peer->transactions = 0;
+	peer->transaction_mem = 0;
+	peer->sync_id = 0;
+	peer->sync_seq = 0;
+	peer->acked_seq = 0;
+	memset(&peer->full_sync, 0, sizeof(peer->full_sync));
+	peer->mcast_seq = 0;
+	peer->mcast_round = 0;
+	peer->mcast_id = 0;
+	memset(&peer->repair_time, 0, sizeof(peer->repair_time));
+	if (hash_add(globals->peer_hash, peer)) {
+		free(peer);
+		return NULL;
+	}
+
+	return peer;
+}
+
+void peer_update(struct globals *globals, struct ether_addr *mac,
+		 uint32_t caps)
+{
+	struct peer *peer;
+
+	peer = peer_get(globals, mac);
+	if (!peer)
+		return;
+
+	peer->caps = caps;
+	clock_gettime(CLOCK_MONOTONIC, &peer->last_seen);
+}
+
+/* capabilities of the daemon with the given link-local address, 0 if it
+ * didn't announce any */
+uint32_t peer_caps(struct globals *globals, const struct in6_addr *address)
+{
+	struct peer search, *peer;
+
+	if (ipv6_to_mac(address, &search.hwaddr) < 0)
+		return 0;
+
+	peer = hash_find(globals->peer_hash, &search);
+	if (!peer)
+		return 0;
+
+	return peer->caps;
+}
+
+void peer_purge(struct globals *globals)
+{
+	struct hash_it_t *hashit = NULL;
+	struct timespec now, diff;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (NULL != (hashit = hash_iterate(globals->peer_hash, hashit))) {
+		struct peer *peer = hashit->bucket->data;
+
+		/* still referenced by its transactions */
+		if (peer->transactions)
+			continue;
+
+		time_diff(&now, &peer->last_seen, &diff);
+		if (diff.tv_sec < ALFRED_SERVER_TIMEOUT)
+			continue;
+
+		hash_remove_bucket(globals->peer_hash, hashit);
+		free(peer);
+	}
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alfred.h"
+#include "packet.h"
+
+void policy_default(struct type_policy *policy)
+{
+	policy->timeout = ALFRED_DATA_TIMEOUT;
+	policy->max_size = ALFRED_MAX_DATASET_SIZE;
+	policy->priority = 0;
+	policy->sync = 1;
+}
+
+void policy_init(struct globals *globals)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(globals->policy); i++)
+		policy_default(&globals->policy[i]);
+}
+
+bool policy_is_default(const struct type_policy *policy)
+{
+	struct type_policy def;
+
+	policy_default(&def);
+
+	return policy->timeout == def.timeout &&
+	       policy->max_size == def.max_size &&
+	       policy->priority == def.priority &&
+	       policy->sync == def.sync;
+}
+
+static int policy_parse_value(const char *arg, unsigned long min,
+			      unsigned long max, unsigned long *value)
+{
+	char *end;
+
+	*value = strtoul(arg, &end, 10);
+	if (end == arg || *end != '\0' || *value < min || *value > max)
+		return -1;
+
+	return 0;
+}
+
+/* parse "<type> [timeout=<s>] [max_size=<bytes>] [priority=<0-255>]
+ * [sync=yes|no]". Keys not given keep their default. Returns 1 for empty
+ * lines, 0 on success and -1 on error */
+int policy_parse(char *line, uint8_t *type, struct type_policy *policy)
+{
+	char *token, *saveptr, *value;
+	unsigned long val;
+
+	/* strip comments */
+	token = strchr(line, '#');
+	if (token)
+		*token = '\0';
+
+	token = strtok_r(line, " \t\r\n", &saveptr);
+	if (!token)
+		return 1;
+
+	if (policy_parse_value(token, 0, 255, &val) < 0)
+		return -1;
+
+	*type = val;
+	policy_default(policy);
+
+	while ((token = strtok_r(NULL, " \t\r\n", &saveptr))) {
+		value = strchr(token, '=');
+		if (!value)
+			return -1;
+
+		*value++ = '\0';
+
+		if (strcmp(token, "timeout") == 0) {
+			if (policy_parse_value(value, 1, INT32_MAX,
+					       &val) < 0)
+				return -1;
+			policy->timeout = val;
+		} else if (strcmp(token, "max_size") == 0) {
+			if (policy_parse_value(value, 0, ALFRED_MAX_DATASET_SIZE,
+					       &val) < 0)
+				return -1;
+			policy->max_size = val;
+		} else if (strcmp(token, "priority") == 0) {
+			if (policy_parse_value(value, 0, 255, &val) < 0)
+				return -1;
+			policy->priority = val;
+		} else if (strcmp(token, "sync") == 0) {
+			if (strcmp(value, "yes") == 0)
+				policy->sync = 1;
+			else if (strcmp(value, "no") == 0)
+				policy->sync = 0;
+			else
+				return -1;
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int policy_load_file(struct globals *globals, const char *path)
+{
+	struct type_policy policy;
+	unsigned int lineno = 0;
+	char line[256];
+	uint8_t type;
+	FILE *fp;
+	int ret;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror("can't open policy file");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+
+		ret = policy_parse(line, &type, &policy);
+		if (ret > 0)
+			continue;
+
+		if (ret < 0) {
+			fprintf(stderr, "%s:%u: bad policy\n", path, lineno);
+			fclose(fp);
+			return -1;
+		}
+
+		globals->policy[type] = policy;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* highest priority used by any data type below the given one, -1 if there
+ * is none. Start with a value above 255 */
+int policy_next_priority(struct globals *globals, int priority)
+{
+	int next = -1;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(globals->policy); i++) {
+		if (globals->policy[i].priority >= priority)
+			continue;
+
+		if (globals->policy[i].priority > next)
+			next = globals->policy[i].priority;
+	}
+
+	return next;
+}
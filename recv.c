@@ -19,6 +19,7 @@
  *
  */
 
+#include <endian.h>
 #include <errno.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
@@ -37,14 +38,252 @@
 #include "list.h"
 #include "packet.h"
 
-static int finish_alfred_push_data(struct globals *globals,
-				   struct ether_addr mac,
-				   struct alfred_push_data_v0 *push)
+/**
+ * struct chunk_range - bytes of a staged dataset which were received
+ * @start: offset of the first byte
+ * @end: offset after the last byte
+ */
+struct chunk_range {
+	uint32_t start;
+	uint32_t end;
+};
+
+/**
+ * struct chunk_assembly - dataset staged from the packets of a transaction
+ * @data: source, type and version of the dataset
+ * @total_length: length of the complete dataset
+ * @received: number of bytes received so far, without overlaps
+ * @buf: buffer for the complete dataset
+ * @ranges: sorted struct chunk_range which don't overlap or touch
+ * @num_ranges: number of entries in ranges
+ * @ranges_size: size of ranges in bytes
+ * @base_missing: delta which couldn't be applied, the dataset is requested
+ *  from the sender instead
+ * @list: list node in the staged datasets of a transaction
+ */
+struct chunk_assembly {
+	struct alfred_data data;
+	uint32_t total_length;
+	uint32_t received;
+	uint8_t *buf;
+	uint8_t *ranges;
+	size_t num_ranges;
+	size_t ranges_size;
+	uint8_t base_missing;
+	struct list_head list;
+};
+
+static int finish_alfred_dataset(struct globals *globals,
+				 struct ether_addr mac,
+				 struct alfred_data *data,
+				 const uint8_t *buf, uint32_t len)
+{
+	bool new_entry_created = false;
+	struct dataset *dataset;
+	int ret;
+
+	/* larger than allowed by the policy of the data type */
+	if (len > globals->policy[data->header.type].max_size)
+		return 0;
+
+	dataset = hash_find(globals->data_hash, data);
+	if (!dataset) {
+		dataset = dataset_add(globals, data);
+		if (!dataset)
+			return -1;
+
+		new_entry_created = true;
+	}
+	/* don't overwrite our own data */
+	if (dataset->data_source == SOURCE_LOCAL)
+		return 0;
+
+	ret = dataset_set_data(globals, dataset, data->header.version, buf,
+			       len);
+	if (ret < 0) {
+		if (new_entry_created)
+			dataset_remove(globals, dataset);
+		return -1;
+	}
+
+	/* check that data was changed */
+	if (new_entry_created || ret > 0)
+		changed_data_type(globals, data->header.type);
+
+	/* if the sender is also the the source of the dataset, we
+	 * got a first hand dataset. */
+	if (memcmp(&mac, data->source, ETH_ALEN) == 0)
+		dataset->data_source = SOURCE_FIRST_HAND;
+	else
+		dataset->data_source = SOURCE_SYNCED;
+
+	dataset_refresh(globals, dataset);
+
+	return 0;
+}
+
+/* the memory of the dataset is charged to head if charge is set */
+static struct chunk_assembly *chunk_assembly_new(struct globals *globals,
+						 struct transaction_head *head,
+						 bool charge,
+						 const uint8_t *source,
+						 uint8_t type, uint8_t version,
+						 uint32_t total_length)
+{
+	struct hashtable_t *staged_hash;
+	struct chunk_assembly *assembly;
+
+	if (!head->staged_hash) {
+		head->staged_hash = hash_new(16, data_compare, data_choose);
+		if (!head->staged_hash)
+			return NULL;
+	}
+
+	/* keep the chains short for transactions with many datasets */
+	if (head->staged_hash->elements >= head->staged_hash->size) {
+		staged_hash = hash_resize(head->staged_hash,
+					  head->staged_hash->size * 2);
+		if (!staged_hash)
+			return NULL;
+
+		head->staged_hash = staged_hash;
+	}
+
+	if (charge && transaction_charge(globals, head,
+					 sizeof(*assembly) + total_length) < 0)
+		return NULL;
+
+	assembly = malloc(sizeof(*assembly));
+	if (!assembly)
+		return NULL;
+
+	/* zeroed to not expose old memory if chunks overlap */
+	assembly->buf = calloc(1, total_length ? total_length : 1);
+	if (!assembly->buf) {
+		free(assembly);
+		return NULL;
+	}
+
+	memcpy(assembly->data.source, source, ETH_ALEN);
+	assembly->data.header.type = type;
+	assembly->data.header.version = version;
+	assembly->data.header.length = 0;
+	assembly->total_length = total_length;
+	assembly->received = 0;
+	assembly->ranges = NULL;
+	assembly->num_ranges = 0;
+	assembly->ranges_size = 0;
+	assembly->base_missing = 0;
+
+	if (hash_add(head->staged_hash, assembly)) {
+		free(assembly->buf);
+		free(assembly);
+		return NULL;
+	}
+
+	list_add_tail(&assembly->list, &head->staged);
+
+	return assembly;
+}
+
+static void chunk_assembly_free(struct transaction_head *head,
+				struct chunk_assembly *assembly)
 {
+	hash_remove(head->staged_hash, assembly);
+	list_del(&assembly->list);
+	free(assembly->ranges);
+	free(assembly->buf);
+	free(assembly);
+}
+
+/* mark the bytes offset to offset + len of the dataset as received. Returns
+ * 1 if some of them were already received, the dataset could otherwise be
+ * committed with holes, and -1 on error */
+static int chunk_assembly_cover(struct chunk_assembly *assembly,
+				uint32_t offset, uint32_t len)
+{
+	struct chunk_range *ranges;
+	uint32_t end = offset + len;
+	bool join_prev, join_next;
+	size_t i, num = assembly->num_ranges;
+
+	if (len == 0)
+		return 0;
+
+	if (len > assembly->total_length - assembly->received)
+		return 1;
+
+	/* the complete dataset at once */
+	if (len == assembly->total_length) {
+		assembly->received = len;
+		return 0;
+	}
+
+	ranges = (struct chunk_range *)assembly->ranges;
+
+	/* chunks usually arrive in order and only extend the last range */
+	for (i = num; i > 0; i--) {
+		if (ranges[i - 1].start < end)
+			break;
+	}
+
+	if (i > 0 && ranges[i - 1].end > offset)
+		return 1;
+
+	join_prev = i > 0 && ranges[i - 1].end == offset;
+	join_next = i < num && ranges[i].start == end;
+
+	if (join_prev && join_next) {
+		ranges[i - 1].end = ranges[i].end;
+		memmove(&ranges[i], &ranges[i + 1],
+			(num - i - 1) * sizeof(*ranges));
+		assembly->num_ranges--;
+	} else if (join_prev) {
+		ranges[i - 1].end = end;
+	} else if (join_next) {
+		ranges[i].start = offset;
+	} else {
+		if (buffer_grow(&assembly->ranges, &assembly->ranges_size,
+				(num + 1) * sizeof(*ranges),
+				4 * sizeof(*ranges)) < 0)
+			return -1;
+
+		ranges = (struct chunk_range *)assembly->ranges;
+		memmove(&ranges[i + 1], &ranges[i],
+			(num - i) * sizeof(*ranges));
+		ranges[i].start = offset;
+		ranges[i].end = end;
+		assembly->num_ranges++;
+	}
+
+	assembly->received += len;
+
+	return 0;
+}
+
+static struct chunk_assembly *
+chunk_assembly_find(struct transaction_head *head, const uint8_t *source,
+		    uint8_t type)
+{
+	struct alfred_data search;
+
+	if (!head->staged_hash)
+		return NULL;
+
+	memcpy(search.source, source, ETH_ALEN);
+	search.header.type = type;
+
+	return hash_find(head->staged_hash, &search);
+}
+
+static int stage_alfred_push_data(struct globals *globals,
+				  struct alfred_push_data_v0 *push,
+				  struct transaction_head *head,
+				  bool charge)
+{
+	struct chunk_assembly *assembly;
 	int len, data_len;
-	bool new_entry_created;
 	struct alfred_data *data;
-	struct dataset *dataset;
 	uint8_t *pos;
 
 	len = ntohs(push->header.length);
@@ -59,70 +298,228 @@ static int finish_alfred_push_data(struct globals *globals,
 		if ((int)(data_len + sizeof(*data)) > len)
 			break;
 
-		new_entry_created = false;
-		dataset = hash_find(globals->data_hash, data);
-		if (!dataset) {
-			dataset = malloc(sizeof(*dataset));
-			if (!dataset)
-				goto err;
-
-			dataset->buf = NULL;
-			dataset->data_source = SOURCE_SYNCED;
-
-			memcpy(&dataset->data, data, sizeof(*data));
-			if (hash_add(globals->data_hash, dataset)) {
-				free(dataset);
-				goto err;
-			}
-			new_entry_created = true;
-		}
-		/* don't overwrite our own data */
-		if (dataset->data_source == SOURCE_LOCAL)
-			goto skip_data;
-
-		clock_gettime(CLOCK_MONOTONIC, &dataset->last_seen);
-
-		/* check that data was changed */
-		if (new_entry_created ||
-		    dataset->data.header.length != data_len ||
-		    memcmp(dataset->buf, data->data, data_len) != 0)
-			changed_data_type(globals, data->header.type);
-
-		/* free old buffer */
-		if (dataset->buf) {
-			free(dataset->buf);
-			dataset->data.header.length = 0;
-		}
+		pos += (sizeof(*data) + data_len);
+		len -= (sizeof(*data) + data_len);
 
-		dataset->buf = malloc(data_len);
+		/* larger than allowed by the policy of the data type */
+		if ((uint32_t)data_len >
+		    globals->policy[data->header.type].max_size)
+			continue;
+
+		/* a later dataset with the same key replaces the earlier */
+		assembly = chunk_assembly_find(head, data->source,
+					       data->header.type);
+		if (assembly)
+			chunk_assembly_free(head, assembly);
+
+		assembly = chunk_assembly_new(globals, head, charge,
+					      data->source, data->header.type,
+					      data->header.version, data_len);
+		if (!assembly)
+			return -1;
 
-		/* that's not good */
-		if (!dataset->buf)
-			goto err;
+		memcpy(assembly->buf, data->data, data_len);
+		chunk_assembly_cover(assembly, 0, data_len);
+	}
 
-		dataset->data.header.length = data_len;
-		dataset->data.header.version = data->header.version;
-		memcpy(dataset->buf, data->data, data_len);
+	return 0;
+}
 
-		/* if the sender is also the the source of the dataset, we
-		 * got a first hand dataset. */
-		if (memcmp(&mac, data->source, ETH_ALEN) == 0)
-			dataset->data_source = SOURCE_FIRST_HAND;
-		else
-			dataset->data_source = SOURCE_SYNCED;
-skip_data:
-		pos += (sizeof(*data) + data_len);
-		len -= (sizeof(*data) + data_len);
+static int stage_alfred_push_chunk(struct globals *globals,
+				   struct alfred_push_chunk_v0 *chunk,
+				   struct transaction_head *head,
+				   bool charge)
+{
+	struct chunk_assembly *assembly;
+	uint32_t offset, total_length;
+	size_t len;
+	int ret;
+
+	len = ntohs(chunk->header.length);
+	len -= sizeof(*chunk) - sizeof(chunk->header);
+	offset = ntohl(chunk->offset);
+	total_length = ntohl(chunk->total_length);
+
+	if (total_length == 0 || total_length > ALFRED_MAX_DATASET_SIZE ||
+	    total_length > globals->policy[chunk->type].max_size)
+		return 0;
+
+	if (offset > total_length || len > total_length - offset)
+		return 0;
+
+	assembly = chunk_assembly_find(head, chunk->source, chunk->type);
+
+	/* chunks of different datasets with the same key */
+	if (assembly && (assembly->total_length != total_length ||
+			 assembly->data.header.version != chunk->version))
+		return 0;
+
+	if (!assembly)
+		assembly = chunk_assembly_new(globals, head, charge,
+					      chunk->source, chunk->type,
+					      chunk->version, total_length);
+	if (!assembly)
+		return -1;
+
+	/* duplicated or overlapping chunk */
+	ret = chunk_assembly_cover(assembly, offset, len);
+	if (ret != 0)
+		return ret < 0 ? -1 : 0;
+
+	memcpy(assembly->buf + offset, chunk->data, len);
+
+	return 0;
+}
+
+/* rebuild the dataset from the delta against the stored content */
+static int stage_alfred_push_delta(struct globals *globals,
+				   struct alfred_push_delta_v0 *delta,
+				   struct transaction_head *head,
+				   bool charge)
+{
+	struct chunk_assembly *assembly;
+	struct alfred_data search;
+	struct dataset *dataset;
+	uint32_t total_length;
+	const uint8_t *base;
+	uint8_t *alloc;
+	ssize_t ret = -1;
+	size_t len;
+
+	len = ntohs(delta->header.length);
+	len -= sizeof(*delta) - sizeof(delta->header);
+	total_length = ntohl(delta->total_length);
+
+	if (total_length > ALFRED_MAX_DATASET_SIZE ||
+	    total_length > globals->policy[delta->type].max_size)
+		return 0;
+
+	/* a later dataset with the same key replaces the earlier */
+	assembly = chunk_assembly_find(head, delta->source, delta->type);
+	if (assembly)
+		chunk_assembly_free(head, assembly);
+
+	assembly = chunk_assembly_new(globals, head, charge, delta->source,
+				      delta->type, delta->version,
+				      total_length);
+	if (!assembly)
+		return -1;
+
+	memcpy(search.source, delta->source, ETH_ALEN);
+	search.header.type = delta->type;
+
+	dataset = hash_find(globals->data_hash, &search);
+	if (dataset && dataset->payload &&
+	    dataset->payload->digest == be64toh(delta->base_digest)) {
+		base = dataset_get_data(globals, dataset, false, &alloc);
+		if (base)
+			ret = delta_apply(base, dataset->payload->length,
+					  delta->data, len, assembly->buf,
+					  total_length);
+		free(alloc);
+	}
+
+	if (ret != (ssize_t)total_length) {
+		assembly->base_missing = 1;
+		globals->delta_failed++;
+		return 0;
 	}
+
+	chunk_assembly_cover(assembly, 0, total_length);
+
 	return 0;
-err:
-	return -1;
+}
+
+static int
+stage_alfred_push_compressed(struct globals *globals,
+			     struct alfred_push_compressed_v0 *compressed,
+			     struct transaction_head *head,
+			     bool charge)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct alfred_push_data_v0 *push;
+	size_t len, plain_len;
+	ssize_t ret;
+
+	len = ntohs(compressed->header.length);
+	len -= sizeof(*compressed) - sizeof(compressed->header);
+	plain_len = ntohs(compressed->length);
+
+	push = (struct alfred_push_data_v0 *)buf;
+	if (plain_len > sizeof(buf) - sizeof(*push))
+		return 0;
+
+	ret = lz_decompress(compressed->data, len, (uint8_t *)push->data,
+			    plain_len);
+	if (ret != (ssize_t)plain_len)
+		return 0;
+
+	push->header.type = ALFRED_PUSH_DATA;
+	push->header.version = ALFRED_VERSION;
+	push->header.length = htons(sizeof(*push) - sizeof(push->header) +
+				    plain_len);
+	push->tx = compressed->tx;
+
+	return stage_alfred_push_data(globals, push, head, charge);
+}
+
+/* parse a packet into the staged datasets of a transaction. The staged
+ * datasets are charged to head if charge is set */
+static int stage_alfred_packet(struct globals *globals,
+			       struct alfred_push_data_v0 *push,
+			       struct transaction_head *head,
+			       bool charge)
+{
+	struct alfred_push_compressed_v0 *compressed;
+	struct alfred_push_chunk_v0 *chunk;
+	struct alfred_push_delta_v0 *delta;
+
+	switch (push->header.type) {
+	case ALFRED_PUSH_CHUNK:
+		chunk = (struct alfred_push_chunk_v0 *)push;
+		return stage_alfred_push_chunk(globals, chunk, head, charge);
+	case ALFRED_PUSH_DELTA:
+		delta = (struct alfred_push_delta_v0 *)push;
+		return stage_alfred_push_delta(globals, delta, head,
+					       charge);
+	case ALFRED_PUSH_COMPRESSED:
+		compressed = (struct alfred_push_compressed_v0 *)push;
+		return stage_alfred_push_compressed(globals, compressed,
+						    head, charge);
+	default:
+		return stage_alfred_push_data(globals, push, head, charge);
+	}
+}
+
+/* apply the complete staged datasets and free all of them. Datasets whose
+ * delta couldn't be applied are requested from the sender */
+static void commit_staged(struct globals *globals, struct interface *interface,
+			  struct in6_addr *source, struct ether_addr mac,
+			  struct transaction_head *head)
+{
+	struct chunk_assembly *assembly, *safe;
+
+	list_for_each_entry_safe(assembly, safe, &head->staged, list) {
+		if (assembly->base_missing)
+			refresh_request(interface, source, &assembly->data);
+		else if (assembly->received >= assembly->total_length)
+			finish_alfred_dataset(globals, mac, &assembly->data,
+					      assembly->buf,
+					      assembly->total_length);
+
+		chunk_assembly_free(head, assembly);
+	}
 }
 
 struct transaction_head *
 transaction_add(struct globals *globals, struct ether_addr mac, uint16_t id)
 {
 	struct transaction_head *head;
+	struct peer *peer;
+
+	peer = peer_get(globals, &mac);
+	if (!peer)
+		return NULL;
 
 	head = malloc(sizeof(*head));
 	if (!head)
@@ -131,35 +528,200 @@ transaction_add(struct globals *globals, struct ether_addr mac, uint16_t id)
 	head->server_addr = mac;
 	head->id = id;
 	head->requested_type = 0;
+	head->request = 0;
+	head->hedges = 0;
+	head->deadline = 0;
 	head->finished = 0;
 	head->num_packet = 0;
 	head->client_socket = -1;
-	clock_gettime(CLOCK_MONOTONIC, &head->last_rx_time);
-	INIT_LIST_HEAD(&head->packet_list);
+	clock_gettime(CLOCK_MONOTONIC, &head->started);
+	head->last_rx_time = head->started;
+	head->nacks = 0;
+	head->seqno_map = NULL;
+	head->seqno_map_size = 0;
+	head->buf = NULL;
+	head->buf_len = 0;
+	head->buf_size = 0;
+	head->parity = NULL;
+	head->parity_len = 0;
+	head->parity_size = 0;
+	INIT_LIST_HEAD(&head->staged);
+	head->staged_hash = NULL;
+	head->peer = peer;
+	head->mem_used = 0;
 	if (hash_add(globals->transaction_hash, head)) {
 		free(head);
 		return NULL;
 	}
 
+	peer->transactions++;
+
 	return head;
 }
 
-struct transaction_head *transaction_clean(struct globals *globals,
-					   struct transaction_head *head)
+/* check whether another transaction of the daemon with the given mac address
+ * can be received without exceeding the limits */
+static int transaction_admit(struct globals *globals, struct ether_addr *mac)
+{
+	struct peer search, *peer;
+
+	if (globals->transaction_hash->elements >= ALFRED_MAX_TRANSACTIONS)
+		return -1;
+
+	if (globals->tx_mem_limit &&
+	    globals->tx_mem_used >= globals->tx_mem_limit)
+		return -1;
+
+	search.hwaddr = *mac;
+	peer = hash_find(globals->peer_hash, &search);
+	if (!peer)
+		return 0;
+
+	if (peer->transactions >= ALFRED_MAX_PEER_TRANSACTIONS)
+		return -1;
+
+	if (globals->tx_peer_mem_limit &&
+	    peer->transaction_mem >= globals->tx_peer_mem_limit)
+		return -1;
+
+	return 0;
+}
+
+/* account len bytes of received data to the transaction. Returns -1 if this
+ * would exceed the limits of all transactions or of the transactions of the
+ * sender */
+int transaction_charge(struct globals *globals, struct transaction_head *head,
+		       size_t len)
+{
+	struct peer *peer = head->peer;
+
+	if (globals->tx_mem_limit &&
+	    globals->tx_mem_used + len > globals->tx_mem_limit)
+		return -1;
+
+	if (globals->tx_peer_mem_limit &&
+	    peer->transaction_mem + len > globals->tx_peer_mem_limit)
+		return -1;
+
+	head->mem_used += len;
+	peer->transaction_mem += len;
+	globals->tx_mem_used += len;
+
+	return 0;
+}
+
+/* store a packet of the transaction, or parse it right away into the staged
+ * datasets with --stream-apply. Returns 1 if the sequence number was already
+ * received, 0 if the packet was added and -1 on error */
+int transaction_add_packet(struct globals *globals,
+			   struct transaction_head *head,
+			   struct alfred_push_data_v0 *push)
 {
-	struct transaction_packet *transaction_packet, *safe;
+	uint16_t seqno = ntohs(push->tx.seqno);
+	size_t len = ntohs(push->header.length) + sizeof(push->header);
+	uint8_t bit = 1 << (seqno % 8);
 
-	list_for_each_entry_safe(transaction_packet, safe, &head->packet_list,
-				 list) {
-		list_del(&transaction_packet->list);
-		free(transaction_packet->push);
-		free(transaction_packet);
+	if (buffer_grow(&head->seqno_map, &head->seqno_map_size,
+			seqno / 8 + 1, 32) < 0)
+		return -1;
+
+	if (head->seqno_map[seqno / 8] & bit)
+		return 1;
+
+	if (globals->stream_apply) {
+		if (stage_alfred_packet(globals, push, head, true) < 0)
+			return -1;
+	} else {
+		if (transaction_charge(globals, head, len) < 0)
+			return -1;
+
+		if (buffer_grow(&head->buf, &head->buf_size,
+				head->buf_len + len, MAX_PAYLOAD) < 0)
+			return -1;
+
+		memcpy(head->buf + head->buf_len, push, len);
+		head->buf_len += len;
 	}
 
+	head->seqno_map[seqno / 8] |= bit;
+	head->num_packet++;
+
+	return 0;
+}
+
+/* free the received data of the transaction */
+void transaction_release(struct globals *globals,
+			 struct transaction_head *head)
+{
+	struct chunk_assembly *assembly, *safe;
+
+	list_for_each_entry_safe(assembly, safe, &head->staged, list)
+		chunk_assembly_free(head, assembly);
+
+	if (head->staged_hash)
+		hash_delete(head->staged_hash, NULL);
+	head->staged_hash = NULL;
+
+	free(head->seqno_map);
+	head->seqno_map = NULL;
+	head->seqno_map_size = 0;
+	free(head->buf);
+	head->buf = NULL;
+	head->buf_len = 0;
+	head->buf_size = 0;
+	free(head->parity);
+	head->parity = NULL;
+	head->parity_len = 0;
+	head->parity_size = 0;
+
+	head->peer->transaction_mem -= head->mem_used;
+	globals->tx_mem_used -= head->mem_used;
+	head->mem_used = 0;
+}
+
+struct transaction_head *transaction_clean(struct globals *globals,
+					   struct transaction_head *head)
+{
+	transaction_release(globals, head);
+	head->peer->transactions--;
+
 	hash_remove(globals->transaction_hash, head);
 	return head;
 }
 
+static void send_status(struct interface *interface,
+			struct in6_addr *destination, uint8_t type,
+			uint16_t id, uint16_t seqno)
+{
+	struct alfred_status_v0 status;
+	uint16_t length;
+
+	status.header.type = type;
+	status.header.version = ALFRED_VERSION;
+	length = sizeof(status) - sizeof(status.header);
+	status.header.length = htons(length);
+
+	status.tx.id = htons(id);
+	status.tx.seqno = htons(seqno);
+
+	send_alfred_packet(interface, destination, &status, sizeof(status));
+}
+
+/* drop the data of a transaction which can't be stored and tell the sender
+ * that it won't be requested. The transaction is kept until it times out to
+ * ignore its remaining packets */
+static void transaction_reject(struct globals *globals,
+			       struct interface *interface,
+			       struct in6_addr *source,
+			       struct transaction_head *head)
+{
+	transaction_release(globals, head);
+	head->finished = -1;
+	globals->tx_rejected++;
+
+	send_status(interface, source, ALFRED_STATUS_ERROR, head->id, 0);
+}
+
 struct transaction_head *
 transaction_clean_hash(struct globals *globals, struct transaction_head *search)
 {
@@ -172,23 +734,42 @@ transaction_clean_hash(struct globals *globals, struct transaction_head *search)
 	return transaction_clean(globals, head);
 }
 
+/* check the length of a received packet using the transaction block of
+ * alfred_push_data_v0 packets */
+int push_packet_check(struct alfred_push_data_v0 *push)
+{
+	size_t len = ntohs(push->header.length) + sizeof(push->header);
+
+	switch (push->header.type) {
+	case ALFRED_PUSH_DATA:
+		return len < sizeof(*push) ? -1 : 0;
+	case ALFRED_PUSH_CHUNK:
+		return len < sizeof(struct alfred_push_chunk_v0) ? -1 : 0;
+	case ALFRED_PARITY:
+		return len < sizeof(struct alfred_parity_v0) ? -1 : 0;
+	case ALFRED_PUSH_DELTA:
+		return len < sizeof(struct alfred_push_delta_v0) ? -1 : 0;
+	case ALFRED_PUSH_COMPRESSED:
+		return len < sizeof(struct alfred_push_compressed_v0) ? -1 : 0;
+	default:
+		return -1;
+	}
+}
+
 static int process_alfred_push_data(struct globals *globals,
+				    struct interface *interface,
 				    struct in6_addr *source,
 				    struct alfred_push_data_v0 *push)
 {
-	int len;
 	struct ether_addr mac;
 	int ret;
 	struct transaction_head search, *head;
-	struct transaction_packet *transaction_packet;
-	int found;
 
 	ret = ipv6_to_mac(source, &mac);
 	if (ret < 0)
 		goto err;
 
-	len = ntohs(push->header.length);
-	if (len < (int)(sizeof(*push) - sizeof(push->header)))
+	if (push_packet_check(push) < 0)
 		goto err;
 
 	search.server_addr = mac;
@@ -201,6 +782,16 @@ static int process_alfred_push_data(struct globals *globals,
 		if (globals->opmode != OPMODE_MASTER)
 			goto err;
 
+		/* answer only the first packet to not flood the sender */
+		if (transaction_admit(globals, &mac) < 0) {
+			globals->tx_rejected++;
+			if (push->tx.seqno == 0)
+				send_status(interface, source,
+					    ALFRED_STATUS_ERROR,
+					    ntohs(push->tx.id), 0);
+			goto err;
+		}
+
 		head = transaction_add(globals, mac, ntohs(push->tx.id));
 		if (!head)
 			goto err;
@@ -211,33 +802,25 @@ static int process_alfred_push_data(struct globals *globals,
 	if (head->finished != 0)
 		return -1;
 
-	found = 0;
-	list_for_each_entry(transaction_packet, &head->packet_list, list) {
-		if (transaction_packet->push->tx.seqno == push->tx.seqno) {
-			found = 1;
-			break;
-		}
-	}
+	if (push->header.type == ALFRED_PARITY) {
+		/* lost packets can't be rebuilt from staged data */
+		if (globals->stream_apply)
+			return 0;
 
-	/* it seems the packet was duplicated */
-	if (found)
-		return 0;
-
-	transaction_packet = malloc(sizeof(*transaction_packet));
-	if (!transaction_packet)
-		goto err;
+		if (fec_store_parity(globals, head,
+				     (struct alfred_parity_v0 *)push) < 0)
+			goto reject;
 
-	transaction_packet->push = malloc(len + sizeof(push->header));
-	if (!transaction_packet->push) {
-		free(transaction_packet);
-		goto err;
+		return 0;
 	}
 
-	memcpy(transaction_packet->push, push, len + sizeof(push->header));
-	list_add_tail(&transaction_packet->list, &head->packet_list);
-	head->num_packet++;
+	/* duplicated packets are dropped by transaction_add_packet */
+	if (transaction_add_packet(globals, head, push) < 0)
+		goto reject;
 
 	return 0;
+reject:
+	transaction_reject(globals, interface, source, head);
 err:
 	return -1;
 }
@@ -304,6 +887,8 @@ static int process_alfred_request(struct globals *globals,
 				  struct in6_addr *source,
 				  struct alfred_request_v0 *request)
 {
+	struct alfred_request_digest_v0 *request_digest;
+	uint8_t type = request->requested_type;
 	int len;
 
 	len = ntohs(request->header.length);
@@ -311,22 +896,99 @@ static int process_alfred_request(struct globals *globals,
 	if (request->header.version != ALFRED_VERSION)
 		return -1;
 
-	if (len != (sizeof(*request) - sizeof(request->header)))
+	/* the requester already has the same datasets of the type */
+	if (len == (sizeof(*request_digest) - sizeof(request->header))) {
+		request_digest = (struct alfred_request_digest_v0 *)request;
+		if (be64toh(request_digest->digest) ==
+		    globals->merkle_types[type]) {
+			send_status(interface, source, ALFRED_STATUS_UNCHANGED,
+				    ntohs(request->tx_id), 0);
+			globals->requests_unchanged++;
+			return 0;
+		}
+	} else if (len != (sizeof(*request) - sizeof(request->header))) {
 		return -1;
+	}
 
 	push_data(globals, interface, source, SOURCE_SYNCED,
-		  request->requested_type, request->tx_id);
+		  request->requested_type, request->tx_id, 0);
 
 	return 0;
 }
 
+static int process_alfred_capabilities(struct globals *globals,
+				       struct in6_addr *source,
+				       struct alfred_capabilities_v0 *caps)
+{
+	struct ether_addr mac;
+	int len;
+
+	len = ntohs(caps->header.length);
+
+	/* newer versions may append fields */
+	if (len < (int)(sizeof(*caps) - sizeof(caps->header)))
+		return -1;
+
+	if (ipv6_to_mac(source, &mac) < 0)
+		return -1;
+
+	peer_update(globals, &mac, ntohl(caps->caps));
+
+	return 0;
+}
+
+/* ask the sender for the packets missing up to num_packet */
+static void send_nack(struct interface *interface, struct in6_addr *source,
+		      struct transaction_head *head, uint16_t num_packet)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct alfred_nack_v0 *nack;
+	size_t num_missing = 0, max_missing;
+	uint32_t seqno;
+
+	nack = (struct alfred_nack_v0 *)buf;
+	max_missing = (sizeof(buf) - sizeof(*nack)) / sizeof(nack->missing[0]);
+
+	for (seqno = 0; seqno < num_packet; seqno++) {
+		if (num_missing == max_missing)
+			break;
+
+		if (seqno / 8 < head->seqno_map_size &&
+		    head->seqno_map[seqno / 8] & (1 << (seqno % 8)))
+			continue;
+
+		nack->missing[num_missing++] = htons(seqno);
+	}
+
+	nack->header.type = ALFRED_NACK;
+	nack->header.version = ALFRED_VERSION;
+	nack->header.length = htons(sizeof(*nack) - sizeof(nack->header) +
+				    num_missing * sizeof(nack->missing[0]));
+	nack->tx.id = htons(head->id);
+	nack->tx.seqno = htons(num_packet);
+
+	send_alfred_packet(interface, source, nack,
+			   sizeof(*nack) +
+			   num_missing * sizeof(nack->missing[0]));
+}
+
+/* the data type requested by head is current as of now */
+static void transaction_fetched(struct globals *globals,
+				struct transaction_head *head)
+{
+	clock_gettime(CLOCK_MONOTONIC,
+		      &globals->type_fetched[head->requested_type]);
+}
+
 static int process_alfred_status_txend(struct globals *globals,
+				       struct interface *interface,
 				       struct in6_addr *source,
 				       struct alfred_status_v0 *request)
 {
 	struct transaction_head search, *head;
-	struct transaction_packet *transaction_packet, *safe;
+	struct alfred_push_data_v0 *push;
 	struct ether_addr mac;
+	size_t pos;
 	int len, ret;
 
 	len = ntohs(request->header.length);
@@ -352,27 +1014,142 @@ static int process_alfred_status_txend(struct globals *globals,
 	if (head->finished != 0)
 		return -1;
 
-	/* missing packets -> cleanup everything */
-	if (head->num_packet != ntohs(request->tx.seqno))
+	/* rebuild what the parity packets allow */
+	if (head->num_packet < ntohs(request->tx.seqno))
+		fec_recover(globals, head, ntohs(request->tx.seqno));
+
+	/* missing packets -> ask the sender for them while retries are left,
+	 * cleanup everything otherwise */
+	if (head->num_packet < ntohs(request->tx.seqno) &&
+	    head->nacks < ALFRED_NACK_RETRIES &&
+	    peer_caps(globals, source) & ALFRED_CAP_NACK) {
+		head->nacks++;
+		globals->nacks_sent++;
+		send_nack(interface, source, head, ntohs(request->tx.seqno));
+		return 0;
+	}
+
+	if (head->num_packet != ntohs(request->tx.seqno)) {
 		head->finished = -1;
-	else
+		globals->tx_incomplete++;
+	} else {
 		head->finished = 1;
+	}
+
+	/* buffered packets are only staged now. The transaction is dropped
+	 * when one of them can't be staged to not commit parts of it */
+	pos = 0;
+	while (head->finished == 1 && pos < head->buf_len) {
+		push = (struct alfred_push_data_v0 *)(head->buf + pos);
+		pos += ntohs(push->header.length) + sizeof(push->header);
+
+		if (stage_alfred_packet(globals, push, head, false) < 0)
+			transaction_reject(globals, interface, source, head);
+	}
+
+	if (head->finished == 1) {
+		commit_staged(globals, interface, source, mac, head);
+		datastore_enforce_limit(globals);
+
+		/* answers to requests are kept for later requests of clients.
+		 * Multicast rounds are not acknowledged by every receiver, a
+		 * missed one is detected with the next round */
+		if (head->request) {
+			transaction_fetched(globals, head);
+		} else if (head->peer->mcast_round &&
+			   head->peer->mcast_id == head->id) {
+			head->peer->mcast_seq = head->peer->mcast_round;
+			head->peer->mcast_round = 0;
+		} else if (peer_caps(globals, source) & ALFRED_CAP_ACK) {
+			send_status(interface, source, ALFRED_STATUS_ACK,
+				    head->id, head->num_packet);
+		}
+	}
+
+	head = transaction_clean_hash(globals, &search);
+	if (!head)
+		return -1;
+
+	hedge_finish(globals, head);
+	if (head->client_socket < 0)
+		free(head);
+	else
+		unix_sock_req_data_finish(globals, head);
+
+	return 0;
+}
+
+static int process_alfred_status_ack(struct globals *globals,
+				     struct in6_addr *source,
+				     struct alfred_status_v0 *status)
+{
+	struct ether_addr mac;
+	struct peer *peer;
+	int len;
+
+	len = ntohs(status->header.length);
+	if (len != (sizeof(*status) - sizeof(status->header)))
+		return -1;
+
+	if (ipv6_to_mac(source, &mac) < 0)
+		return -1;
+
+	peer = peer_get(globals, &mac);
+	if (!peer)
+		return -1;
+
+	/* acknowledgement of an older sync */
+	if (status->tx.id != peer->sync_id)
+		return -1;
+
+	peer->acked_seq = peer->sync_seq;
+
+	return 0;
+}
+
+/* the master has the same datasets of the requested type as we do, answer
+ * the client from the data store */
+static int process_alfred_status_unchanged(struct globals *globals,
+					   struct in6_addr *source,
+					   struct alfred_status_v0 *status)
+{
+	struct transaction_head search, *head;
+	struct hash_it_t *hashit = NULL;
+	int len;
+
+	len = ntohs(status->header.length);
+	if (len != (sizeof(*status) - sizeof(status->header)))
+		return -1;
+
+	if (ipv6_to_mac(source, &search.server_addr) < 0)
+		return -1;
+
+	search.id = ntohs(status->tx.id);
+
+	head = hash_find(globals->transaction_hash, &search);
+	if (!head || !head->request || head->finished != 0)
+		return -1;
+
+	/* our copies are as current as the ones of the master */
+	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
+		struct dataset *dataset = hashit->bucket->data;
 
-	list_for_each_entry_safe(transaction_packet, safe, &head->packet_list,
-				 list) {
-		if (head->finished == 1)
-			finish_alfred_push_data(globals, mac,
-						transaction_packet->push);
+		if (dataset->data.header.type != head->requested_type ||
+		    dataset->data_source == SOURCE_LOCAL)
+			continue;
 
-		list_del(&transaction_packet->list);
-		free(transaction_packet->push);
-		free(transaction_packet);
+		dataset_refresh(globals, dataset);
 	}
 
+	globals->requests_unchanged++;
+	transaction_fetched(globals, head);
+	head->finished = 1;
+
 	head = transaction_clean_hash(globals, &search);
 	if (!head)
 		return -1;
 
+	hedge_finish(globals, head);
 	if (head->client_socket < 0)
 		free(head);
 	else
@@ -381,6 +1158,52 @@ static int process_alfred_status_txend(struct globals *globals,
 	return 0;
 }
 
+static int process_alfred_sync_round(struct globals *globals,
+				     struct interface *interface,
+				     struct in6_addr *source,
+				     struct alfred_sync_round_v0 *round)
+{
+	struct ether_addr mac;
+	struct peer *peer;
+	uint32_t seq;
+	int len;
+
+	if (globals->opmode != OPMODE_MASTER)
+		return -1;
+
+	len = ntohs(round->header.length);
+	if (len < (int)(sizeof(*round) - sizeof(round->header)))
+		return -1;
+
+	if (ipv6_to_mac(source, &mac) < 0)
+		return -1;
+
+	peer = peer_get(globals, &mac);
+	if (!peer)
+		return -1;
+
+	seq = ntohl(round->round);
+
+	/* the previous round was lost or incomplete, the full sync sent as
+	 * answer replaces all missed rounds */
+	if (peer->mcast_seq + 1 != seq) {
+		send_status(interface, source, ALFRED_STATUS_REPAIR,
+			    ntohs(round->tx.id), 0);
+		peer->mcast_seq = seq - 1;
+	}
+
+	/* the round is completed by its txend packet */
+	if (ntohs(round->tx.seqno) == 0) {
+		peer->mcast_seq = seq;
+		peer->mcast_round = 0;
+	} else {
+		peer->mcast_round = seq;
+		peer->mcast_id = ntohs(round->tx.id);
+	}
+
+	return 0;
+}
+
 int recv_alfred_packet(struct globals *globals, struct interface *interface,
 		       int recv_sock)
 {
@@ -422,7 +1245,12 @@ int recv_alfred_packet(struct globals *globals, struct interface *interface,
 
 	switch (packet->type) {
 	case ALFRED_PUSH_DATA:
-		process_alfred_push_data(globals, &source.sin6_addr,
+	case ALFRED_PUSH_CHUNK:
+	case ALFRED_PUSH_DELTA:
+	case ALFRED_PUSH_COMPRESSED:
+	case ALFRED_PARITY:
+		process_alfred_push_data(globals, interface,
+					 &source.sin6_addr,
 					 (struct alfred_push_data_v0 *)packet);
 		break;
 	case ALFRED_ANNOUNCE_MASTER:
@@ -435,9 +1263,50 @@ int recv_alfred_packet(struct globals *globals, struct interface *interface,
 				       (struct alfred_request_v0 *)packet);
 		break;
 	case ALFRED_STATUS_TXEND:
-		process_alfred_status_txend(globals, &source.sin6_addr,
+		process_alfred_status_txend(globals, interface,
+					    &source.sin6_addr,
 					    (struct alfred_status_v0 *)packet);
 		break;
+	case ALFRED_STATUS_ACK:
+		process_alfred_status_ack(globals, &source.sin6_addr,
+					  (struct alfred_status_v0 *)packet);
+		break;
+	case ALFRED_STATUS_UNCHANGED:
+		process_alfred_status_unchanged(globals, &source.sin6_addr,
+						(struct alfred_status_v0 *)packet);
+		break;
+	case ALFRED_MERKLE:
+		merkle_receive(globals, interface, &source.sin6_addr,
+			       (struct alfred_merkle_v0 *)packet);
+		break;
+	case ALFRED_AGES:
+		gossip_receive_ages(globals, (struct alfred_ages_v0 *)packet);
+		break;
+	case ALFRED_SYNC_ROUND:
+		process_alfred_sync_round(globals, interface,
+					  &source.sin6_addr,
+					  (struct alfred_sync_round_v0 *)packet);
+		break;
+	case ALFRED_STATUS_REPAIR:
+		sync_repair(globals, interface, &source.sin6_addr,
+			    (struct alfred_status_v0 *)packet);
+		break;
+	case ALFRED_REFRESH:
+		refresh_receive(globals, interface, &source.sin6_addr,
+				(struct alfred_refresh_v0 *)packet);
+		break;
+	case ALFRED_STATUS_ERROR:
+		retransmit_cancel(globals, &source.sin6_addr,
+				  (struct alfred_status_v0 *)packet);
+		break;
+	case ALFRED_NACK:
+		retransmit_nack(globals, interface, &source.sin6_addr,
+				(struct alfred_nack_v0 *)packet);
+		break;
+	case ALFRED_CAPABILITIES:
+		process_alfred_capabilities(globals, &source.sin6_addr,
+					    (struct alfred_capabilities_v0 *)packet);
+		break;
 	default:
 		/* unknown packet type */
 		return -1;
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+/* Keepalive of the datasets of a slave. Instead of pushing its unchanged
+ * datasets every interval, a slave sends their version and digest. The
+ * master refreshes the matching copies and answers with the entries it
+ * doesn't have, which the slave pushes as usual. Receivers of deltas they
+ * can't apply ask for the complete datasets the same way. */
+
+#include <endian.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alfred.h"
+#include "hash.h"
+#include "packet.h"
+
+/**
+ * struct refresh_ctx - alfred_refresh_v0 packet being filled
+ * @interface: interface to send on
+ * @dest: receiver of the packets
+ * @max_count: entries fitting in a packet
+ * @count: entries in the packet
+ * @refresh: the packet, MAX_PAYLOAD bytes
+ */
+struct refresh_ctx {
+	struct interface *interface;
+	struct in6_addr *dest;
+	size_t max_count;
+	size_t count;
+	struct alfred_refresh_v0 *refresh;
+};
+
+static void refresh_ctx_init(struct refresh_ctx *ctx,
+			     struct interface *interface,
+			     struct in6_addr *dest, uint8_t *buf,
+			     enum alfred_refresh_kind kind,
+			     const uint8_t *source)
+{
+	ctx->interface = interface;
+	ctx->dest = dest;
+	ctx->count = 0;
+	ctx->max_count = (netsock_max_packet(interface) -
+			  sizeof(*ctx->refresh)) /
+			 sizeof(ctx->refresh->entries[0]);
+
+	ctx->refresh = (struct alfred_refresh_v0 *)buf;
+	ctx->refresh->header.type = ALFRED_REFRESH;
+	ctx->refresh->header.version = ALFRED_VERSION;
+	ctx->refresh->kind = kind;
+	memcpy(ctx->refresh->source, source, ETH_ALEN);
+}
+
+static void refresh_ctx_send(struct refresh_ctx *ctx)
+{
+	struct alfred_refresh_v0 *refresh = ctx->refresh;
+	size_t len;
+
+	if (!ctx->count)
+		return;
+
+	len = sizeof(*refresh) + ctx->count * sizeof(refresh->entries[0]);
+	refresh->header.length = htons(len - sizeof(refresh->header));
+	send_alfred_packet(ctx->interface, ctx->dest, refresh, len);
+
+	ctx->count = 0;
+}
+
+static void refresh_ctx_add(struct refresh_ctx *ctx, uint8_t type,
+			    uint8_t version, uint64_t digest)
+{
+	struct alfred_refresh_entry_v0 *entry;
+
+	entry = &ctx->refresh->entries[ctx->count++];
+	entry->type = type;
+	entry->version = version;
+	entry->digest = htobe64(digest);
+
+	if (ctx->count == ctx->max_count)
+		refresh_ctx_send(ctx);
+}
+
+/* the entries of a packet share its source, the packet is sent before
+ * entries of another source are added */
+static void refresh_ctx_source(struct refresh_ctx *ctx, const uint8_t *source)
+{
+	if (memcmp(ctx->refresh->source, source, ETH_ALEN) == 0)
+		return;
+
+	refresh_ctx_send(ctx);
+	memcpy(ctx->refresh->source, source, ETH_ALEN);
+}
+
+/* send the digests of the local datasets which didn't change after since,
+ * the changed ones are pushed */
+int refresh_send(struct globals *globals, struct interface *interface,
+		 struct in6_addr *dest, uint32_t since)
+{
+	struct hash_it_t *hashit = NULL;
+	uint8_t buf[MAX_PAYLOAD];
+	struct refresh_ctx ctx;
+
+	refresh_ctx_init(&ctx, interface, dest, buf, ALFRED_REFRESH_DIGESTS,
+			 interface->hwaddr.ether_addr_octet);
+
+	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
+		struct dataset *dataset = hashit->bucket->data;
+
+		if (dataset->data_source != SOURCE_LOCAL ||
+		    dataset->change_seq > since || !dataset->payload)
+			continue;
+
+		/* local datasets are stored with the address of the first
+		 * interface when they were set, which differs after the
+		 * interfaces changed */
+		refresh_ctx_source(&ctx, dataset->data.source);
+		refresh_ctx_add(&ctx, dataset->data.header.type,
+				dataset->data.header.version,
+				dataset->payload->digest);
+	}
+
+	refresh_ctx_send(&ctx);
+
+	return 0;
+}
+
+/* refresh the datasets of the slave which are unchanged, ask for the
+ * others */
+static int refresh_digests(struct globals *globals,
+			   struct interface *interface,
+			   struct in6_addr *source,
+			   struct alfred_refresh_v0 *refresh, size_t count)
+{
+	struct alfred_refresh_entry_v0 *entry;
+	uint8_t buf[MAX_PAYLOAD];
+	struct alfred_data search;
+	struct dataset *dataset;
+	struct refresh_ctx ctx;
+	size_t i;
+
+	if (globals->opmode != OPMODE_MASTER)
+		return -1;
+
+	refresh_ctx_init(&ctx, interface, source, buf, ALFRED_REFRESH_MISSING,
+			 refresh->source);
+
+	memcpy(search.source, refresh->source, ETH_ALEN);
+
+	for (i = 0; i < count; i++) {
+		entry = &refresh->entries[i];
+		search.header.type = entry->type;
+
+		/* synced copies are only kept alive by their master, pushing
+		 * them again makes this master their first hand owner */
+		dataset = hash_find(globals->data_hash, &search);
+		if (dataset && dataset->data_source == SOURCE_FIRST_HAND &&
+		    dataset->payload &&
+		    dataset->data.header.version == entry->version &&
+		    dataset->payload->digest == be64toh(entry->digest)) {
+			dataset_refresh(globals, dataset);
+			globals->refreshed++;
+			continue;
+		}
+
+		globals->refresh_missing++;
+		refresh_ctx_add(&ctx, entry->type, entry->version,
+				be64toh(entry->digest));
+	}
+
+	refresh_ctx_send(&ctx);
+
+	return 0;
+}
+
+/* ask the sender of a delta for the complete dataset */
+int refresh_request(struct interface *interface, struct in6_addr *dest,
+		    struct alfred_data *data)
+{
+	uint8_t buf[sizeof(struct alfred_refresh_v0) +
+		    sizeof(struct alfred_refresh_entry_v0)];
+	struct refresh_ctx ctx;
+
+	refresh_ctx_init(&ctx, interface, dest, buf, ALFRED_REFRESH_MISSING,
+			 data->source);
+	refresh_ctx_add(&ctx, data->header.type, data->header.version, 0);
+	refresh_ctx_send(&ctx);
+
+	return 0;
+}
+
+/* push the datasets the receiver asked for. Slaves only send their local
+ * datasets, masters the ones they sync */
+static int refresh_missing(struct globals *globals,
+			   struct interface *interface,
+			   struct in6_addr *source,
+			   struct alfred_refresh_v0 *refresh, size_t count)
+{
+	enum data_source max_source = SOURCE_LOCAL;
+	struct dataset **datasets;
+	struct alfred_data search;
+	struct dataset *dataset;
+	size_t i, num_datasets = 0;
+
+	if (globals->opmode == OPMODE_MASTER)
+		max_source = SOURCE_FIRST_HAND;
+
+	datasets = malloc((count + 1) * sizeof(*datasets));
+	if (!datasets)
+		return -1;
+
+	memcpy(search.source, refresh->source, ETH_ALEN);
+
+	for (i = 0; i < count; i++) {
+		search.header.type = refresh->entries[i].type;
+
+		dataset = hash_find(globals->data_hash, &search);
+		if (!dataset || dataset->data_source > max_source ||
+		    !dataset->payload)
+			continue;
+
+		datasets[num_datasets++] = dataset;
+	}
+
+	if (num_datasets)
+		push_datasets(globals, interface, source, datasets,
+			      num_datasets, get_random_id());
+
+	free(datasets);
+
+	return 0;
+}
+
+int refresh_receive(struct globals *globals, struct interface *interface,
+		    struct in6_addr *source, struct alfred_refresh_v0 *refresh)
+{
+	size_t len, count;
+
+	len = ntohs(refresh->header.length);
+	if (len < sizeof(*refresh) - sizeof(refresh->header))
+		return -1;
+
+	len -= sizeof(*refresh) - sizeof(refresh->header);
+	count = len / sizeof(refresh->entries[0]);
+
+	switch (refresh->kind) {
+	case ALFRED_REFRESH_DIGESTS:
+		return refresh_digests(globals, interface, source, refresh,
+				       count);
+	case ALFRED_REFRESH_MISSING:
+		return refresh_missing(globals, interface, source, refresh,
+				       count);
+	default:
+		return -1;
+	}
+}
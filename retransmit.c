@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "alfred.h"
+#include "hash.h"
+#include "packet.h"
+
+static int retransmit_compare(void *d1, void *d2)
+{
+	struct retransmit_cache *c1 = d1, *c2 = d2;
+
+	if (c1->id != c2->id)
+		return 0;
+
+	return memcmp(&c1->address, &c2->address, sizeof(c1->address)) == 0;
+}
+
+static int retransmit_choose(void *d1, int size)
+{
+	struct retransmit_cache *c1 = d1;
+	const uint8_t *key = (const uint8_t *)&c1->address;
+	uint32_t hash = c1->id;
+	size_t i;
+
+	for (i = 0; i < sizeof(c1->address); i++) {
+		hash += key[i];
+		hash += (hash << 10);
+		hash ^= (hash >> 6);
+	}
+
+	hash += (hash << 3);
+	hash ^= (hash >> 11);
+	hash += (hash << 15);
+
+	return hash % size;
+}
+
+int retransmit_init(struct globals *globals)
+{
+	globals->retransmit_hash = hash_new(64, retransmit_compare,
+					    retransmit_choose);
+	if (!globals->retransmit_hash)
+		return -1;
+
+	return 0;
+}
+
+static void retransmit_free(struct retransmit_cache *cache)
+{
+	free(cache->buf);
+	free(cache);
+}
+
+/* start caching the packets of a transaction sent to dest */
+struct retransmit_cache *retransmit_add(struct globals *globals,
+					const struct in6_addr *dest,
+					uint16_t id)
+{
+	struct retransmit_cache *cache, *old;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	memcpy(&cache->address, dest, sizeof(cache->address));
+	cache->id = id;
+	cache->num_packet = 0;
+	cache->retries = 0;
+	clock_gettime(CLOCK_MONOTONIC, &cache->created);
+	cache->buf = NULL;
+	cache->buf_len = 0;
+	cache->buf_size = 0;
+
+	/* transaction ids are random, a collision replaces the old cache */
+	old = hash_remove(globals->retransmit_hash, cache);
+	if (old)
+		retransmit_free(old);
+
+	if (hash_add(globals->retransmit_hash, cache)) {
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+/* packets beyond ALFRED_RETRANSMIT_MAX_SIZE are not cached, they are lost
+ * for good when the receiver misses them */
+void retransmit_store(struct retransmit_cache *cache, const void *packet,
+		      size_t len)
+{
+	if (!cache)
+		return;
+
+	if (cache->buf_len + len > ALFRED_RETRANSMIT_MAX_SIZE)
+		return;
+
+	if (buffer_grow(&cache->buf, &cache->buf_size, cache->buf_len + len,
+			MAX_PAYLOAD) < 0)
+		return;
+
+	memcpy(cache->buf + cache->buf_len, packet, len);
+	cache->buf_len += len;
+}
+
+int retransmit_nack(struct globals *globals, struct interface *interface,
+		    const struct in6_addr *source,
+		    struct alfred_nack_v0 *nack)
+{
+	struct retransmit_cache search, *cache;
+	struct alfred_push_data_v0 *push;
+	struct alfred_status_v0 status_end;
+	uint8_t requested[UINT16_MAX / 8 + 1];
+	size_t pos, len, num_missing, i;
+	uint16_t seqno, length;
+
+	len = ntohs(nack->header.length);
+	if (len < sizeof(*nack) - sizeof(nack->header))
+		return -1;
+
+	num_missing = (len - (sizeof(*nack) - sizeof(nack->header))) /
+		      sizeof(nack->missing[0]);
+
+	memcpy(&search.address, source, sizeof(search.address));
+	search.id = nack->tx.id;
+
+	cache = hash_find(globals->retransmit_hash, &search);
+	if (!cache) {
+		/* multicast sync rounds are repaired as unicast. Every
+		 * receiver limits its own nacks */
+		memcpy(&search.address, &in6addr_localmcast,
+		       sizeof(search.address));
+		cache = hash_find(globals->retransmit_hash, &search);
+		if (!cache)
+			return -1;
+	} else if (cache->retries >= ALFRED_NACK_RETRIES) {
+		return -1;
+	}
+
+	if (cache->num_packet != ntohs(nack->tx.seqno))
+		return -1;
+
+	cache->retries++;
+
+	memset(requested, 0, sizeof(requested));
+	for (i = 0; i < num_missing; i++) {
+		seqno = ntohs(nack->missing[i]);
+		requested[seqno / 8] |= 1 << (seqno % 8);
+	}
+
+	for (pos = 0; pos < cache->buf_len; pos += len) {
+		push = (struct alfred_push_data_v0 *)(cache->buf + pos);
+		len = ntohs(push->header.length) + sizeof(push->header);
+		seqno = ntohs(push->tx.seqno);
+
+		if (!(requested[seqno / 8] & (1 << (seqno % 8))))
+			continue;
+
+		send_alfred_packet(interface, source, push, len);
+		globals->nack_retransmitted++;
+	}
+
+	status_end.header.type = ALFRED_STATUS_TXEND;
+	status_end.header.version = ALFRED_VERSION;
+	length = sizeof(status_end) - sizeof(status_end.header);
+	status_end.header.length = htons(length);
+
+	status_end.tx.id = cache->id;
+	status_end.tx.seqno = htons(cache->num_packet);
+
+	send_alfred_packet(interface, source, &status_end, sizeof(status_end));
+
+	return 0;
+}
+
+/* the receiver dropped the transaction, its packets won't be requested */
+void retransmit_cancel(struct globals *globals, const struct in6_addr *source,
+		       struct alfred_status_v0 *status)
+{
+	struct retransmit_cache search, *cache;
+
+	if (ntohs(status->header.length) !=
+	    sizeof(*status) - sizeof(status->header))
+		return;
+
+	memcpy(&search.address, source, sizeof(search.address));
+	search.id = status->tx.id;
+
+	cache = hash_remove(globals->retransmit_hash, &search);
+	if (cache)
+		retransmit_free(cache);
+}
+
+void retransmit_purge(struct globals *globals)
+{
+	struct hash_it_t *hashit = NULL;
+	struct timespec now, diff;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (NULL != (hashit = hash_iterate(globals->retransmit_hash,
+					      hashit))) {
+		struct retransmit_cache *cache = hashit->bucket->data;
+
+		time_diff(&now, &cache->created, &diff);
+		if (diff.tv_sec < ALFRED_RETRANSMIT_TIMEOUT)
+			continue;
+
+		hash_remove_bucket(globals->retransmit_hash, hashit);
+		retransmit_free(cache);
+	}
+}
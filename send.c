@@ -19,15 +19,19 @@
  *
  */
 
+#include <endian.h>
 #include <netinet/in.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include "alfred.h"
+#include "batadv_query.h"
 #include "hash.h"
 #include "packet.h"
 #include "list.h"
@@ -44,129 +48,828 @@ int announce_master(struct globals *globals)
 
 		send_alfred_packet(interface, &in6addr_localmcast,
 				   &announcement, sizeof(announcement));
+		send_capabilities(globals, interface, &in6addr_localmcast);
 	}
 
 	return 0;
 }
 
-int push_data(struct globals *globals, struct interface *interface,
-	      struct in6_addr *destination, enum data_source max_source_level,
-	      int type_filter, uint16_t tx_id)
+int send_capabilities(struct globals *globals, struct interface *interface,
+		      const struct in6_addr *dest)
 {
-	struct hash_it_t *hashit = NULL;
-	uint8_t buf[MAX_PAYLOAD];
-	struct alfred_push_data_v0 *push;
-	struct alfred_data *data;
-	uint16_t total_length = 0;
-	size_t tlv_length;
-	uint16_t seqno = 0;
+	struct alfred_capabilities_v0 capabilities;
 	uint16_t length;
+
+	length = sizeof(capabilities) - sizeof(capabilities.header);
+
+	capabilities.header.type = ALFRED_CAPABILITIES;
+	capabilities.header.version = ALFRED_VERSION;
+	capabilities.header.length = htons(length);
+	capabilities.caps = ALFRED_OWN_CAPS;
+
+	/* parity needs the packets which were already parsed */
+	if (globals->stream_apply)
+		capabilities.caps &= ~ALFRED_CAP_FEC;
+
+	capabilities.caps = htonl(capabilities.caps);
+
+	send_alfred_packet(interface, dest, &capabilities,
+			   sizeof(capabilities));
+
+	return 0;
+}
+
+/* ask a master for the datasets of a type. Masters supporting it only send
+ * them when they differ from ours */
+int send_request(struct globals *globals, struct interface *interface,
+		 struct server *server, uint8_t type, uint16_t tx_id)
+{
+	struct alfred_request_digest_v0 request;
+	size_t len = sizeof(request);
+
+	/* the master may only split large datasets for capable receivers */
+	send_capabilities(globals, interface, &server->address);
+
+	/* older masters get the alfred_request_v0 part of it */
+	if (!(peer_caps(globals, &server->address) &
+	      ALFRED_CAP_REQUEST_DIGEST))
+		len = sizeof(struct alfred_request_v0);
+
+	request.header.type = ALFRED_REQUEST;
+	request.header.version = ALFRED_VERSION;
+	request.header.length = htons(len - sizeof(request.header));
+	request.requested_type = type;
+	request.tx_id = htons(tx_id);
+	request.digest = htobe64(globals->merkle_types[type]);
+
+	send_alfred_packet(interface, &server->address, &request, len);
+
+	return 0;
+}
+
+/**
+ * struct push_ctx - transaction sent by push_data()
+ * @globals: global state of the daemon
+ * @interface: interface to send on
+ * @destination: receiver of the transaction
+ * @caps: enum alfred_capability bits of the receiver
+ * @cache: copies of the sent packets for nacks, NULL if not supported
+ * @fec: parity of the current group, NULL if not used
+ * @tx_id: transaction id as sent in the packets, changes when the datasets
+ *  don't fit in a single transaction
+ * @since: change sequence number the receiver is known to have, 0 if unknown
+ * @seqno: sequence number of the next packet
+ * @max_packet: largest packet to send
+ * @compress: aggregated datasets are sent compressed when they get smaller
+ * @max_data: bytes of datasets aggregated before they are sent
+ * @buf: alfred_push_data_v0 packet being aggregated, MAX_PAYLOAD bytes
+ * @total_length: bytes of datasets aggregated in buf
+ */
+struct push_ctx {
+	struct globals *globals;
+	struct interface *interface;
+	const struct in6_addr *destination;
+	uint32_t caps;
+	struct retransmit_cache *cache;
+	struct fec_group *fec;
+	uint16_t tx_id;
+	uint32_t since;
+	uint16_t seqno;
+	size_t max_packet;
+	bool compress;
+	size_t max_data;
+	uint8_t *buf;
+	uint16_t total_length;
+};
+
+static void push_data_xmit(struct push_ctx *ctx, void *packet, size_t len)
+{
+	send_alfred_packet(ctx->interface, ctx->destination, packet, len);
+	retransmit_store(ctx->cache, packet, len);
+	fec_add(ctx->fec, ctx->interface, ctx->destination, packet, len);
+}
+
+/* set up the packet cache and the parity of a new transaction */
+static void push_ctx_start(struct push_ctx *ctx, uint16_t tx_id)
+{
+	struct globals *globals = ctx->globals;
+
+	ctx->tx_id = tx_id;
+	ctx->seqno = 0;
+	ctx->cache = NULL;
+	ctx->fec = NULL;
+
+	/* keep the packets to answer nacks of the receiver */
+	if (ctx->caps & ALFRED_CAP_NACK)
+		ctx->cache = retransmit_add(globals, ctx->destination, tx_id);
+
+	if (globals->fec_group && ctx->caps & ALFRED_CAP_FEC)
+		ctx->fec = fec_new(globals->fec_group, tx_id);
+}
+
+/* send the txend packet of the transaction, also for an empty transaction
+ * when force is set */
+static void push_ctx_end(struct push_ctx *ctx, bool force)
+{
 	struct alfred_status_v0 status_end;
+	uint16_t length;
 
-	push = (struct alfred_push_data_v0 *)buf;
+	if (ctx->cache)
+		ctx->cache->num_packet = ctx->seqno;
+
+	/* parity of the last, incomplete group */
+	fec_flush(ctx->fec, ctx->interface, ctx->destination);
+	free(ctx->fec);
+	ctx->fec = NULL;
+
+	if (ctx->seqno == 0 && !force)
+		return;
+
+	status_end.header.type = ALFRED_STATUS_TXEND;
+	status_end.header.version = ALFRED_VERSION;
+	length = sizeof(status_end) - sizeof(status_end.header);
+	status_end.header.length = htons(length);
+
+	status_end.tx.id = ctx->tx_id;
+	status_end.tx.seqno = htons(ctx->seqno);
+
+	send_alfred_packet(ctx->interface, ctx->destination, &status_end,
+			   sizeof(status_end));
+}
+
+/* end the transaction and send the remaining packets in a new one */
+static void push_ctx_split(struct push_ctx *ctx)
+{
+	push_ctx_end(ctx, false);
+	push_ctx_start(ctx, get_random_id());
+	ctx->globals->tx_split++;
+}
+
+/* sequence number of the next packet. The txend packet counts the packets
+ * in 16 bits, a transaction is split before they run out */
+static uint16_t push_ctx_seqno(struct push_ctx *ctx)
+{
+	if (ctx->seqno == ALFRED_MAX_TX_PACKETS)
+		push_ctx_split(ctx);
+
+	return ctx->seqno++;
+}
+
+/* send the datasets in block as alfred_push_data_v0 packet. The header is
+ * placed in front of the block, over aggregated data which was already
+ * sent */
+static void push_data_send_block(struct push_ctx *ctx, uint8_t *block,
+				 size_t len)
+{
+	struct alfred_push_data_v0 *push;
+	size_t tlv_length;
+
+	push = (struct alfred_push_data_v0 *)(block - sizeof(*push));
 	push->header.type = ALFRED_PUSH_DATA;
 	push->header.version = ALFRED_VERSION;
-	push->tx.id = tx_id;
 
-	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
-		struct dataset *dataset = hashit->bucket->data;
+	tlv_length = len + sizeof(*push) - sizeof(push->header);
+	push->header.length = htons(tlv_length);
+	push->tx.seqno = htons(push_ctx_seqno(ctx));
+	push->tx.id = ctx->tx_id;
+	push_data_xmit(ctx, push, sizeof(*push) + len);
+}
 
-		if (dataset->data_source > max_source_level)
-			continue;
+/* send the aggregated datasets in a single compressed packet. Returns -1 if
+ * they don't get smaller or don't fit */
+static int push_data_send_compressed(struct globals *globals,
+				     struct push_ctx *ctx)
+{
+	struct alfred_push_compressed_v0 *push;
+	uint8_t buf[MAX_PAYLOAD];
+	size_t zlen, zmax;
 
-		if (type_filter >= 0 &&
-		    dataset->data.header.type != type_filter)
-			continue;
+	push = (struct alfred_push_compressed_v0 *)buf;
 
-		/* would the packet be too big? send so far aggregated data
-		 * first */
-		if (total_length + dataset->data.header.length + sizeof(*data) >
-		    MAX_PAYLOAD - sizeof(*push)) {
-			/* is there any data to send? */
-			if (total_length == 0)
-				continue;
+	zmax = ctx->max_packet - sizeof(*push);
+	if (zmax > ctx->total_length - 1U)
+		zmax = ctx->total_length - 1U;
+
+	zlen = lz_compress(ctx->buf + sizeof(struct alfred_push_data_v0),
+			   ctx->total_length, push->data, zmax);
+	if (!zlen)
+		return -1;
+
+	push->header.type = ALFRED_PUSH_COMPRESSED;
+	push->header.version = ALFRED_VERSION;
+	push->header.length = htons(sizeof(*push) - sizeof(push->header) +
+				    zlen);
+	push->tx.seqno = htons(push_ctx_seqno(ctx));
+	push->tx.id = ctx->tx_id;
+	push->length = htons(ctx->total_length);
+	push_data_xmit(ctx, push, sizeof(*push) + zlen);
+
+	globals->sync_compressed++;
+	globals->sync_compress_saved += ctx->total_length - zlen;
+
+	return 0;
+}
+
+/* send the aggregated datasets */
+static void push_data_send(struct globals *globals, struct push_ctx *ctx)
+{
+	struct alfred_push_data_v0 *push;
+	size_t pos, len, data_len, max_len;
+	struct alfred_data *data;
+	uint8_t *block;
+
+	if (!ctx->total_length)
+		return;
+
+	if (ctx->compress && push_data_send_compressed(globals, ctx) == 0) {
+		ctx->total_length = 0;
+		return;
+	}
 
-			tlv_length = total_length;
-			tlv_length += sizeof(*push) - sizeof(push->header);
-			push->header.length = htons(tlv_length);
-			push->tx.seqno = htons(seqno++);
-			send_alfred_packet(interface, destination, push,
-					   sizeof(*push) + total_length);
-			total_length = 0;
+	block = ctx->buf + sizeof(*push);
+	max_len = ctx->max_packet - sizeof(*push);
+
+	/* more was aggregated than fits uncompressed, aggregate less for
+	 * the rest of the transaction */
+	if (ctx->total_length > max_len) {
+		ctx->max_data /= 2;
+		if (ctx->max_data < max_len)
+			ctx->max_data = max_len;
+	}
+
+	/* split the datasets into packets of at most max_len bytes */
+	pos = 0;
+	len = 0;
+	while (pos + len < ctx->total_length) {
+		data = (struct alfred_data *)(block + pos + len);
+		data_len = sizeof(*data) + ntohs(data->header.length);
+
+		if (len && len + data_len > max_len) {
+			push_data_send_block(ctx, block + pos, len);
+			pos += len;
+			len = 0;
 		}
 
-		/* still too large? - should never happen */
-		if (total_length + dataset->data.header.length + sizeof(*data) >
-		    MAX_PAYLOAD - sizeof(*push))
-			continue;
+		len += data_len;
+	}
+
+	push_data_send_block(ctx, block + pos, len);
+
+	ctx->total_length = 0;
+}
+
+/* send a dataset too large for a single push packet in chunks */
+static void push_data_chunks(struct globals *globals, struct push_ctx *ctx,
+			     struct dataset *dataset)
+{
+	struct alfred_push_chunk_v0 *chunk;
+	size_t chunk_max = ctx->max_packet - sizeof(*chunk);
+	uint32_t offset, total_length;
+	size_t len, num_chunks;
+	const uint8_t *plain;
+	uint8_t *alloc;
+
+	plain = dataset_get_data(globals, dataset, false, &alloc);
+	if (!plain)
+		return;
+
+	total_length = dataset->payload->length;
+
+	/* datasets are only applied when all their chunks were received in
+	 * the same transaction */
+	num_chunks = (total_length + chunk_max - 1) / chunk_max;
+	if (ctx->seqno && ctx->seqno + num_chunks > ALFRED_MAX_TX_PACKETS)
+		push_ctx_split(ctx);
+
+	chunk = (struct alfred_push_chunk_v0 *)ctx->buf;
+	chunk->header.type = ALFRED_PUSH_CHUNK;
+	chunk->header.version = ALFRED_VERSION;
+	memcpy(chunk->source, dataset->data.source, sizeof(chunk->source));
+	chunk->type = dataset->data.header.type;
+	chunk->version = dataset->data.header.version;
+	chunk->total_length = htonl(total_length);
 
-		data = (struct alfred_data *)
-		       (buf + sizeof(*push) + total_length);
-		memcpy(data, &dataset->data, sizeof(*data));
-		data->header.length = htons(data->header.length);
-		memcpy(data->data, dataset->buf, dataset->data.header.length);
+	for (offset = 0; offset < total_length; offset += len) {
+		len = total_length - offset;
+		if (len > chunk_max)
+			len = chunk_max;
 
-		total_length += dataset->data.header.length + sizeof(*data);
+		chunk->header.length = htons(sizeof(*chunk) -
+					     sizeof(chunk->header) + len);
+		chunk->tx.seqno = htons(push_ctx_seqno(ctx));
+		chunk->tx.id = ctx->tx_id;
+		chunk->offset = htonl(offset);
+		memcpy(chunk->data, plain + offset, len);
+
+		push_data_xmit(ctx, chunk, sizeof(*chunk) + len);
 	}
-	/* send the final packet */
-	if (total_length) {
-		tlv_length = total_length;
-		tlv_length += sizeof(*push) - sizeof(push->header);
-		push->header.length = htons(tlv_length);
-		push->tx.seqno = htons(seqno++);
-		send_alfred_packet(interface, destination, push,
-				   sizeof(*push) + total_length);
+
+	free(alloc);
+}
+
+static void push_ctx_init(struct globals *globals, struct push_ctx *ctx,
+			  struct interface *interface,
+			  const struct in6_addr *destination, uint32_t caps,
+			  uint16_t tx_id, uint8_t *buf)
+{
+	struct alfred_push_data_v0 *push;
+
+	ctx->globals = globals;
+	ctx->interface = interface;
+	ctx->destination = destination;
+	ctx->caps = caps;
+	ctx->since = 0;
+	ctx->max_packet = MAX_PAYLOAD;
+	ctx->compress = false;
+	ctx->buf = buf;
+	ctx->total_length = 0;
+
+	/* receivers of chunks get packets which don't have to be fragmented by
+	 * IPv6, one lost fragment would lose the whole packet */
+	if (ctx->caps & ALFRED_CAP_CHUNK)
+		ctx->max_packet = netsock_max_packet(interface);
+
+	push_ctx_start(ctx, tx_id);
+
+	/* parity packets are larger than the packets they protect */
+	if (ctx->fec)
+		ctx->max_packet -= ALFRED_FEC_OVERHEAD;
+
+	ctx->max_data = ctx->max_packet - sizeof(*push);
+
+	/* aggregate as many datasets as should fit in a compressed packet */
+	if (globals->compress_sync && ctx->caps & ALFRED_CAP_COMPRESS) {
+		ctx->compress = true;
+		ctx->max_data *= ALFRED_COMPRESS_SYNC_RATIO;
+		if (ctx->max_data > MAX_PAYLOAD - sizeof(*push))
+			ctx->max_data = MAX_PAYLOAD - sizeof(*push);
 	}
+}
 
-	/* send transaction txend packet */
-	if (seqno > 0 || type_filter != NO_FILTER) {
-		status_end.header.type = ALFRED_STATUS_TXEND;
-		status_end.header.version = ALFRED_VERSION;
-		length = sizeof(status_end) - sizeof(status_end.header);
-		status_end.header.length = htons(length);
+/* send the dataset as delta against its previous content when the receiver
+ * got that one with the sync up to ctx->since. Returns -1 if the dataset has
+ * to be sent completely */
+static int push_dataset_delta(struct globals *globals, struct push_ctx *ctx,
+			      struct dataset *dataset)
+{
+	struct alfred_push_delta_v0 *delta;
+	const uint8_t *plain, *base;
+	uint8_t *alloc, *base_alloc;
+	uint8_t buf[MAX_PAYLOAD];
+	size_t delta_max, delta_len = 0;
 
-		status_end.tx.id = tx_id;
-		status_end.tx.seqno = htons(seqno);
+	if (!(ctx->caps & ALFRED_CAP_DELTA) || !ctx->since || !dataset->base ||
+	    dataset->base_seq > ctx->since ||
+	    dataset->payload->length < ALFRED_DELTA_MIN_SIZE)
+		return -1;
+
+	/* only worth it when it is smaller than the dataset */
+	delta_max = ctx->max_packet - sizeof(*delta);
+	if (delta_max > dataset->payload->length - 1)
+		delta_max = dataset->payload->length - 1;
+
+	plain = dataset_get_data(globals, dataset, false, &alloc);
+	base = payload_get_data(dataset->base, &base_alloc);
+	if (plain && base)
+		delta_len = delta_encode(base, dataset->base->length, plain,
+					 dataset->payload->length,
+					 buf + sizeof(*delta), delta_max);
+	free(base_alloc);
+	free(alloc);
+
+	if (!delta_len)
+		return -1;
+
+	push_data_send(globals, ctx);
+
+	delta = (struct alfred_push_delta_v0 *)buf;
+	delta->header.type = ALFRED_PUSH_DELTA;
+	delta->header.version = ALFRED_VERSION;
+	delta->header.length = htons(sizeof(*delta) - sizeof(delta->header) +
+				     delta_len);
+	delta->tx.seqno = htons(push_ctx_seqno(ctx));
+	delta->tx.id = ctx->tx_id;
+	memcpy(delta->source, dataset->data.source, sizeof(delta->source));
+	delta->type = dataset->data.header.type;
+	delta->version = dataset->data.header.version;
+	delta->base_digest = htobe64(dataset->base->digest);
+	delta->total_length = htonl(dataset->payload->length);
+
+	push_data_xmit(ctx, delta, sizeof(*delta) + delta_len);
+
+	globals->delta_pushed++;
+	globals->delta_saved += dataset->payload->length - delta_len;
+
+	return 0;
+}
+
+static void push_dataset(struct globals *globals, struct push_ctx *ctx,
+			 struct dataset *dataset)
+{
+	struct alfred_push_data_v0 *push;
+	struct alfred_data *data;
+	size_t data_len;
 
-		send_alfred_packet(interface, destination, &status_end,
-				   sizeof(status_end));
+	if (push_dataset_delta(globals, ctx, dataset) == 0)
+		return;
+
+	data_len = dataset->payload->length + sizeof(*data);
+
+	/* too large for a single packet, the receiver has to support
+	 * chunks */
+	if (data_len > ctx->max_packet - sizeof(*push)) {
+		if (!(ctx->caps & ALFRED_CAP_CHUNK))
+			return;
+
+		push_data_send(globals, ctx);
+		push_data_chunks(globals, ctx, dataset);
+		return;
 	}
 
+	/* would the packet be too big? send so far aggregated data first */
+	if (ctx->total_length + data_len > ctx->max_data)
+		push_data_send(globals, ctx);
+
+	data = (struct alfred_data *)(ctx->buf + sizeof(*push) +
+				      ctx->total_length);
+	if (dataset_copy_data(globals, dataset, data->data, false))
+		return;
+
+	memcpy(data, &dataset->data, sizeof(*data));
+	data->header.length = htons(dataset->payload->length);
+
+	ctx->total_length += data_len;
+}
+
+/* send the last packets and the txend packet, which is also sent for an
+ * empty transaction when force is set */
+static void push_ctx_finish(struct globals *globals, struct push_ctx *ctx,
+			    bool force)
+{
+	push_data_send(globals, ctx);
+	push_ctx_end(ctx, force);
+}
+
+/* add the datasets changed after the change sequence number since */
+static void push_data_ctx(struct globals *globals, struct push_ctx *ctx,
+			  enum data_source max_source_level, int type_filter,
+			  uint32_t since)
+{
+	struct hash_it_t *hashit = NULL;
+	struct type_policy *policy;
+	int priority;
+
+	ctx->since = since;
+
+	/* one pass per used priority, highest first */
+	for (priority = policy_next_priority(globals, 256); priority >= 0;
+	     priority = policy_next_priority(globals, priority)) {
+		while (NULL != (hashit = hash_iterate(globals->data_hash,
+						      hashit))) {
+			struct dataset *dataset = hashit->bucket->data;
+
+			if (dataset->data_source > max_source_level)
+				continue;
+
+			if (type_filter >= 0 &&
+			    dataset->data.header.type != type_filter)
+				continue;
+
+			if (dataset->change_seq <= since)
+				continue;
+
+			policy = &globals->policy[dataset->data.header.type];
+			if (policy->priority != priority)
+				continue;
+
+			/* only the synchronization between masters pushes
+			 * first hand data */
+			if (max_source_level == SOURCE_FIRST_HAND &&
+			    !policy->sync)
+				continue;
+
+			push_dataset(globals, ctx, dataset);
+		}
+	}
+}
+
+/* send the datasets changed after the change sequence number since */
+int push_data(struct globals *globals, struct interface *interface,
+	      struct in6_addr *destination, enum data_source max_source_level,
+	      int type_filter, uint16_t tx_id, uint32_t since)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct push_ctx ctx;
+
+	push_ctx_init(globals, &ctx, interface, destination,
+		      peer_caps(globals, destination), tx_id, buf);
+	push_data_ctx(globals, &ctx, max_source_level, type_filter, since);
+	push_ctx_finish(globals, &ctx, type_filter != NO_FILTER);
+
 	return 0;
 }
 
+/* send the given datasets in a new transaction. Returns the id of the last
+ * transaction, which differs from tx_id when the transaction was split */
+uint16_t push_datasets(struct globals *globals, struct interface *interface,
+		       struct in6_addr *destination, struct dataset **datasets,
+		       size_t count, uint16_t tx_id)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct push_ctx ctx;
+	size_t i;
+
+	push_ctx_init(globals, &ctx, interface, destination,
+		      peer_caps(globals, destination), tx_id, buf);
+
+	for (i = 0; i < count; i++)
+		push_dataset(globals, &ctx, datasets[i]);
+
+	push_ctx_finish(globals, &ctx, false);
+
+	return ctx.tx_id;
+}
+
+/* synced datasets time out on the receiver when they are not sent again,
+ * all of them are sent at least twice within the shortest timeout */
+static time_t sync_full_interval(struct globals *globals, time_t interval)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(globals->policy); i++) {
+		if (globals->policy[i].timeout / 2 < interval)
+			interval = globals->policy[i].timeout / 2;
+	}
+
+	return interval;
+}
+
+/* change sequence number after which datasets are synced to the master of
+ * peer: the last acknowledged sync, 0 for all datasets if it doesn't
+ * acknowledge syncs or a full sync is due */
+uint32_t sync_since(struct globals *globals, struct peer *peer,
+		    struct timespec *now)
+{
+	time_t full_interval = ALFRED_FULL_SYNC_INTERVAL;
+	struct timespec diff;
+	uint32_t since = 0;
+
+	/* changes missed by the delta syncs are found by comparing the
+	 * digests, full syncs are only needed to refresh the datasets */
+	if (peer->caps & ALFRED_CAP_MERKLE)
+		full_interval = ALFRED_DATA_TIMEOUT;
+
+	full_interval = sync_full_interval(globals, full_interval);
+
+	time_diff(now, &peer->full_sync, &diff);
+	if (peer->caps & ALFRED_CAP_ACK && peer->acked_seq &&
+	    diff.tv_sec < full_interval)
+		since = peer->acked_seq;
+
+	if (since) {
+		globals->delta_syncs++;
+	} else {
+		globals->full_syncs++;
+		peer->full_sync = *now;
+	}
+
+	return since;
+}
+
+/* send the datasets changed since the last acknowledged sync to a master,
+ * all datasets if it doesn't acknowledge syncs or a full sync is due */
+static void sync_server(struct globals *globals, struct interface *interface,
+			struct server *server, struct timespec *now)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct push_ctx ctx;
+	struct peer *peer;
+	uint32_t since;
+	uint16_t tx_id;
+
+	tx_id = get_random_id();
+
+	peer = peer_get(globals, &server->hwaddr);
+	if (!peer) {
+		push_data(globals, interface, &server->address,
+			  SOURCE_FIRST_HAND, NO_FILTER, tx_id, 0);
+		return;
+	}
+
+	since = sync_since(globals, peer, now);
+	peer->sync_seq = globals->change_seq;
+
+	push_ctx_init(globals, &ctx, interface, &server->address, peer->caps,
+		      tx_id, buf);
+	push_data_ctx(globals, &ctx, SOURCE_FIRST_HAND, NO_FILTER, since);
+	push_ctx_finish(globals, &ctx, false);
+
+	/* a sync split into several transactions is acknowledged with the
+	 * last one */
+	peer->sync_id = ctx.tx_id;
+
+	if (peer->caps & ALFRED_CAP_MERKLE)
+		merkle_send_root(globals, interface, &server->address);
+}
+
+/* start the next multicast sync round, returns the change sequence number
+ * after which datasets are sent in it */
+static uint32_t sync_multicast_start(struct globals *globals,
+				     struct timespec *now)
+{
+	struct timespec diff;
+	time_t full_interval;
+	uint32_t since = 0;
+
+	full_interval = sync_full_interval(globals, ALFRED_FULL_SYNC_INTERVAL);
+	time_diff(now, &globals->mcast_full_sync, &diff);
+
+	if (globals->mcast_round && diff.tv_sec < full_interval) {
+		since = globals->mcast_sync_seq;
+		globals->delta_syncs++;
+	} else {
+		globals->full_syncs++;
+		globals->mcast_full_sync = *now;
+	}
+
+	globals->mcast_round++;
+	globals->mcast_sync_seq = globals->change_seq;
+
+	return since;
+}
+
+/* send the first hand datasets changed after since to all masters on the
+ * link in a single transaction. caps are the capabilities shared by these
+ * masters */
+static void sync_multicast(struct globals *globals,
+			   struct interface *interface, uint32_t caps,
+			   uint32_t since)
+{
+	struct alfred_sync_round_v0 round;
+	uint8_t buf[MAX_PAYLOAD];
+	struct push_ctx ctx;
+	uint16_t length;
+
+	push_ctx_init(globals, &ctx, interface, &in6addr_localmcast, caps,
+		      get_random_id(), buf);
+	push_data_ctx(globals, &ctx, SOURCE_FIRST_HAND, NO_FILTER, since);
+	push_data_send(globals, &ctx);
+
+	round.header.type = ALFRED_SYNC_ROUND;
+	round.header.version = ALFRED_VERSION;
+	length = sizeof(round) - sizeof(round.header);
+	round.header.length = htons(length);
+	round.tx.id = ctx.tx_id;
+	round.tx.seqno = htons(ctx.seqno);
+	round.round = htonl(globals->mcast_round);
+
+	send_alfred_packet(interface, &in6addr_localmcast, &round,
+			   sizeof(round));
+
+	/* the txend packet completes the round even without datasets */
+	push_ctx_finish(globals, &ctx, true);
+}
+
 int sync_data(struct globals *globals)
 {
 	struct hash_it_t *hashit = NULL;
+	struct gossip_target *targets = NULL;
 	struct interface *interface;
+	size_t num_targets = 0, max_targets = 0;
+	uint32_t mcast_since = 0, mcast_caps;
+	bool mcast, mcast_started = false;
+	struct timespec now;
+	struct peer *peer;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (globals->gossip_fanout) {
+		list_for_each_entry(interface, &globals->interfaces, list)
+			max_targets += interface->server_hash->elements;
+
+		targets = malloc((max_targets + 1) * sizeof(*targets));
+	}
 
 	/* send local data and data from our clients to (all) other servers */
 	list_for_each_entry(interface, &globals->interfaces, list) {
+		mcast = false;
+		mcast_caps = ALFRED_OWN_CAPS;
+
 		while (NULL != (hashit = hash_iterate(interface->server_hash,
 						      hashit))) {
 			struct server *server = hashit->bucket->data;
 
-			push_data(globals, interface, &server->address,
-				  SOURCE_FIRST_HAND, NO_FILTER,
-				  get_random_id());
+			peer = NULL;
+			if (globals->mcast_sync || targets)
+				peer = peer_get(globals, &server->hwaddr);
+
+			/* received by the multicast round */
+			if (globals->mcast_sync && peer &&
+			    peer->caps & ALFRED_CAP_MCAST_SYNC) {
+				mcast = true;
+				mcast_caps &= peer->caps;
+				continue;
+			}
+
+			/* masters without gossip support are synced every
+			 * round */
+			if (!targets || !peer ||
+			    !(peer->caps & ALFRED_CAP_GOSSIP)) {
+				sync_server(globals, interface, server, &now);
+				continue;
+			}
+
+			targets[num_targets].interface = interface;
+			targets[num_targets].server = server;
+			targets[num_targets].peer = peer;
+			num_targets++;
 		}
+
+		if (!mcast)
+			continue;
+
+		/* one round for all interfaces */
+		if (!mcast_started) {
+			mcast_since = sync_multicast_start(globals, &now);
+			mcast_started = true;
+		}
+
+		sync_multicast(globals, interface, mcast_caps, mcast_since);
 	}
+
+	if (targets)
+		gossip_round(globals, targets, num_targets, &now);
+
+	free(targets);
 	return 0;
 }
 
+/* a master missed a multicast sync round, send all first hand datasets to
+ * it as unicast */
+int sync_repair(struct globals *globals, struct interface *interface,
+		struct in6_addr *source, struct alfred_status_v0 *status)
+{
+	struct timespec now, diff;
+	struct ether_addr mac;
+	struct peer *peer;
+
+	if (globals->opmode != OPMODE_MASTER || !globals->mcast_sync)
+		return -1;
+
+	if (ntohs(status->header.length) !=
+	    sizeof(*status) - sizeof(status->header))
+		return -1;
+
+	if (ipv6_to_mac(source, &mac) < 0)
+		return -1;
+
+	peer = peer_get(globals, &mac);
+	if (!peer)
+		return -1;
+
+	/* answer at most once per interval */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time_diff(&now, &peer->repair_time, &diff);
+	if (diff.tv_sec < ALFRED_INTERVAL)
+		return 0;
+
+	peer->repair_time = now;
+	globals->mcast_repairs++;
+
+	return push_data(globals, interface, source, SOURCE_FIRST_HAND,
+			 NO_FILTER, get_random_id(), 0);
+}
+
 int push_local_data(struct globals *globals)
 {
 	struct interface *interface;
+	struct server *server = globals->best_server;
+	uint32_t since = 0;
 
 	/* no server - yet */
-	if (!globals->best_server)
+	if (!server)
 		return -1;
 
+	/* the master which got the last push only needs the changed
+	 * datasets, the others are kept alive by their digests */
+	if (peer_caps(globals, &server->address) & ALFRED_CAP_REFRESH &&
+	    memcmp(&globals->local_push_server, &server->hwaddr,
+		   sizeof(server->hwaddr)) == 0)
+		since = globals->local_push_seq;
+
 	list_for_each_entry(interface, &globals->interfaces, list) {
-		push_data(globals, interface, &globals->best_server->address,
-			  SOURCE_LOCAL, NO_FILTER, get_random_id());
+		send_capabilities(globals, interface, &server->address);
+		push_data(globals, interface, &server->address, SOURCE_LOCAL,
+			  NO_FILTER, get_random_id(), since);
+
+		if (since)
+			refresh_send(globals, interface, &server->address,
+				     since);
 	}
 
+	globals->local_push_server = server->hwaddr;
+	globals->local_push_seq = globals->change_seq;
+
 	return 0;
 }
 
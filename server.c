@@ -41,13 +41,22 @@
 #include "hash.h"
 #include "list.h"
 
-static int data_compare(void *d1, void *d2)
+static volatile sig_atomic_t alfred_stop;
+
+static void alfred_stop_handler(int sig)
+{
+	(void)sig;
+
+	alfred_stop = 1;
+}
+
+int data_compare(void *d1, void *d2)
 {
 	/* compare source and type */
 	return ((memcmp(d1, d2, ETH_ALEN + 1) == 0) ? 1 : 0);
 }
 
-static int data_choose(void *d1, int size)
+int data_choose(void *d1, int size)
 {
 	unsigned char *key = d1;
 	uint32_t hash = 0;
@@ -110,6 +119,15 @@ static int create_hashes(struct globals *globals)
 	if (!globals->data_hash || !globals->transaction_hash)
 		return -1;
 
+	if (datastore_init(globals))
+		return -1;
+
+	if (peer_init(globals))
+		return -1;
+
+	if (retransmit_init(globals))
+		return -1;
+
 	return 0;
 }
 
@@ -163,21 +181,23 @@ static int purge_data(struct globals *globals)
 	struct hash_it_t *hashit = NULL;
 	struct timespec now, diff;
 	struct interface *interface;
+	struct type_policy *policy;
 
 	clock_gettime(CLOCK_MONOTONIC, &now);
 
 	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
 		struct dataset *dataset = hashit->bucket->data;
 
+		policy = &globals->policy[dataset->data.header.type];
+
 		time_diff(&now, &dataset->last_seen, &diff);
-		if (diff.tv_sec < ALFRED_DATA_TIMEOUT)
+		if (diff.tv_sec < (time_t)policy->timeout)
 			continue;
 
 		changed_data_type(globals, dataset->data.header.type);
 
 		hash_remove_bucket(globals->data_hash, hashit);
-		free(dataset->buf);
-		free(dataset);
+		dataset_free(globals, dataset);
 	}
 
 	list_for_each_entry(interface, &globals->interfaces, list) {
@@ -200,6 +220,9 @@ static int purge_data(struct globals *globals)
 	if (!globals->best_server)
 		set_best_server(globals);
 
+	peer_purge(globals);
+	retransmit_purge(globals);
+
 	while ((hashit = hash_iterate(globals->transaction_hash, hashit))) {
 		struct transaction_head *head = hashit->bucket->data;
 
@@ -209,6 +232,7 @@ static int purge_data(struct globals *globals)
 
 		hash_remove_bucket(globals->transaction_hash, hashit);
 		transaction_clean(globals, head);
+		hedge_finish(globals, head);
 		if (head->client_socket < 0)
 			free(head);
 		else
@@ -285,6 +309,22 @@ static void check_if_sockets(struct globals *globals)
 		check_if_socket(interface);
 }
 
+static void check_snapshot(struct globals *globals)
+{
+	struct timespec now, diff;
+
+	if (!globals->snapshot_path)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time_diff(&now, &globals->snapshot_time, &diff);
+
+	if (diff.tv_sec < ALFRED_SNAPSHOT_INTERVAL)
+		return;
+
+	snapshot_write(globals);
+}
+
 static void execute_update_command(struct globals *globals)
 {
 	pid_t script_pid;
@@ -344,8 +384,17 @@ int alfred_server(struct globals *globals)
 	if (create_hashes(globals))
 		return -1;
 
-	if (unix_sock_open_daemon(globals))
-		return -1;
+	if (globals->takeover && handoff_receive(globals) < 0) {
+		fprintf(stderr, "Can't take over from running daemon, starting from scratch\n");
+		globals->takeover = 0;
+	}
+
+	if (!globals->takeover) {
+		snapshot_load(globals);
+
+		if (unix_sock_open_daemon(globals))
+			return -1;
+	}
 
 	if (list_empty(&globals->interfaces)) {
 		fprintf(stderr, "Can't start server: interface missing\n");
@@ -369,8 +418,14 @@ int alfred_server(struct globals *globals)
 
 	clock_gettime(CLOCK_MONOTONIC, &last_check);
 	globals->if_check = last_check;
+	globals->snapshot_time = last_check;
+
+	if (signal(SIGTERM, alfred_stop_handler) == SIG_ERR)
+		perror("could not register SIGTERM handler");
+	if (signal(SIGINT, alfred_stop_handler) == SIG_ERR)
+		perror("could not register SIGINT handler");
 
-	while (1) {
+	while (!alfred_stop && !globals->handed_off) {
 		clock_gettime(CLOCK_MONOTONIC, &now);
 		now.tv_sec -= ALFRED_INTERVAL;
 		if (!time_diff(&last_check, &now, &tv)) {
@@ -378,6 +433,9 @@ int alfred_server(struct globals *globals)
 			tv.tv_nsec = 0;
 		}
 
+		hedge_requests(globals, &tv);
+		unix_sock_req_deadlines(globals, &tv);
+
 		netsock_reopen(globals);
 
 		FD_ZERO(&fds);
@@ -391,6 +449,9 @@ int alfred_server(struct globals *globals)
 		ret = pselect(maxsock + 1, &fds, NULL, &errfds, &tv, NULL);
 
 		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
 			perror("main loop select failed ...");
 		} else if (ret) {
 			netsock_check_error(globals, &errfds);
@@ -417,10 +478,16 @@ int alfred_server(struct globals *globals)
 			push_local_data(globals);
 		}
 		purge_data(globals);
+		datastore_compress_cold(globals);
 		check_if_sockets(globals);
+		check_snapshot(globals);
 		execute_update_command(globals);
 	}
 
+	/* the new daemon continues with the current state */
+	if (!globals->handed_off)
+		snapshot_write(globals);
+
 	netsock_close_all(globals);
 	unix_sock_close(globals);
 	return 0;
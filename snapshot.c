@@ -0,0 +1,435 @@
+/*
+ * Copyright (C) 2012-2015  B.A.T.M.A.N. contributors:
+ *
+ * Simon Wunderlich
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ *
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "alfred.h"
+#include "hash.h"
+#include "list.h"
+#include "packet.h"
+
+#define SNAPSHOT_MAGIC		"ALFS"
+#define SNAPSHOT_VERSION	3
+
+/**
+ * struct snapshot_header - header of the snapshot file
+ * @magic: SNAPSHOT_MAGIC
+ * @version: SNAPSHOT_VERSION
+ * @reserved: always zero
+ * @count: number of records following the header
+ * @written: CLOCK_REALTIME seconds when the file was written
+ *
+ * All fields are stored in network byte order
+ */
+struct snapshot_header {
+	char magic[4];
+	uint8_t version;
+	uint8_t reserved[3];
+	uint32_t count;
+	uint64_t written;
+} __packed;
+
+/**
+ * struct snapshot_record - dataset stored in the snapshot file
+ * @data: data block header as sent over the network, the length is unused
+ * @data_source: enum data_source of the dataset
+ * @reserved: always zero
+ * @length: length of the payload
+ * @zlength: length of the compressed payload, 0 if not compressed
+ * @age: seconds since the dataset was last seen when the file was written
+ * @change_seq: globals->change_seq of the last change of the dataset
+ * @digest: digest over the plain payload
+ *
+ * Followed by the payload as stored in memory (zlength bytes if compressed,
+ * length otherwise)
+ */
+struct snapshot_record {
+	struct alfred_data data;
+	uint8_t data_source;
+	uint8_t reserved[3];
+	uint32_t length;
+	uint32_t zlength;
+	uint32_t age;
+	uint32_t change_seq;
+	uint64_t digest;
+} __packed;
+
+void snapshot_put(struct globals *globals)
+{
+	struct snapshot *snapshot = globals->snapshot;
+
+	snapshot->refs--;
+	if (snapshot->refs > 0)
+		return;
+
+	munmap(snapshot->map, snapshot->map_len);
+	free(snapshot->datasets);
+	free(snapshot->payloads);
+	free(snapshot);
+	globals->snapshot = NULL;
+}
+
+static int snapshot_write_record(FILE *fp, struct dataset *dataset,
+				 struct timespec *now)
+{
+	struct payload *payload = dataset->payload;
+	struct snapshot_record record;
+	struct timespec diff;
+	size_t body_len;
+
+	time_diff(now, &dataset->last_seen, &diff);
+	if (diff.tv_sec < 0)
+		diff.tv_sec = 0;
+
+	memset(&record, 0, sizeof(record));
+	memcpy(&record.data, &dataset->data, sizeof(record.data));
+	record.data.header.length = 0;
+	record.data_source = dataset->data_source;
+	record.length = htonl(payload->length);
+	record.zlength = htonl(payload->zlength);
+	record.age = htonl(diff.tv_sec);
+	record.change_seq = htonl(dataset->change_seq);
+	record.digest = htobe64(payload->digest);
+
+	body_len = payload->zlength ? payload->zlength : payload->length;
+
+	if (fwrite(&record, sizeof(record), 1, fp) != 1)
+		return -1;
+
+	if (body_len && fwrite(payload->buf, body_len, 1, fp) != 1)
+		return -1;
+
+	return 0;
+}
+
+int snapshot_write_fp(struct globals *globals, FILE *fp)
+{
+	struct snapshot_header header;
+	struct hash_it_t *hashit = NULL;
+	struct dataset *dataset;
+	struct timespec now, realtime;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	clock_gettime(CLOCK_REALTIME, &realtime);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.count = htonl(globals->data_hash->elements);
+	header.written = htobe64(realtime.tv_sec);
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1)
+		return -1;
+
+	/* synced data is written in eviction order, so the order of the lru
+	 * list survives a reload */
+	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
+		dataset = hashit->bucket->data;
+
+		if (dataset->data_source == SOURCE_SYNCED)
+			continue;
+
+		if (snapshot_write_record(fp, dataset, &now) < 0) {
+			hash_iterate_free(hashit);
+			return -1;
+		}
+	}
+
+	list_for_each_entry(dataset, &globals->data_lru, lru) {
+		if (snapshot_write_record(fp, dataset, &now) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int snapshot_write(struct globals *globals)
+{
+	char *tmp_path;
+	size_t path_len;
+	FILE *fp;
+	int ret = -1;
+
+	if (!globals->snapshot_path)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &globals->snapshot_time);
+
+	path_len = strlen(globals->snapshot_path) + sizeof(".tmp");
+	tmp_path = malloc(path_len);
+	if (!tmp_path)
+		return -1;
+
+	snprintf(tmp_path, path_len, "%s.tmp", globals->snapshot_path);
+
+	fp = fopen(tmp_path, "w");
+	if (!fp) {
+		perror("can't open snapshot file");
+		goto out;
+	}
+
+	if (snapshot_write_fp(globals, fp) < 0) {
+		fclose(fp);
+		goto err;
+	}
+
+	if (fclose(fp) != 0)
+		goto err;
+
+	if (rename(tmp_path, globals->snapshot_path) < 0) {
+		perror("can't rename snapshot file");
+		goto err;
+	}
+
+	ret = 0;
+	goto out;
+
+err:
+	fprintf(stderr, "failed to write snapshot %s\n", globals->snapshot_path);
+	unlink(tmp_path);
+out:
+	free(tmp_path);
+	return ret;
+}
+
+static int snapshot_map(int fd, struct snapshot *snapshot)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 ||
+	    st.st_size < (off_t)sizeof(struct snapshot_header))
+		return -1;
+
+	snapshot->map_len = st.st_size;
+	snapshot->map = mmap(NULL, snapshot->map_len, PROT_READ, MAP_PRIVATE,
+			     fd, 0);
+
+	if (snapshot->map == MAP_FAILED) {
+		perror("can't map snapshot file");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* returns -1 if the payload of the record is corrupted */
+static int snapshot_add_record(struct globals *globals,
+			       struct snapshot *snapshot,
+			       struct snapshot_record *record,
+			       struct timespec *now, uint32_t age,
+			       size_t *num_datasets, size_t *num_payloads)
+{
+	struct dataset *dataset;
+	struct payload *payload, *pooled;
+	const uint8_t *buf;
+	uint8_t *alloc;
+	uint64_t digest;
+
+	/* duplicated record */
+	if (hash_find(globals->data_hash, &record->data))
+		return 0;
+
+	payload = &snapshot->payloads[*num_payloads];
+	payload->digest = be64toh(record->digest);
+	payload->length = ntohl(record->length);
+	payload->zlength = ntohl(record->zlength);
+	payload->flags = PAYLOAD_SNAPSHOT | PAYLOAD_MAPPED;
+	payload->last_read = *now;
+	payload->buf = (uint8_t *)(record + 1);
+
+	/* the digest is the key of the payload pool, a corrupted or stale
+	 * record must not alias the payload of another content */
+	buf = payload_get_data(payload, &alloc);
+	if (!buf)
+		return -1;
+
+	digest = digest64(buf, payload->length);
+	free(alloc);
+
+	if (digest != payload->digest)
+		return -1;
+
+	pooled = payload_adopt(globals, payload);
+	if (!pooled)
+		return 0;
+
+	if (pooled == payload) {
+		(*num_payloads)++;
+		snapshot->refs++;
+	}
+
+	dataset = &snapshot->datasets[*num_datasets];
+	memcpy(&dataset->data, &record->data, sizeof(dataset->data));
+	dataset->data.header.length = 0;
+	dataset->payload = pooled;
+	dataset->data_source = record->data_source;
+	dataset->from_snapshot = 1;
+	dataset->last_seen = *now;
+	dataset->last_seen.tv_sec -= age;
+	dataset->revision = 1;
+	dataset->change_seq = ntohl(record->change_seq);
+	dataset->changed = dataset->last_seen;
+
+	if (dataset_adopt(globals, dataset)) {
+		payload_put(globals, pooled);
+		return 0;
+	}
+
+	(*num_datasets)++;
+	snapshot->refs++;
+
+	return 0;
+}
+
+int snapshot_load_fd(struct globals *globals, int fd)
+{
+	struct snapshot_header *header;
+	struct snapshot_record *record;
+	struct snapshot *snapshot;
+	struct type_policy *policy;
+	struct timespec now, realtime;
+	size_t num_datasets = 0, num_payloads = 0, num_corrupt = 0;
+	size_t count, offset, body_len, length, zlength;
+	int64_t written_age;
+	uint32_t i, age;
+
+	/* only one snapshot can be active */
+	if (globals->snapshot)
+		return -1;
+
+	snapshot = malloc(sizeof(*snapshot));
+	if (!snapshot)
+		return -1;
+
+	memset(snapshot, 0, sizeof(*snapshot));
+	if (snapshot_map(fd, snapshot) < 0) {
+		free(snapshot);
+		return -1;
+	}
+
+	header = snapshot->map;
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != SNAPSHOT_VERSION) {
+		fprintf(stderr, "ignoring snapshot: unknown format\n");
+		munmap(snapshot->map, snapshot->map_len);
+		free(snapshot);
+		return -1;
+	}
+
+	/* every record needs at least its header */
+	count = ntohl(header->count);
+	if (count > (snapshot->map_len - sizeof(*header)) / sizeof(*record))
+		count = (snapshot->map_len - sizeof(*header)) / sizeof(*record);
+
+	snapshot->datasets = calloc(count, sizeof(*snapshot->datasets));
+	snapshot->payloads = calloc(count, sizeof(*snapshot->payloads));
+	if (count && (!snapshot->datasets || !snapshot->payloads)) {
+		free(snapshot->datasets);
+		free(snapshot->payloads);
+		munmap(snapshot->map, snapshot->map_len);
+		free(snapshot);
+		return -1;
+	}
+
+	/* keep the snapshot alive while loading */
+	snapshot->refs = 1;
+	globals->snapshot = snapshot;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	written_age = realtime.tv_sec - (int64_t)be64toh(header->written);
+	if (written_age < 0)
+		written_age = 0;
+
+	offset = sizeof(*header);
+	for (i = 0; i < count; i++) {
+		if (snapshot->map_len - offset < sizeof(*record))
+			break;
+
+		record = (struct snapshot_record *)
+			 ((uint8_t *)snapshot->map + offset);
+		length = ntohl(record->length);
+		zlength = ntohl(record->zlength);
+
+		if ((zlength >= length && zlength != 0) ||
+		    length > ALFRED_MAX_DATASET_SIZE)
+			break;
+
+		body_len = zlength ? zlength : length;
+		if (snapshot->map_len - offset - sizeof(*record) < body_len)
+			break;
+
+		offset += sizeof(*record) + body_len;
+
+		if (record->data_source > SOURCE_SYNCED)
+			continue;
+
+		policy = &globals->policy[record->data.header.type];
+		if (ntohl(record->age) + written_age >= policy->timeout)
+			continue;
+
+		age = ntohl(record->age) + written_age;
+		if (snapshot_add_record(globals, snapshot, record, &now, age,
+					&num_datasets, &num_payloads) < 0)
+			num_corrupt++;
+	}
+
+	printf("loaded %zu datasets from snapshot\n", num_datasets);
+	if (num_corrupt)
+		fprintf(stderr, "ignored %zu corrupted snapshot records\n",
+			num_corrupt);
+
+	/* drop loading reference, releases everything if nothing was used */
+	snapshot_put(globals);
+
+	return 0;
+}
+
+int snapshot_load(struct globals *globals)
+{
+	int fd, ret;
+
+	if (!globals->snapshot_path)
+		return 0;
+
+	fd = open(globals->snapshot_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			perror("can't open snapshot file");
+		return -1;
+	}
+
+	ret = snapshot_load_fd(globals, fd);
+	close(fd);
+
+	return ret;
+}
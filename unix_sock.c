@@ -20,8 +20,10 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -93,12 +95,64 @@ int unix_sock_open_client(struct globals *globals)
 	return 0;
 }
 
+/* read one complete message into buf which has room for size bytes */
+static int unix_sock_read_msg(int client_sock, uint8_t *buf, size_t size)
+{
+	struct alfred_tlv *packet = (struct alfred_tlv *)buf;
+	size_t length;
+
+	if (read_full(client_sock, buf, sizeof(*packet)) < 0)
+		return -1;
+
+	length = ntohs(packet->length);
+	if (length > size - sizeof(*packet))
+		return -1;
+
+	if (read_full(client_sock, buf + sizeof(*packet), length) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int unix_sock_store_data(struct globals *globals,
+				struct alfred_data *data,
+				const uint8_t *buf, uint32_t len)
+{
+	struct dataset *dataset;
+	bool new_entry_created = false;
+
+	if (len > globals->policy[data->header.type].max_size)
+		return -1;
+
+	dataset = hash_find(globals->data_hash, data);
+	if (!dataset) {
+		dataset = dataset_add(globals, data);
+		if (!dataset)
+			return -1;
+
+		new_entry_created = true;
+	}
+
+	if (dataset_set_data(globals, dataset, data->header.version,
+			     buf, len) < 0) {
+		if (new_entry_created)
+			dataset_remove(globals, dataset);
+		return -1;
+	}
+
+	dataset->data_source = SOURCE_LOCAL;
+	dataset_refresh(globals, dataset);
+
+	datastore_enforce_limit(globals);
+
+	return 0;
+}
+
 static int unix_sock_add_data(struct globals *globals,
 			      struct alfred_push_data_v0 *push,
 			      int client_sock)
 {
 	struct alfred_data *data;
-	struct dataset *dataset;
 	int len, data_len, ret = -1;
 	struct interface *interface;
 
@@ -124,41 +178,128 @@ static int unix_sock_add_data(struct globals *globals,
 	if ((int)(data_len + sizeof(*data)) > len)
 		goto err;
 
-	dataset = hash_find(globals->data_hash, data);
-	if (!dataset) {
-		dataset = malloc(sizeof(*dataset));
-		if (!dataset)
+	ret = unix_sock_store_data(globals, data, data->data, data_len);
+err:
+	close(client_sock);
+	return ret;
+}
+
+/* collect the chunks of a dataset sent in order by the client. chunk points
+ * to the first chunk in a buffer of MAX_PAYLOAD bytes which is reused for the
+ * following ones */
+static int unix_sock_add_chunks(struct globals *globals,
+				struct alfred_push_chunk_v0 *chunk,
+				int client_sock)
+{
+	uint32_t offset = 0, total_length;
+	struct interface *interface;
+	struct alfred_data data;
+	uint8_t *buf = NULL;
+	int ret = -1;
+	size_t len;
+
+	interface = netsock_first_interface(globals);
+	if (!interface)
+		goto err;
+
+	total_length = ntohl(chunk->total_length);
+	if (total_length == 0 || total_length > ALFRED_MAX_DATASET_SIZE ||
+	    total_length > globals->policy[chunk->type].max_size)
+		goto err;
+
+	memcpy(data.source, &interface->hwaddr, sizeof(interface->hwaddr));
+	data.header.type = chunk->type;
+	data.header.version = chunk->version;
+	data.header.length = 0;
+
+	buf = malloc(total_length);
+	if (!buf)
+		goto err;
+
+	while (1) {
+		len = ntohs(chunk->header.length);
+		if (len < sizeof(*chunk) - sizeof(chunk->header))
 			goto err;
 
-		dataset->buf = NULL;
+		len -= sizeof(*chunk) - sizeof(chunk->header);
 
-		memcpy(&dataset->data, data, sizeof(*data));
-		if (hash_add(globals->data_hash, dataset)) {
-			free(dataset);
+		if (chunk->type != data.header.type ||
+		    ntohl(chunk->total_length) != total_length ||
+		    ntohl(chunk->offset) != offset ||
+		    len == 0 || len > total_length - offset)
 			goto err;
-		}
-	}
-	dataset->data_source = SOURCE_LOCAL;
-	clock_gettime(CLOCK_MONOTONIC, &dataset->last_seen);
 
-	/* free old buffer */
-	free(dataset->buf);
+		memcpy(buf + offset, chunk->data, len);
+		offset += len;
 
-	dataset->buf = malloc(data_len);
-	/* that's not good */
-	if (!dataset->buf)
-		goto err;
+		if (offset == total_length)
+			break;
 
-	dataset->data.header.length = data_len;
-	dataset->data.header.version = data->header.version;
-	memcpy(dataset->buf, data->data, data_len);
+		if (unix_sock_read_msg(client_sock, (uint8_t *)chunk,
+				       MAX_PAYLOAD) < 0)
+			goto err;
 
-	ret = 0;
+		if (chunk->header.type != ALFRED_PUSH_CHUNK)
+			goto err;
+	}
+
+	ret = unix_sock_store_data(globals, &data, buf, total_length);
 err:
+	free(buf);
 	close(client_sock);
 	return ret;
 }
 
+/* write a dataset too large for a single push packet as chunks */
+static int unix_sock_reply_chunks(struct globals *globals, int client_sock,
+				  uint16_t id, uint16_t *seqno,
+				  struct dataset *dataset)
+{
+	uint8_t buf[MAX_PAYLOAD];
+	struct alfred_push_chunk_v0 *chunk;
+	uint32_t offset, total_length;
+	const uint8_t *plain;
+	uint8_t *alloc;
+	size_t len, chunk_max;
+	int ret = 0;
+
+	plain = dataset_get_data(globals, dataset, true, &alloc);
+	if (!plain)
+		return 0;
+
+	total_length = dataset->payload->length;
+
+	chunk = (struct alfred_push_chunk_v0 *)buf;
+	chunk_max = sizeof(buf) - sizeof(*chunk);
+	chunk->header.type = ALFRED_PUSH_CHUNK;
+	chunk->header.version = ALFRED_VERSION;
+	chunk->tx.id = htons(id);
+	memcpy(chunk->source, dataset->data.source, sizeof(chunk->source));
+	chunk->type = dataset->data.header.type;
+	chunk->version = dataset->data.header.version;
+	chunk->total_length = htonl(total_length);
+
+	for (offset = 0; offset < total_length; offset += len) {
+		len = total_length - offset;
+		if (len > chunk_max)
+			len = chunk_max;
+
+		chunk->header.length = htons(sizeof(*chunk) -
+					     sizeof(chunk->header) + len);
+		chunk->tx.seqno = htons((*seqno)++);
+		chunk->offset = htonl(offset);
+		memcpy(chunk->data, plain + offset, len);
+
+		if (write_full(client_sock, buf, sizeof(*chunk) + len) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(alloc);
+	return ret;
+}
+
 static int unix_sock_req_data_reply(struct globals *globals, int client_sock,
 				    uint16_t id, uint8_t requested_type)
 {
@@ -182,22 +323,32 @@ static int unix_sock_req_data_reply(struct globals *globals, int client_sock,
 		if (dataset->data.header.type != requested_type)
 			continue;
 
-		/* too large? - should never happen */
-		if (dataset->data.header.length + sizeof(*data) >
-		    MAX_PAYLOAD - sizeof(*push))
+		/* too large for a single packet, stream it in chunks */
+		if (dataset->payload->length + sizeof(*data) >
+		    MAX_PAYLOAD - sizeof(*push)) {
+			if (unix_sock_reply_chunks(globals, client_sock, id,
+						   &seqno, dataset) < 0) {
+				ret = -1;
+				hash_iterate_free(hashit);
+				break;
+			}
 			continue;
+		}
 
 		data = push->data;
+		if (dataset_copy_data(globals, dataset, data->data, true))
+			continue;
+
 		memcpy(data, &dataset->data, sizeof(*data));
-		data->header.length = htons(data->header.length);
-		memcpy(data->data, dataset->buf, dataset->data.header.length);
+		data->header.length = htons(dataset->payload->length);
 
-		len = dataset->data.header.length + sizeof(*data);
+		len = dataset->payload->length + sizeof(*data);
 		len += sizeof(*push) - sizeof(push->header);
 		push->header.length = htons(len);
 		push->tx.seqno = htons(seqno++);
 
-		if (write(client_sock, buf, sizeof(push->header) + len) < 0) {
+		if (write_full(client_sock, buf,
+			       sizeof(push->header) + len) < 0) {
 			ret = -1;
 			hash_iterate_free(hashit);
 			break;
@@ -209,19 +360,72 @@ static int unix_sock_req_data_reply(struct globals *globals, int client_sock,
 	return ret;
 }
 
+/* seconds since the datasets of the type were fetched from the master, -1
+ * if they never were */
+static time_t unix_sock_cache_age(struct globals *globals, uint8_t type)
+{
+	struct timespec now, diff;
+
+	if (!globals->type_fetched[type].tv_sec &&
+	    !globals->type_fetched[type].tv_nsec)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time_diff(&now, &globals->type_fetched[type], &diff);
+
+	return diff.tv_sec;
+}
+
+/* a request for the type without client is still pending */
+static bool unix_sock_revalidating(struct globals *globals, uint8_t type)
+{
+	struct hash_it_t *hashit = NULL;
+
+	while (NULL != (hashit = hash_iterate(globals->transaction_hash,
+					      hashit))) {
+		struct transaction_head *head = hashit->bucket->data;
+
+		if (head->request && head->client_socket < 0 &&
+		    head->requested_type == type && head->finished == 0) {
+			hash_iterate_free(hashit);
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static int unix_sock_req_data(struct globals *globals,
 			      struct alfred_request_v0 *request,
 			      int client_sock)
 {
-	int len;
-	uint16_t id;
+	struct alfred_request_freshness_v0 *request_freshness;
+	struct alfred_request_deadline_v0 *request_deadline;
+	uint8_t freshness = ALFRED_FRESHNESS_CACHED;
+	uint8_t type = request->requested_type;
 	struct transaction_head *head = NULL;
 	struct interface *interface;
+	struct server *server;
+	uint32_t deadline = 0;
+	time_t age;
+	uint16_t id;
+	int len;
 
 	len = ntohs(request->header.length);
 
-	if (len != (sizeof(*request) - sizeof(request->header)))
+	if (len == (sizeof(*request_deadline) - sizeof(request->header))) {
+		request_deadline =
+			(struct alfred_request_deadline_v0 *)request;
+		freshness = request_deadline->freshness;
+		deadline = ntohl(request_deadline->deadline);
+	} else if (len == (sizeof(*request_freshness) -
+			   sizeof(request->header))) {
+		request_freshness =
+			(struct alfred_request_freshness_v0 *)request;
+		freshness = request_freshness->freshness;
+	} else if (len != (sizeof(*request) - sizeof(request->header))) {
 		return -1;
+	}
 
 	id = ntohs(request->tx_id);
 
@@ -229,25 +433,121 @@ static int unix_sock_req_data(struct globals *globals,
 
 	/* no server to send the request to, only give back what we have now. */
 	if (!globals->best_server || !interface)
-		return unix_sock_req_data_reply(globals, client_sock, id,
-						request->requested_type);
+		return unix_sock_req_data_reply(globals, client_sock, id, type);
 
 	/* a master already has data to respond with */
 	if (globals->opmode == OPMODE_MASTER)
-		return unix_sock_req_data_reply(globals, client_sock, id,
-						request->requested_type);
+		return unix_sock_req_data_reply(globals, client_sock, id, type);
+
+	/* answer with the datasets fetched for an earlier request when they
+	 * are recent enough for the client */
+	age = unix_sock_cache_age(globals, type);
+	if (globals->cache_age && age >= 0 &&
+	    freshness != ALFRED_FRESHNESS_FRESH) {
+		if (age < globals->cache_age) {
+			globals->cache_hits++;
+			return unix_sock_req_data_reply(globals, client_sock,
+							id, type);
+		}
+
+		/* outdated datasets are fetched again without a client
+		 * waiting for them */
+		if (freshness == ALFRED_FRESHNESS_STALE) {
+			globals->cache_stale_hits++;
+			unix_sock_req_data_reply(globals, client_sock, id,
+						 type);
+			client_sock = -1;
 
-	head = transaction_add(globals, globals->best_server->hwaddr, id);
+			if (unix_sock_revalidating(globals, type))
+				return 0;
+		}
+	}
+
+	server = globals->best_server;
+
+	head = transaction_add(globals, server->hwaddr, id);
 	if (!head)
 		return -1;
 
 	head->client_socket = client_sock;
-	head->requested_type = request->requested_type;
+	head->requested_type = type;
+	head->request = 1;
+	head->deadline = deadline;
 
-	send_alfred_packet(interface, &globals->best_server->address,
-			   request, sizeof(*request));
+	return send_request(globals, interface, server, type, id);
+}
 
-	return 0;
+/* remember how long the client waited for the answer, the last
+ * ALFRED_LATENCY_SAMPLES requests are kept for the stats */
+static void unix_sock_req_latency(struct globals *globals,
+				  struct transaction_head *head)
+{
+	struct timespec now, diff;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time_diff(&now, &head->started, &diff);
+
+	i = globals->requests_answered++ % ALFRED_LATENCY_SAMPLES;
+	globals->request_latency[i] = diff.tv_sec * 1000 +
+				      diff.tv_nsec / 1000000;
+}
+
+/* answer the client of a transaction whose deadline expired with the
+ * datasets stored by now. The transaction continues without client */
+static void unix_sock_req_data_expire(struct globals *globals,
+				      struct transaction_head *head)
+{
+	struct alfred_status_v0 status;
+
+	unix_sock_req_latency(globals, head);
+	globals->requests_expired++;
+
+	status.header.type = ALFRED_STATUS_PARTIAL;
+	status.header.version = ALFRED_VERSION;
+	status.header.length = htons(sizeof(status) - sizeof(status.header));
+	status.tx.id = htons(head->id);
+	status.tx.seqno = 0;
+
+	if (write_full(head->client_socket, &status, sizeof(status)) < 0) {
+		close(head->client_socket);
+		head->client_socket = -1;
+		return;
+	}
+
+	unix_sock_req_data_reply(globals, head->client_socket, head->id,
+				 head->requested_type);
+	head->client_socket = -1;
+}
+
+/* answer the clients whose deadline expired and limit the select timeout
+ * tv to the next deadline */
+void unix_sock_req_deadlines(struct globals *globals, struct timespec *tv)
+{
+	struct hash_it_t *hashit = NULL;
+	struct timespec now, due, diff, rest;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (NULL != (hashit = hash_iterate(globals->transaction_hash,
+					      hashit))) {
+		struct transaction_head *head = hashit->bucket->data;
+
+		if (!head->deadline || head->client_socket < 0)
+			continue;
+
+		due = head->started;
+		time_add_ms(&due, head->deadline);
+
+		if (time_diff(&due, &now, &diff) &&
+		    (diff.tv_sec || diff.tv_nsec)) {
+			if (time_diff(tv, &diff, &rest))
+				*tv = diff;
+			continue;
+		}
+
+		unix_sock_req_data_expire(globals, head);
+	}
 }
 
 int unix_sock_req_data_finish(struct globals *globals,
@@ -265,6 +565,7 @@ int unix_sock_req_data_finish(struct globals *globals,
 	if (head->finished != 1)
 		send_data = 0;
 
+	unix_sock_req_latency(globals, head);
 	free(head);
 
 	if (send_data) {
@@ -344,6 +645,238 @@ err:
 	return ret;
 }
 
+static int
+unix_sock_set_policy(struct globals *globals,
+		     struct alfred_set_policy_v0 *set_policy,
+		     int client_sock)
+{
+	struct type_policy *policy;
+	int len, ret = -1;
+
+	len = ntohs(set_policy->header.length);
+
+	if (len < (int)(sizeof(*set_policy) - sizeof(set_policy->header)))
+		goto err;
+
+	if (ntohl(set_policy->timeout) == 0 ||
+	    ntohl(set_policy->timeout) > INT32_MAX)
+		goto err;
+
+	if (ntohl(set_policy->max_size) > ALFRED_MAX_DATASET_SIZE)
+		goto err;
+
+	policy = &globals->policy[set_policy->type];
+	policy->timeout = ntohl(set_policy->timeout);
+	policy->max_size = ntohl(set_policy->max_size);
+	policy->priority = set_policy->priority;
+	policy->sync = !!set_policy->sync;
+
+	ret = 0;
+err:
+	close(client_sock);
+	return ret;
+}
+
+static int unix_sock_history(struct globals *globals,
+			     struct alfred_history_request_v0 *request,
+			     int client_sock)
+{
+	static const uint8_t any_source[ETH_ALEN];
+	struct hash_it_t *hashit = NULL;
+	int len, ret = -1;
+	uint32_t since;
+
+	len = ntohs(request->header.length);
+
+	if (len < (int)(sizeof(*request) - sizeof(request->header)))
+		goto err;
+
+	since = ntohl(request->since);
+	ret = 0;
+
+	while (NULL != (hashit = hash_iterate(globals->data_hash, hashit))) {
+		struct dataset *dataset = hashit->bucket->data;
+
+		if (dataset->data.header.type != request->type)
+			continue;
+
+		if (memcmp(request->source, any_source, ETH_ALEN) != 0 &&
+		    memcmp(request->source, dataset->data.source,
+			   ETH_ALEN) != 0)
+			continue;
+
+		if (history_reply(globals, dataset, since, client_sock) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+err:
+	close(client_sock);
+	return ret;
+}
+
+static int unix_sock_latency_compare(const void *a, const void *b)
+{
+	uint32_t l1 = *(const uint32_t *)a, l2 = *(const uint32_t *)b;
+
+	return (l1 > l2) - (l1 < l2);
+}
+
+/* percentiles of the recorded request latencies in milliseconds */
+static void unix_sock_latency(struct globals *globals, uint32_t *p50,
+			      uint32_t *p99, uint32_t *max)
+{
+	uint32_t latency[ALFRED_LATENCY_SAMPLES];
+	size_t count = globals->requests_answered;
+
+	*p50 = 0;
+	*p99 = 0;
+	*max = 0;
+
+	if (count > ALFRED_LATENCY_SAMPLES)
+		count = ALFRED_LATENCY_SAMPLES;
+
+	if (!count)
+		return;
+
+	memcpy(latency, globals->request_latency, count * sizeof(*latency));
+	qsort(latency, count, sizeof(*latency), unix_sock_latency_compare);
+
+	*p50 = latency[(count - 1) * 50 / 100];
+	*p99 = latency[(count - 1) * 99 / 100];
+	*max = latency[count - 1];
+}
+
+static int unix_sock_stats(struct globals *globals, int client_sock)
+{
+	struct datastore_account account;
+	struct alfred_stats_v0 *stats;
+	struct type_policy *policy;
+	uint8_t buf[MAX_PAYLOAD];
+	uint32_t latency_p50, latency_p99, latency_max;
+	long max_age, mean_age;
+	size_t len, max_len;
+	int ret = 0;
+	size_t i;
+
+	datastore_account(globals, &account);
+	gossip_staleness(globals, &max_age, &mean_age);
+	unix_sock_latency(globals, &latency_p50, &latency_p99, &latency_max);
+
+	stats = (struct alfred_stats_v0 *)buf;
+	max_len = sizeof(buf) - sizeof(*stats);
+
+	len = snprintf(stats->text, max_len,
+		       "datasets: %zu\n"
+		       "payloads: %zu\n"
+		       "payload bytes: %zu\n"
+		       "memory used: %zu\n"
+		       "memory limit: %zu\n"
+		       "evicted datasets: %"PRIu32"\n"
+		       "deduplicated bytes saved: %zu\n"
+		       "compressed payloads: %zu\n"
+		       "compressed bytes saved: %zu\n"
+		       "uncompressed shared payloads: %zu\n"
+		       "uncompressed shared payload bytes: %zu\n"
+		       "history depth: %u\n"
+		       "history entries: %zu\n"
+		       "history bytes: %zu\n"
+		       "transactions: %d\n"
+		       "transaction memory used: %zu\n"
+		       "transaction memory limit: %zu\n"
+		       "transaction memory limit per peer: %zu\n"
+		       "rejected transactions: %"PRIu32"\n"
+		       "incomplete transactions: %"PRIu32"\n"
+		       "split transactions: %"PRIu32"\n"
+		       "fec rebuilt packets: %"PRIu32"\n"
+		       "nacks sent: %"PRIu32"\n"
+		       "nack retransmitted packets: %"PRIu32"\n"
+		       "full syncs: %"PRIu32"\n"
+		       "delta syncs: %"PRIu32"\n"
+		       "merkle root: %016"PRIx64"\n"
+		       "merkle pushed datasets: %"PRIu32"\n"
+		       "gossip fanout: %u\n"
+		       "gossip rounds: %"PRIu32"\n"
+		       "gossip refreshed datasets: %"PRIu32"\n"
+		       "synced data max age: %ld\n"
+		       "synced data mean age: %ld\n"
+		       "multicast sync rounds: %"PRIu32"\n"
+		       "multicast sync repairs: %"PRIu32"\n"
+		       "refreshed slave datasets: %"PRIu32"\n"
+		       "requested slave datasets: %"PRIu32"\n"
+		       "delta pushed datasets: %"PRIu32"\n"
+		       "delta bytes saved: %"PRIu64"\n"
+		       "delta failed datasets: %"PRIu32"\n"
+		       "compressed sync packets: %"PRIu32"\n"
+		       "compressed sync bytes saved: %"PRIu64"\n"
+		       "unchanged requests: %"PRIu32"\n"
+		       "cache age: %"PRIu32"\n"
+		       "cache hits: %"PRIu32"\n"
+		       "stale cache hits: %"PRIu32"\n"
+		       "hedge delay: %"PRIu32"\n"
+		       "hedged requests: %"PRIu32"\n"
+		       "hedge answered requests: %"PRIu32"\n"
+		       "cancelled hedged requests: %"PRIu32"\n"
+		       "answered requests: %"PRIu32"\n"
+		       "request latency p50: %"PRIu32"\n"
+		       "request latency p99: %"PRIu32"\n"
+		       "request latency max: %"PRIu32"\n"
+		       "expired requests: %"PRIu32"\n",
+		       account.datasets, account.payloads,
+		       account.payload_bytes, account.mem_used,
+		       globals->data_mem_limit, account.evicted,
+		       account.dedup_saved, account.compressed,
+		       account.compress_saved, account.compress_shared,
+		       account.compress_shared_bytes, globals->history_depth,
+		       account.history_entries, account.history_bytes,
+		       globals->transaction_hash->elements,
+		       globals->tx_mem_used, globals->tx_mem_limit,
+		       globals->tx_peer_mem_limit, globals->tx_rejected,
+		       globals->tx_incomplete, globals->tx_split,
+		       globals->fec_rebuilt,
+		       globals->nacks_sent, globals->nack_retransmitted,
+		       globals->full_syncs, globals->delta_syncs,
+		       merkle_root(globals), globals->merkle_pushed,
+		       globals->gossip_fanout, globals->gossip_rounds,
+		       globals->gossip_refreshed, max_age, mean_age,
+		       globals->mcast_round, globals->mcast_repairs,
+		       globals->refreshed, globals->refresh_missing,
+		       globals->delta_pushed, globals->delta_saved,
+		       globals->delta_failed, globals->sync_compressed,
+		       globals->sync_compress_saved,
+		       globals->requests_unchanged, globals->cache_age,
+		       globals->cache_hits, globals->cache_stale_hits,
+		       globals->hedge_delay, globals->hedges_sent,
+		       globals->hedges_won, globals->hedges_cancelled,
+		       globals->requests_answered, latency_p50, latency_p99,
+		       latency_max, globals->requests_expired);
+
+	for (i = 0; i < ARRAY_SIZE(globals->policy) && len < max_len; i++) {
+		policy = &globals->policy[i];
+		if (policy_is_default(policy))
+			continue;
+
+		len += snprintf(stats->text + len, max_len - len,
+				"policy %zu: timeout=%"PRIu32" max_size=%"PRIu32" priority=%u sync=%s\n",
+				i, policy->timeout, policy->max_size,
+				policy->priority, policy->sync ? "yes" : "no");
+	}
+
+	if (len >= max_len)
+		len = max_len - 1;
+
+	stats->header.type = ALFRED_STATS;
+	stats->header.version = ALFRED_VERSION;
+	stats->header.length = htons(len);
+
+	if (write(client_sock, buf, sizeof(*stats) + len) < 0)
+		ret = -1;
+
+	close(client_sock);
+	return ret;
+}
+
 int unix_sock_read(struct globals *globals)
 {
 	int client_sock;
@@ -351,7 +884,8 @@ int unix_sock_read(struct globals *globals)
 	socklen_t sun_size = sizeof(sun_addr);
 	struct alfred_tlv *packet;
 	uint8_t buf[MAX_PAYLOAD];
-	int length, headsize, ret = -1;
+	struct timeval tv;
+	int ret = -1;
 
 	client_sock = accept(globals->unix_sock, (struct sockaddr *)&sun_addr,
 			     &sun_size);
@@ -360,23 +894,20 @@ int unix_sock_read(struct globals *globals)
 		return -1;
 	}
 
-	/* we assume that we can instantly read here. */
-	length = read(client_sock, buf, sizeof(buf));
-	if (length <= 0) {
-		perror("read from unix socket failed");
-		goto err;
-	}
+	/* don't let a stalled client block the daemon */
+	tv.tv_sec = ALFRED_UNIX_TIMEOUT;
+	tv.tv_usec = 0;
+	if (setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		       sizeof(tv)) < 0)
+		perror("can't set unix socket timeout");
 
-	/* drop too small packets */
-	headsize = sizeof(*packet);
-	if (length < headsize)
+	if (unix_sock_read_msg(client_sock, buf, sizeof(buf)) < 0) {
+		fprintf(stderr, "read from unix socket failed\n");
 		goto err;
+	}
 
 	packet = (struct alfred_tlv *)buf;
 
-	if ((length - headsize) < ((int)ntohs(packet->length)))
-		goto err;
-
 	if (packet->version != ALFRED_VERSION)
 		goto err;
 
@@ -386,6 +917,11 @@ int unix_sock_read(struct globals *globals)
 					 (struct alfred_push_data_v0 *)packet,
 					 client_sock);
 		break;
+	case ALFRED_PUSH_CHUNK:
+		ret = unix_sock_add_chunks(globals,
+					   (struct alfred_push_chunk_v0 *)packet,
+					   client_sock);
+		break;
 	case ALFRED_REQUEST:
 		ret = unix_sock_req_data(globals,
 					 (struct alfred_request_v0 *)packet,
@@ -401,6 +937,22 @@ int unix_sock_read(struct globals *globals)
 					     (struct alfred_change_interface_v0 *)packet,
 					     client_sock);
 		break;
+	case ALFRED_STATS:
+		ret = unix_sock_stats(globals, client_sock);
+		break;
+	case ALFRED_SET_POLICY:
+		ret = unix_sock_set_policy(globals,
+					   (struct alfred_set_policy_v0 *)packet,
+					   client_sock);
+		break;
+	case ALFRED_HANDOFF:
+		ret = handoff_send(globals, client_sock);
+		break;
+	case ALFRED_HISTORY:
+		ret = unix_sock_history(globals,
+					(struct alfred_history_request_v0 *)packet,
+					client_sock);
+		break;
 
 	default:
 		/* unknown packet type */
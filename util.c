@@ -19,11 +19,15 @@
  *
  */
 
+#include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 #include "alfred.h"
 
 int time_diff(struct timespec *tv1, struct timespec *tv2,
@@ -39,6 +43,16 @@ int time_diff(struct timespec *tv1, struct timespec *tv2,
 	return (tvdiff->tv_sec >= 0);
 }
 
+void time_add_ms(struct timespec *tv, uint64_t ms)
+{
+	tv->tv_sec += ms / 1000;
+	tv->tv_nsec += (ms % 1000) * 1000000;
+	if (tv->tv_nsec >= 1000000000) {
+		tv->tv_nsec -= 1000000000;
+		tv->tv_sec += 1;
+	}
+}
+
 void time_random_seed(void)
 {
 	struct timespec now;
@@ -60,3 +74,81 @@ uint16_t get_random_id(void)
 {
 	return random();
 }
+
+/* 64 bit FNV-1a */
+uint64_t digest64(const void *buf, size_t len)
+{
+	const uint8_t *c = buf;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= c[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* read exactly len bytes, fails on end of file */
+int read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* grow buf by doubling its size (starting at min_size) until it holds needed
+ * bytes. The new part of the buffer is zeroed */
+int buffer_grow(uint8_t **buf, size_t *size, size_t needed, size_t min_size)
+{
+	size_t new_size = *size ? *size : min_size;
+	uint8_t *new_buf;
+
+	if (needed <= *size)
+		return 0;
+
+	while (new_size < needed)
+		new_size *= 2;
+
+	new_buf = realloc(*buf, new_size);
+	if (!new_buf)
+		return -1;
+
+	memset(new_buf + *size, 0, new_size - *size);
+	*buf = new_buf;
+	*size = new_size;
+
+	return 0;
+}